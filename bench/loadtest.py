@@ -0,0 +1,241 @@
+#!/usr/bin/env python3
+"""Load test against a local RDP server.
+
+Starts the server (FreeRDP's sample server by default), then for each
+concurrency level connects that many sessions from one SessionTemplate
+and measures:
+
+  connects_per_sec   sessions connected per second of wall time
+  first_paint        seconds from start to the first paint, percentiles
+  input_to_paint     seconds from typing to the next paint, percentiles
+  paints_per_sec     paints and dirty pixels per second, all sessions
+  rss_per_session    resident memory added per connected session
+
+Results go out as JSON, one object per level. Example:
+
+  python3 bench/loadtest.py --levels 1,10,100 --output results.json
+"""
+
+import argparse
+import json
+import os
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+import freerdp
+
+
+def log(message):
+    sys.stderr.write(message + "\n")
+    sys.stderr.flush()
+
+
+def rss_bytes():
+    """Resident set size of this process."""
+    with open("/proc/self/statm") as statm:
+        return int(statm.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+
+
+def percentiles(values):
+    """min, p50, p95, p99 and max of `values`, None when empty."""
+    if not values:
+        return None
+    values = sorted(values)
+
+    def at(q):
+        return values[min(len(values) - 1, int(q * len(values)))]
+
+    return {"count": len(values), "min": values[0], "p50": at(0.50), "p95": at(0.95),
+            "p99": at(0.99), "max": values[-1]}
+
+
+def wait_port(host, port, timeout):
+    """Whether something accepts connections on host:port within `timeout`."""
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            socket.create_connection((host, port), 1).close()
+            return True
+        except OSError:
+            time.sleep(0.2)
+    return False
+
+
+def start_server(args):
+    """Run the stand-in server unless one is already listening."""
+    if wait_port(args.host, args.port, 0.5):
+        log("using the server already on {}:{}".format(args.host, args.port))
+        return None
+    log("starting {}".format(args.server))
+    server = subprocess.Popen(args.server, shell=True, cwd=args.server_dir,
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    if not wait_port(args.host, args.port, args.server_timeout):
+        server.kill()
+        raise SystemExit("server did not come up on {}:{}".format(args.host, args.port))
+    return server
+
+
+class Sessions(object):
+    """Connect and disconnect events of one level's sessions."""
+
+    def __init__(self):
+        self.cond = threading.Condition()
+        self.connected = set()
+        self.failed = set()
+
+    def on_event(self, client, event, arg):
+        with self.cond:
+            if event == freerdp.EVENT_CONNECT:
+                self.connected.add(id(client))
+            elif event in (freerdp.EVENT_ERROR, freerdp.EVENT_DISCONNECT) and id(client) not in self.connected:
+                self.failed.add(id(client))
+            else:
+                return
+            self.cond.notify_all()
+
+    def wait(self, count, timeout):
+        deadline = time.monotonic() + timeout
+        with self.cond:
+            while len(self.connected) + len(self.failed) < count:
+                left = deadline - time.monotonic()
+                if left <= 0:
+                    break
+                self.cond.wait(left)
+            return len(self.connected)
+
+
+def probe_input(client, args, latencies, lock):
+    """Type a key and time the next paint, `args.probes` times."""
+    for _ in range(args.probes):
+        frame = client.frame
+        begin = time.monotonic()
+        client.type_text(args.probe_text)
+        changed = client.wait_for_change(timeout=args.input_timeout, since=frame)
+        with lock:
+            latencies.append(time.monotonic() - begin if changed else None)
+
+
+def first_paints(clients):
+    """Seconds to first paint of each client that has painted."""
+    timings = []
+    for client in clients:
+        try:
+            timing = client.connect_timings.get("first_paint")
+        except RuntimeError:
+            continue
+        if timing is not None:
+            timings.append(timing)
+    return timings
+
+
+def run_level(template, count, args):
+    log("level {}: starting".format(count))
+    sessions = Sessions()
+    rss_before = rss_bytes()
+    begin = time.monotonic()
+    clients = freerdp.start_many(template, count, on_event=sessions.on_event)
+    started = [c for c in clients if c is not None]
+    connected = sessions.wait(len(started), args.connect_timeout)
+    connect_time = time.monotonic() - begin
+    live = [c for c in started if id(c) in sessions.connected]
+
+    # first paints may trail the connect by a round trip or two
+    time.sleep(args.settle)
+    first_paint = first_paints(live)
+    rss_after = rss_bytes()
+
+    before = freerdp.metrics()
+    time.sleep(args.window)
+    after = freerdp.metrics()
+    paints = (after["paints"] - before["paints"]) / args.window
+    pixels = (after["dirty_pixels"] - before["dirty_pixels"]) / args.window
+
+    latencies = []
+    lock = threading.Lock()
+    # headless sessions have no frames to time input against
+    probed = [] if args.headless else live[:args.probe_sessions]
+    threads = [threading.Thread(target=probe_input, args=(client, args, latencies, lock)) for client in probed]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    result = {
+        "sessions": count,
+        "started": len(started),
+        "connected": connected,
+        "failed": len(sessions.failed),
+        "connect_seconds": connect_time,
+        "connects_per_sec": connected / connect_time if connect_time > 0 else None,
+        "first_paint": percentiles(first_paint),
+        "input_to_paint": percentiles([l for l in latencies if l is not None]),
+        "input_timeouts": sum(1 for l in latencies if l is None),
+        "paints_per_sec": paints,
+        "dirty_pixels_per_sec": pixels,
+        "rss_per_session": (rss_after - rss_before) / connected if connected else None,
+    }
+
+    # the last reference to each session, the wait below needs them all gone
+    del live, probed, started, clients, threads
+    deadline = time.monotonic() + args.connect_timeout
+    while freerdp.live_sessions() > 0 and time.monotonic() < deadline:
+        time.sleep(0.1)
+    log("level {}: {} of {} connected, {:.1f}/s".format(count, connected, count, result["connects_per_sec"] or 0))
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--levels", default="1,10,100,1000", help="comma separated session counts")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=3389)
+    parser.add_argument("--args", default="/cert-ignore /u:bench /p:bench",
+                        help="extra session arguments, /v: is added")
+    parser.add_argument("--server", default="sfreerdp-server",
+                        help="command starting the stand-in server, run unless one is listening")
+    parser.add_argument("--server-dir", default=None,
+                        help="directory to run the server in, the sample server wants server.crt and server.key")
+    parser.add_argument("--server-timeout", type=float, default=10.0)
+    parser.add_argument("--engine", type=int, default=0,
+                        help="engine workers, 0 for one per core, -1 for a thread per session")
+    parser.add_argument("--headless", action="store_true", help="input-only sessions, no paint figures")
+    parser.add_argument("--connect-timeout", type=float, default=120.0)
+    parser.add_argument("--settle", type=float, default=2.0, help="seconds to wait for first paints")
+    parser.add_argument("--window", type=float, default=5.0, help="seconds to measure paint throughput over")
+    parser.add_argument("--probe-sessions", type=int, default=20, help="sessions to time input on")
+    parser.add_argument("--probes", type=int, default=5, help="keystrokes timed per session")
+    parser.add_argument("--probe-text", default="a")
+    parser.add_argument("--input-timeout", type=float, default=2.0)
+    parser.add_argument("--output", default="-", help="JSON results file, - for stdout")
+    args = parser.parse_args()
+
+    server = start_server(args)
+    try:
+        if args.engine >= 0:
+            freerdp.start_engine(args.engine)
+        template = freerdp.SessionTemplate("/v:{}:{} {}".format(args.host, args.port, args.args),
+                                           headless=args.headless)
+        results = {
+            "host": "{}:{}".format(args.host, args.port),
+            "engine": args.engine,
+            "headless": args.headless,
+            "levels": [run_level(template, int(level), args) for level in args.levels.split(",")],
+        }
+    finally:
+        if server is not None:
+            server.terminate()
+            server.wait()
+
+    text = json.dumps(results, indent=2, sort_keys=True)
+    if args.output == "-":
+        print(text)
+    else:
+        with open(args.output, "w") as output:
+            output.write(text + "\n")
+
+
+if __name__ == "__main__":
+    main()
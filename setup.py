@@ -1,3 +1,4 @@
+import os
 from distutils.core import setup, Extension
 
 setup(name="freerdp", 
@@ -5,8 +6,26 @@ setup(name="freerdp",
       ext_modules=[
                    Extension("freerdp", 
                              sources=["src/freerdp.c", 
+                                      "src/freerdp_clipboard.c",
+                                      "src/freerdp_engine.c",
+                                      "src/freerdp_events.c",
+                                      "src/freerdp_input.c",
+                                      "src/freerdp_match.c",
+                                      "src/freerdp_metrics.c",
+                                      "src/freerdp_pool.c",
+                                      "src/freerdp_rects.c",
+                                      "src/freerdp_record.c",
+                                      "src/freerdp_registry.c",
+                                      "src/freerdp_template.c",
+                                      "src/freerdp_thumbnail.c",
                                       "src/freerdp_py.c",
+                                      "src/freerdp_async_py.c",
+                                      "src/freerdp_template_py.c",
+                                      "src/freerdp_pool_py.c",
+                                      "src/freerdp_macro_py.c",
                                       "src/freerdp_const_py.c"],
+                             # entry point tracing, switched on at runtime by FREERDP_DEBUG
+                             define_macros=[("FAPI_TRACE", None)] if os.environ.get("FREERDP_TRACE") else [],
                              include_dirs=["src",
                                            "sub_modules/FreeRDP/include", 
                                            "sub_modules/FreeRDP/winpr/include"],
@@ -1,13 +1,17 @@
 #ifndef _WIN32
+#include <poll.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #else
 #include <winsock2.h>
 #include <Windows.h>
 #include <ws2tcpip.h>
 #endif
 
+#include <time.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -25,22 +29,11 @@
 #include <winpr/synch.h>
 
 #include "freerdp.h"
+#include "freerdp_session.h"
 
-
-#define MAX_CONNECTIONS 100
 HANDLE g_sem = NULL;
-static int g_thread_count = 0;
-static freerdp* g_instances[MAX_CONNECTIONS] = { NULL };
-
-/**
- * Additional context.
- */
-struct context {
-    rdpContext _p;
-    BOOL shutdown;
-    instance_callback_t onConnect; 
-};
-typedef struct context Context;
+static volatile int g_session_count = 0;
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
 
 /**
  * Instance data for thread.
@@ -53,7 +46,16 @@ struct thread_data {
  * Init context.
  */
 int fapi_context_new(freerdp* instance, rdpContext* context) {
+    Context* ctx = (Context*)context;
+    pthread_condattr_t attr;
     context->channels = freerdp_channels_new();
+    pthread_mutex_init(&ctx->fb_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->fb_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    fapi_input_init(ctx);
+    ctx->sockfd = -1;
     return 0;
 }
 
@@ -61,61 +63,138 @@ int fapi_context_new(freerdp* instance, rdpContext* context) {
  * Deinit context.
  */
 void fapi_context_free(freerdp* instance, rdpContext* context) {
+    Context* ctx = (Context*)context;
+    fapi_input_free(ctx);
+    fapi_clipboard_free(ctx);
+    fapi_record_free(ctx);
+    fapi_thumbnail_free(ctx);
+    pthread_cond_destroy(&ctx->fb_cond);
+    pthread_mutex_destroy(&ctx->fb_lock);
 }
 
 /**
- * Update paint.
+ * Timestamp a connect phase and report it.
+ */
+static void fapi_mark(Context* ctx, int phase) {
+    __atomic_store_n(&ctx->timings[phase], fapi_now(), __ATOMIC_RELEASE);
+    fapi_emit(ctx, EVENT_TIMING, phase);
+}
+
+/**
+ * Record the regions invalidated since BeginPaint as a new frame.
+ */
+static void fapi_record_dirty(Context* ctx, rdpGdi* gdi) {
+    int i;
+    rect_t r;
+    UINT64 area = 0;
+    HGDI_WND hwnd = gdi->primary->hdc->hwnd;
+    struct dirty_frame* entry;
+    struct dirty_frame paint;
+    /* built aside, an empty paint leaves the oldest history slot alone */
+    paint.count = 0;
+    for (i = 0; i < hwnd->ninvalid; i++) {
+        r.x = hwnd->cinvalid[i].x < 0 ? 0 : hwnd->cinvalid[i].x;
+        r.y = hwnd->cinvalid[i].y < 0 ? 0 : hwnd->cinvalid[i].y;
+        r.width = hwnd->cinvalid[i].x + hwnd->cinvalid[i].w - r.x;
+        r.height = hwnd->cinvalid[i].y + hwnd->cinvalid[i].h - r.y;
+        if (r.x + r.width > gdi->width)
+            r.width = gdi->width - r.x;
+        if (r.y + r.height > gdi->height)
+            r.height = gdi->height - r.y;
+        dirty_add(paint.rects, &paint.count, FAPI_DIRTY_RECTS, r);
+    }
+    if (paint.count == 0)
+        return;
+    entry = &ctx->dirty[(ctx->frame + 1) % FAPI_DIRTY_HISTORY];
+    entry->count = paint.count;
+    memcpy(entry->rects, paint.rects, paint.count * sizeof(rect_t));
+    for (i = 0; i < entry->count; i++)
+        area += (UINT64)entry->rects[i].width * entry->rects[i].height;
+    fapi_count(ctx, METRIC_PAINTS, 1);
+    fapi_count(ctx, METRIC_DIRTY_PIXELS, area);
+    fapi_thumbnail_paint(ctx, entry->rects, entry->count);
+    ctx->last_paint = fapi_now();
+    entry->frame = ctx->frame + 1;
+    __atomic_store_n(&ctx->frame, entry->frame, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&ctx->fb_cond);
+    if (entry->frame == 1)
+        fapi_mark(ctx, CONNECT_PHASE_FIRST_PAINT);
+    fapi_emit(ctx, EVENT_FRAME, entry->frame);
+}
+
+/**
+ * Update paint. Holds the framebuffer lock and leaves
+ * the sequence odd until the matching EndPaint.
  */
 void fapi_begin_paint(rdpContext* context) {
+    Context* ctx = (Context*)context;
     rdpGdi* gdi = context->gdi;
+    if (!ctx->painting) {
+        pthread_mutex_lock(&ctx->fb_lock);
+        ctx->painting = TRUE;
+        __atomic_add_fetch(&ctx->fb_seq, 1, __ATOMIC_SEQ_CST);
+    }
     gdi->primary->hdc->hwnd->invalid->null = 1;
+    gdi->primary->hdc->hwnd->ninvalid = 0;
 }
 
 /**
  * Paint updated.
  */
 void fapi_end_paint(rdpContext* context) {
+    Context* ctx = (Context*)context;
     rdpGdi* gdi = context->gdi;
-    if (gdi->primary->hdc->hwnd->invalid->null)
-        return;
+    if (!gdi->primary->hdc->hwnd->invalid->null)
+        fapi_record_dirty(ctx, gdi);
+    if (ctx->painting) {
+        __atomic_add_fetch(&ctx->fb_seq, 1, __ATOMIC_SEQ_CST);
+        ctx->painting = FALSE;
+        pthread_mutex_unlock(&ctx->fb_lock);
+    }
 }
 
 /**
  * Updated channel data.
  */
 int fapi_receive_channel_data(freerdp* instance, int channelId, BYTE* data, int size, int flags, int total_size) {
+    fapi_record_channel((Context*)instance->context, channelId, data, size, flags, total_size);
     return freerdp_channels_data(instance, channelId, data, size, flags, total_size);
 }
 
 /**
- * Clipboard ready.
+ * Channel events.
  */
-void fapi_process_cb_monitor_ready_event(rdpChannels* channels, freerdp* instance) {
+void fapi_process_channel_event(rdpChannels* channels, freerdp* instance) {
     wMessage* event;
-    RDP_CB_FORMAT_LIST_EVENT* format_list_event;
-    event = freerdp_event_new(CliprdrChannel_Class, CliprdrChannel_FormatList, NULL, NULL);
-    format_list_event = (RDP_CB_FORMAT_LIST_EVENT*) event;
-    format_list_event->num_formats = 0;
-    freerdp_channels_send_event(channels, event);
+    Context* context = (Context*)instance->context;
+    while ((event = freerdp_channels_pop_event(channels)) != NULL) {
+        if (!fapi_clipboard_event(context, event))
+            fprintf(stderr, "fapi_process_channel_event: unknown event type %d\n", GetMessageType(event->id));
+        freerdp_event_free(event);
+    }
 }
 
 /**
- * Channel event.
+ * Negotiate the least the server allows to be sent: no orders,
+ * caches or codecs, and the cheapest colour depth and desktop
+ * for whatever arrives before output is suppressed.
  */
-void fapi_process_channel_event(rdpChannels* channels, freerdp* instance) {
-    wMessage* event;
-    event = freerdp_channels_pop_event(channels);
-    if (event) {
-        switch (GetMessageType(event->id)) {
-            case CliprdrChannel_MonitorReady:
-                fapi_process_cb_monitor_ready_event(channels, instance);
-                break;
-            default:
-                fprintf(stderr, "fapi_process_channel_event: unknown event type %d\n", GetMessageType(event->id));
-                break;
-        }
-        freerdp_event_free(event);
-    }
+static void fapi_pre_connect_headless(freerdp* instance) {
+    rdpSettings* settings = instance->settings;
+    ZeroMemory(settings->OrderSupport, 32);
+    settings->BitmapCacheEnabled = FALSE;
+    settings->BitmapCachePersistEnabled = FALSE;
+    settings->OffscreenSupportLevel = 0;
+    settings->GlyphSupportLevel = GLYPH_SUPPORT_NONE;
+    settings->RemoteFxCodec = FALSE;
+    settings->NSCodec = FALSE;
+    settings->SurfaceCommandsEnabled = FALSE;
+    settings->ColorDepth = 8;
+    settings->PerformanceFlags = PERF_DISABLE_WALLPAPER | PERF_DISABLE_FULLWINDOWDRAG |
+        PERF_DISABLE_MENUANIMATIONS | PERF_DISABLE_THEMING | PERF_DISABLE_CURSOR_SHADOW |
+        PERF_DISABLE_CURSORSETTINGS;
+    freerdp_channels_pre_connect(instance->context->channels, instance);
+    fapi_mark((Context*)instance->context, CONNECT_PHASE_PRE_CONNECT);
 }
 
 /**
@@ -124,6 +203,10 @@ void fapi_process_channel_event(rdpChannels* channels, freerdp* instance) {
 BOOL fapi_pre_connect(freerdp* instance) {
     rdpSettings* settings;
     settings = instance->settings;
+    if (((Context*)instance->context)->headless) {
+        fapi_pre_connect_headless(instance);
+        return TRUE;
+    }
     settings->OrderSupport[NEG_DSTBLT_INDEX] = TRUE;
     settings->OrderSupport[NEG_PATBLT_INDEX] = TRUE;
     settings->OrderSupport[NEG_SCRBLT_INDEX] = TRUE;
@@ -146,7 +229,9 @@ BOOL fapi_pre_connect(freerdp* instance) {
     settings->OrderSupport[NEG_POLYGON_CB_INDEX] = TRUE;
     settings->OrderSupport[NEG_ELLIPSE_SC_INDEX] = TRUE;
     settings->OrderSupport[NEG_ELLIPSE_CB_INDEX] = TRUE;
+    fapi_record_pre_connect((Context*)instance->context);
     freerdp_channels_pre_connect(instance->context->channels, instance);
+    fapi_mark((Context*)instance->context, CONNECT_PHASE_PRE_CONNECT);
     return TRUE;
 }
 
@@ -155,92 +240,486 @@ BOOL fapi_pre_connect(freerdp* instance) {
  */
 BOOL fapi_post_connect(freerdp* instance) {
     //rdpGdi* gdi;
-    gdi_init(instance, CLRCONV_ALPHA | CLRCONV_INVERT | CLRBUF_16BPP | CLRBUF_32BPP, NULL);
-    //gdi = instance->context->gdi;
-    instance->update->BeginPaint = fapi_begin_paint;
-    instance->update->EndPaint = fapi_end_paint;
+    Context* context = (Context*)instance->context;
+    fapi_mark(context, CONNECT_PHASE_HANDSHAKE);
+    /* without GDI callbacks updates are parsed and dropped */
+    if (!context->headless) {
+        gdi_init(instance, CLRCONV_ALPHA | CLRCONV_INVERT | CLRBUF_16BPP | CLRBUF_32BPP, NULL);
+        fapi_mark(context, CONNECT_PHASE_GDI_INIT);
+        //gdi = instance->context->gdi;
+        instance->update->BeginPaint = fapi_begin_paint;
+        instance->update->EndPaint = fapi_end_paint;
+        fapi_record_post_connect(context);
+    }
     freerdp_channels_post_connect(instance->context->channels, instance);
     return TRUE;
 }
 
 /**
- * Session thread.
+ * Ask the server to stop or resume sending graphics for `area`, or
+ * the whole desktop, when it advertised Suppress Output support.
+ * Session loop only.
  */
-int fapi_run(freerdp* instance) {
-    int i;
-    int fds;
-    int max_fds;
-    int rcount;
-    int wcount;
-    void* rfds[32];
-    void* wfds[32];
-    fd_set rfds_set;
-    fd_set wfds_set;
-    rdpChannels* channels;
-    ZeroMemory(rfds, sizeof(rfds));
-    ZeroMemory(wfds, sizeof(wfds));
-    channels = instance->context->channels;
-    freerdp_connect(instance);
-    Context* context = ((Context*)(instance->context));
-    context->onConnect(instance);
+static void fapi_suppress_output(Context* ctx, BOOL allow, const RECTANGLE_16* area) {
+    RECTANGLE_16 desktop;
+    rdpSettings* settings = ctx->_p.settings;
+    rdpUpdate* update = ctx->_p.update;
+    if (!settings->SuppressOutput || update->SuppressOutput == NULL)
+        return;
+    desktop.left = 0;
+    desktop.top = 0;
+    desktop.right = settings->DesktopWidth > 0 ? settings->DesktopWidth - 1 : 0;
+    desktop.bottom = settings->DesktopHeight > 0 ? settings->DesktopHeight - 1 : 0;
+    update->SuppressOutput(&ctx->_p, allow ? 1 : 0, allow ? (RECTANGLE_16*)(area != NULL ? area : &desktop) : NULL);
+}
 
-    while (!context->shutdown)
-    {
-        rcount = 0;
-        wcount = 0;
-        if (freerdp_get_fds(instance, rfds, &rcount, wfds, &wcount) != TRUE) {
-            fprintf(stderr, "Failed to get FreeRDP file descriptor\n");
-            break;
-        }
-        if (freerdp_channels_get_fds(channels, instance, rfds, &rcount, wfds, &wcount) != TRUE) {
-            fprintf(stderr, "Failed to get channel manager file descriptor\n");
-            break;
+/**
+ * Bring what the server sends in line with pause/resume requests
+ * and reader activity, setting output_due for the idle check.
+ * Session loop only.
+ */
+static void fapi_output_service(Context* ctx) {
+    BOOL allow;
+    BOOL idle = FALSE;
+    BOOL has_area;
+    RECTANGLE_16 area;
+    UINT64 now;
+    UINT64 last;
+    UINT64 idle_ns = __atomic_load_n(&ctx->idle_suppress, __ATOMIC_RELAXED);
+    unsigned int request = __atomic_load_n(&ctx->output_request, __ATOMIC_ACQUIRE);
+    ctx->output_due = 0;
+    allow = !__atomic_load_n(&ctx->output_paused, __ATOMIC_ACQUIRE);
+    if (allow && idle_ns != 0) {
+        now = fapi_now();
+        last = __atomic_load_n(&ctx->last_read, __ATOMIC_SEQ_CST);
+        if ((INT64)(now - last) >= (INT64)idle_ns && __atomic_load_n(&ctx->readers, __ATOMIC_SEQ_CST) == 0) {
+            /* publish before looking again, fapi_touch does the reverse */
+            __atomic_store_n(&ctx->output_idle, 1, __ATOMIC_SEQ_CST);
+            last = __atomic_load_n(&ctx->last_read, __ATOMIC_SEQ_CST);
+            idle = (INT64)(now - last) >= (INT64)idle_ns && __atomic_load_n(&ctx->readers, __ATOMIC_SEQ_CST) == 0;
         }
+        if (!idle)
+            ctx->output_due = last + idle_ns;
+    }
+    if (!idle)
+        __atomic_store_n(&ctx->output_idle, 0, __ATOMIC_SEQ_CST);
+    allow = allow && !idle;
+    if (allow == ctx->output_allowed && request == ctx->output_applied)
+        return;
+    ctx->output_applied = request;
+    ctx->output_allowed = allow;
+    pthread_mutex_lock(&ctx->lock);
+    has_area = ctx->output_area_set;
+    area = ctx->output_area;
+    pthread_mutex_unlock(&ctx->lock);
+    fapi_suppress_output(ctx, allow, has_area ? &area : NULL);
+}
 
-        max_fds = 0;
-        FD_ZERO(&rfds_set);
-        FD_ZERO(&wfds_set);
+/**
+ * Note a framebuffer reader, waking the loop if output was
+ * suppressed for lack of one.
+ */
+void fapi_touch(Context* ctx) {
+    if (__atomic_load_n(&ctx->idle_suppress, __ATOMIC_RELAXED) == 0)
+        return;
+    __atomic_store_n(&ctx->last_read, fapi_now(), __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctx->output_idle, __ATOMIC_SEQ_CST))
+        fapi_wake(ctx);
+}
 
-        for (i = 0; i < rcount; i++) {
-            fds = (int)(long)(rfds[i]);
-            if (fds > max_fds)
-                max_fds = fds;
-            FD_SET(fds, &rfds_set);
-        }
+/**
+ * Connect and notify.
+ */
+BOOL fapi_connect(freerdp* instance) {
+    Context* context = (Context*)instance->context;
+    fapi_mark(context, CONNECT_PHASE_CONNECTING);
+    if (freerdp_connect(instance) != TRUE) {
+        fprintf(stderr, "fapi_connect: connection failed\n");
+        fapi_emit(context, EVENT_ERROR, SESSION_ERROR_CONNECT);
+        return FALSE;
+    }
+    fapi_connected(context);
+    return TRUE;
+}
 
-        if (max_fds == 0)
-            break;
+/**
+ * Announce a session that is up.
+ */
+void fapi_connected(Context* context) {
+    fapi_mark(context, CONNECT_PHASE_CONNECTED);
+    /* idle time counts from here, output state is applied on the loop */
+    __atomic_store_n(&context->last_read, fapi_now(), __ATOMIC_SEQ_CST);
+    fapi_emit(context, EVENT_CONNECT, 0);
+    if (context->onConnect != NULL)
+        context->onConnect(context->session);
+    if (context->pool != NULL)
+        fapi_pool_connected(context);
+}
 
-        struct timeval timeout; timeout.tv_sec=1; timeout.tv_usec=0;
-        BOOL timeoutBreak = FALSE;
-        if (select(max_fds + 1, &rfds_set, &wfds_set, NULL, &timeout) == -1) {
-            if (errno == ETIMEDOUT) { timeoutBreak = TRUE; }
-            /* these are not really errors */ 
-            else if (!((errno == EAGAIN) ||
-	             (errno == EWOULDBLOCK) ||
-		     (errno == EINPROGRESS) ||
-                     (errno == EINTR))) /* signal occurred */
-	    {
-                fprintf(stderr, "fapi_run: select failed\n");
-                break;
-            }
+/**
+ * Whether a dropped connection can be restored with the auto-reconnect
+ * cookie the server handed out at logon. Not after a server-side
+ * disconnect or once the session is stopping.
+ */
+BOOL fapi_can_reconnect(Context* ctx) {
+    rdpSettings* settings = ctx->_p.settings;
+    return !ctx->shutdown && settings->AutoReconnectionEnabled &&
+        settings->ServerAutoReconnectCookie != NULL && settings->ServerAutoReconnectCookie->cbLen != 0 &&
+        !freerdp_shall_disconnect(ctx->_p.instance);
+}
+
+/**
+ * Time between reconnect attempts.
+ */
+#define FAPI_RECONNECT_GAP 1000000000ULL
+
+/**
+ * One attempt to restore a dropped connection. Blocks like
+ * fapi_connect, the descriptors change. While AutoReconnectMaxRetries
+ * allows another attempt a failure leaves `reconnecting` set, with
+ * the next one due at `reconnect_at`; the caller waits for it without
+ * holding anything up.
+ */
+BOOL fapi_reconnect(freerdp* instance) {
+    Context* context = (Context*)instance->context;
+    UINT32 retries = instance->settings->AutoReconnectMaxRetries;
+    context->reconnecting = TRUE;
+    if (!context->shutdown) {
+        context->reconnect_attempt++;
+        if (freerdp_reconnect(instance) == TRUE) {
+            /* kernel counters start over with the new socket */
+            ZeroMemory(context->tcp_seen, sizeof(context->tcp_seen));
+            context->reconnecting = FALSE;
+            fapi_emit(context, EVENT_RECONNECT, context->reconnect_attempt);
+            context->reconnect_attempt = 0;
+            return TRUE;
         }
+        if (context->reconnect_attempt < (retries > 0 ? retries : 1) && !context->shutdown) {
+            context->reconnect_at = fapi_now() + FAPI_RECONNECT_GAP;
+            return FALSE;
+        }
+    }
+    context->reconnecting = FALSE;
+    context->reconnect_attempt = 0;
+    return FALSE;
+}
 
-        if (!timeoutBreak && !((Context*)(instance->context))->shutdown) {
-            if (freerdp_check_fds(instance) != TRUE) {
-                fprintf(stderr, "Failed to check FreeRDP file descriptor\n");
-                break;
-            }
-            if (freerdp_channels_check_fds(channels, instance) != TRUE) {
-                fprintf(stderr, "Failed to check channel manager file descriptor\n");
-                break;
-            }
-            fapi_process_channel_event(channels, instance);
+/**
+ * Sleep on the session's wake descriptor until `due`, back early
+ * for stop(). Wakes that come in meanwhile are passed on to the
+ * loop once it watches the descriptor again.
+ */
+static void fapi_wait_until(Context* ctx, UINT64 due) {
+    UINT64 now;
+    UINT64 count;
+    BOOL woken = FALSE;
+    struct pollfd pfd;
+    pfd.fd = ctx->wakefd;
+    pfd.events = POLLIN;
+    while (!ctx->shutdown && (now = fapi_now()) < due) {
+        if (poll(&pfd, 1, (int)((due - now + 999999) / 1000000)) > 0 &&
+                read(ctx->wakefd, &count, sizeof(count)) > 0)
+            woken = TRUE;
+    }
+    if (woken)
+        fapi_wake(ctx);
+}
+
+/**
+ * Register FreeRDP and channel file descriptors.
+ */
+BOOL fapi_watch_fds(int epfd, Context* ctx) {
+    int i;
+    int rcount = 0;
+    int wcount = 0;
+    void* rfds[FAPI_MAX_FDS];
+    void* wfds[FAPI_MAX_FDS];
+    struct epoll_event event;
+    freerdp* instance = ctx->_p.instance;
+    ZeroMemory(rfds, sizeof(rfds));
+    ZeroMemory(wfds, sizeof(wfds));
+    if (freerdp_get_fds(instance, rfds, &rcount, wfds, &wcount) != TRUE) {
+        fprintf(stderr, "Failed to get FreeRDP file descriptor\n");
+        return FALSE;
+    }
+    if (freerdp_channels_get_fds(ctx->_p.channels, instance, rfds, &rcount, wfds, &wcount) != TRUE) {
+        fprintf(stderr, "Failed to get channel manager file descriptor\n");
+        return FALSE;
+    }
+    if (rcount == 0)
+        return FALSE;
+
+    ctx->nfds = 0;
+    /* the transport reports its socket first */
+    ctx->sockfd = (int)(long)(rfds[0]);
+    ctx->net_watch.ctx = ctx;
+    ctx->net_watch.kind = FAPI_EV_NET;
+    ZeroMemory(&event, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &ctx->net_watch;
+    for (i = 0; i < rcount; i++) {
+        ctx->fds[ctx->nfds] = (int)(long)(rfds[i]);
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctx->fds[ctx->nfds], &event) == -1) {
+            /* same descriptor reported twice */
+            if (errno == EEXIST)
+                continue;
+            fprintf(stderr, "fapi_watch_fds: epoll_ctl failed (%d)\n", errno);
+            fapi_unwatch_fds(epfd, ctx);
+            return FALSE;
         }
+        ctx->nfds++;
+    }
+    ctx->wake_watch.ctx = ctx;
+    ctx->wake_watch.kind = FAPI_EV_WAKE;
+    event.data.ptr = &ctx->wake_watch;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctx->wakefd, &event) == -1) {
+        fprintf(stderr, "fapi_watch_fds: epoll_ctl failed (%d)\n", errno);
+        fapi_unwatch_fds(epfd, ctx);
+        return FALSE;
     }
+    ctx->timer_watch.ctx = ctx;
+    ctx->timer_watch.kind = FAPI_EV_TIMER;
+    event.data.ptr = &ctx->timer_watch;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctx->timerfd, &event) == -1) {
+        fprintf(stderr, "fapi_watch_fds: epoll_ctl failed (%d)\n", errno);
+        fapi_unwatch_fds(epfd, ctx);
+        return FALSE;
+    }
+    /* input may have been queued while connecting */
+    fapi_wake(ctx);
+    return TRUE;
+}
+
+/**
+ * Remove the session from an epoll set.
+ */
+void fapi_unwatch_fds(int epfd, Context* ctx) {
+    int i;
+    for (i = 0; i < ctx->nfds; i++)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, ctx->fds[i], NULL);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, ctx->wakefd, NULL);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, ctx->timerfd, NULL);
+    ctx->nfds = 0;
+}
+
+/**
+ * Answer a health probe if the connection is still up.
+ */
+static void fapi_probe_service(Context* ctx) {
+    unsigned int request = __atomic_load_n(&ctx->probe_request, __ATOMIC_ACQUIRE);
+    if (request != ctx->probe_done && !freerdp_shall_disconnect(ctx->_p.instance) && fapi_tcp_alive(ctx))
+        __atomic_store_n(&ctx->probe_done, request, __ATOMIC_RELEASE);
+}
+
+/**
+ * Process a session whose descriptors fired.
+ * Returns FALSE once the session should close.
+ */
+BOOL fapi_dispatch(Context* ctx, int ready) {
+    UINT64 count;
+    UINT64 begin;
+    BOOL status;
+    freerdp* instance = ctx->_p.instance;
+    fapi_count(ctx, METRIC_WAKEUPS, 1);
+    if (ready & FAPI_EV_WAKE) {
+        while (read(ctx->wakefd, &count, sizeof(count)) > 0)
+            ;
+    }
+    if (ready & FAPI_EV_TIMER) {
+        if (read(ctx->timerfd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            fprintf(stderr, "fapi_dispatch: timerfd read failed (%d)\n", errno);
+    }
+    if (ctx->shutdown)
+        return FALSE;
+    if (ready & FAPI_EV_WAKE)
+        fapi_probe_service(ctx);
+    if (ready & (FAPI_EV_WAKE | FAPI_EV_TIMER)) {
+        fapi_input_service(ctx);
+        fapi_output_service(ctx);
+        fapi_arm_timer(ctx);
+    }
+    if (!(ready & FAPI_EV_NET))
+        return TRUE;
+    begin = fapi_now();
+    status = freerdp_check_fds(instance);
+    fapi_observe(ctx, METRIC_CHECK_FDS, fapi_now() - begin);
+    fapi_sample_tcp(ctx);
+    if (status != TRUE) {
+        fprintf(stderr, "Failed to check FreeRDP file descriptor\n");
+        fapi_emit(ctx, EVENT_ERROR, SESSION_ERROR_TRANSPORT);
+        return FALSE;
+    }
+    if (freerdp_channels_check_fds(ctx->_p.channels, instance) != TRUE) {
+        fprintf(stderr, "Failed to check channel manager file descriptor\n");
+        fapi_emit(ctx, EVENT_ERROR, SESSION_ERROR_TRANSPORT);
+        return FALSE;
+    }
+    fapi_process_channel_event(ctx->_p.channels, instance);
+    /* a paint may be the echo paced input or a macro waits for */
+    if ((ctx->echo_wait && ctx->frame != ctx->echo_frame) ||
+            (ctx->macro_wait && ctx->frame != ctx->macro_frame)) {
+        fapi_input_service(ctx);
+        fapi_arm_timer(ctx);
+    }
+    return TRUE;
+}
+
+/**
+ * Wake the loop driving the session.
+ */
+void fapi_wake(Context* ctx) {
+    UINT64 one = 1;
+    if (write(ctx->wakefd, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "fapi_wake: eventfd write failed (%d)\n", errno);
+}
+
+/**
+ * Monotonic clock in nanoseconds.
+ */
+UINT64 fapi_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UINT64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Arm the session timer for the earlier of the input and idle
+ * deadlines, or disarm it when there is neither.
+ */
+void fapi_arm_timer(Context* ctx) {
+    UINT64 due = ctx->current != NULL ? ctx->input_due : 0;
+    if (ctx->output_due != 0 && (due == 0 || ctx->output_due < due))
+        due = ctx->output_due;
+    fapi_schedule(ctx, due);
+}
+
+/**
+ * Arm the session timer for an absolute monotonic time, 0 disarms it.
+ */
+void fapi_schedule(Context* ctx, UINT64 due) {
+    struct itimerspec spec;
+    ZeroMemory(&spec, sizeof(spec));
+    spec.it_value.tv_sec = due / 1000000000ULL;
+    spec.it_value.tv_nsec = due % 1000000000ULL;
+    if (timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+        fprintf(stderr, "fapi_schedule: timerfd_settime failed (%d)\n", errno);
+}
+
+/**
+ * Disconnect once.
+ */
+static void fapi_disconnect(freerdp* instance) {
+    Context* context = (Context*)instance->context;
+    if (context->disconnected)
+        return;
+    context->disconnected = TRUE;
+    freerdp_disconnect(instance);
+}
+
+/**
+ * Tear down a finished session.
+ */
+void fapi_close(freerdp* instance) {
+    Context* context = (Context*)instance->context;
+    rdpChannels* channels = instance->context->channels;
+    if (context->pool != NULL)
+        fapi_pool_closed(context);
+    /* final byte counts before the socket goes */
+    context->sampled = 0;
+    fapi_sample_tcp(context);
+    context->sockfd = -1;
+    fapi_disconnect(instance);
+    if (!context->painting)
+        pthread_mutex_lock(&context->fb_lock);
+    else
+        __atomic_add_fetch(&context->fb_seq, 1, __ATOMIC_SEQ_CST);
+    context->painting = FALSE;
+    context->closed = TRUE;
+    pthread_cond_broadcast(&context->fb_cond);
+    pthread_mutex_unlock(&context->fb_lock);
+    /* input waiters give up once the session is gone */
+    pthread_mutex_lock(&context->lock);
+    pthread_cond_broadcast(&context->cond);
+    pthread_mutex_unlock(&context->lock);
     freerdp_channels_close(channels, instance);
     freerdp_channels_free(channels);
+    instance->context->channels = NULL;
+    fapi_emit(context, EVENT_DISCONNECT, 0);
+    if (__atomic_sub_fetch(&g_session_count, 1, __ATOMIC_ACQ_REL) == 0)
+        ReleaseSemaphore(g_sem, 1, NULL);
+    fapi_release(context);
+}
+
+/**
+ * Drop a reference, the last one frees the session.
+ * The run loop and the caller of start() each hold one.
+ */
+void fapi_release(Context* ctx) {
+    freerdp* instance = ctx->_p.instance;
+    if (__atomic_sub_fetch(&ctx->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    close(ctx->wakefd);
+    close(ctx->timerfd);
+    if (instance->context->gdi != NULL)
+        gdi_free(instance);
+    freerdp_context_free(instance);
     freerdp_free(instance);
+}
+
+/**
+ * Session thread, sleeps in its own epoll set until the
+ * connection, the wake eventfd or the input timer has work.
+ */
+int fapi_run(freerdp* instance) {
+    int i;
+    int epfd;
+    int count;
+    int ready;
+    BOOL up;
+    struct epoll_event events[FAPI_MAX_FDS + 2];
+    Context* context = ((Context*)(instance->context));
+    if (!fapi_connect(instance)) {
+        fapi_close(instance);
+        return 0;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        fprintf(stderr, "fapi_run: epoll_create failed (%d)\n", errno);
+        fapi_close(instance);
+        return 0;
+    }
+    if (!fapi_watch_fds(epfd, context)) {
+        close(epfd);
+        fapi_close(instance);
+        return 0;
+    }
+
+    while (!context->shutdown)
+    {
+        count = epoll_wait(epfd, events, FAPI_MAX_FDS + 2, -1);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "fapi_run: epoll_wait failed (%d)\n", errno);
+            break;
+        }
+        ready = 0;
+        for (i = 0; i < count; i++)
+            ready |= ((struct watch*)events[i].data.ptr)->kind;
+        if (fapi_dispatch(context, ready))
+            continue;
+        if (!fapi_can_reconnect(context))
+            break;
+        fapi_unwatch_fds(epfd, context);
+        while (!(up = fapi_reconnect(instance)) && context->reconnecting)
+            fapi_wait_until(context, context->reconnect_at);
+        if (!up || !fapi_watch_fds(epfd, context))
+            break;
+    }
+    fapi_unwatch_fds(epfd, context);
+    close(epfd);
+    fapi_close(instance);
     return 0;
 }
 
@@ -251,161 +730,481 @@ void* thread_func(void* param)
 {
     struct thread_data* data;
     data = (struct thread_data*) param;
-    fapi_run(data->instance);
+    if (((Context*)data->instance->context)->replay != NULL)
+        fapi_replay_run(data->instance);
+    else
+        fapi_run(data->instance);
     free(data);
     pthread_detach(pthread_self());
-    g_thread_count--;
-    if (g_thread_count < 1)
-        ReleaseSemaphore(g_sem, 1, NULL);
     return NULL;
 }
 
 /**
- * Stop instance and remove tracking.
+ * Ask the session's loop to shut down.
  */
-void internal_stop(void* instance, int index) {
-    g_instances[index] = NULL;
-    ((Context*)(((freerdp*)instance)->context))->shutdown = TRUE;
-    freerdp_disconnect((freerdp*)instance);
+void fapi_stop(Context* ctx) {
+    ctx->shutdown = TRUE;
+    fapi_wake(ctx);
+    /* a reconnect waiting for its next attempt sits with the connectors */
+    if (ctx->reconnecting && ctx->worker != NULL)
+        engine_kick();
 }
 
 /**
  * Stop instance and disconnect.
  */
-void stop(void* instance) {
-    int index;
-    for (index=0; index<MAX_CONNECTIONS; ++index) {
-        if (g_instances[index] == instance) {
-            internal_stop(g_instances[index], index);
-            break;
-        }
+void stop(session_t session) {
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return;
+    fapi_stop(context);
+    fapi_release(context);
+}
+
+/**
+ * Record an output request for the session loop.
+ */
+static void fapi_request_output(session_t session, BOOL paused, const rect_t* rect) {
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return;
+    pthread_mutex_lock(&context->lock);
+    context->output_area_set = rect != NULL;
+    if (rect != NULL) {
+        context->output_area.left = rect->x < 0 ? 0 : rect->x;
+        context->output_area.top = rect->y < 0 ? 0 : rect->y;
+        context->output_area.right = rect->x + rect->width > 0 ? rect->x + rect->width - 1 : 0;
+        context->output_area.bottom = rect->y + rect->height > 0 ? rect->y + rect->height - 1 : 0;
     }
+    pthread_mutex_unlock(&context->lock);
+    __atomic_store_n(&context->output_paused, paused, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&context->output_request, 1, __ATOMIC_ACQ_REL);
+    fapi_wake(context);
+    fapi_release(context);
+}
+
+void pause_updates(session_t session) {
+    fapi_request_output(session, TRUE, NULL);
+}
+
+void resume_updates(session_t session, const rect_t* rect) {
+    fapi_request_output(session, FALSE, rect);
+}
+
+void set_idle_suppress(session_t session, int ms_idle) {
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return;
+    __atomic_store_n(&context->last_read, fapi_now(), __ATOMIC_SEQ_CST);
+    __atomic_store_n(&context->idle_suppress, ms_idle > 0 ? (UINT64)ms_idle * 1000000 : 0, __ATOMIC_RELAXED);
+    fapi_wake(context);
+    fapi_release(context);
 }
 
 /**
- * Wrap key presses.
- */
-void press_keys(void* void_instance, int count, DWORD* codes) {
-    freerdp* instance = (freerdp*)void_instance;
-    int index;
-    for (index=0; index<count; ++index) {
-        freerdp_input_send_keyboard_event_ex(instance->input, TRUE, codes[index]); usleep(100);
-    }
-    for (index=count-1; index>=0; --index) {
-        freerdp_input_send_keyboard_event_ex(instance->input, FALSE, codes[index]); usleep(100);
-    }
-}
-
-/**
- * Run a command string.
- */
-void run_command(void* void_instance, char* command) {
-    freerdp* instance = (freerdp*)void_instance;
-    freerdp_input_send_keyboard_event_ex(instance->input, TRUE, RDP_SCANCODE_LWIN); usleep(100);
-    freerdp_input_send_keyboard_event_ex(instance->input, TRUE, RDP_SCANCODE_KEY_R); usleep(100);
-    freerdp_input_send_keyboard_event_ex(instance->input, FALSE, RDP_SCANCODE_LWIN); usleep(100);
-    freerdp_input_send_keyboard_event_ex(instance->input, FALSE, RDP_SCANCODE_KEY_R); usleep(100);
-
-    char * raw;
-    char val;
-    DWORD code;
-    BOOL isUpper;
-    for (raw=command; *raw != '\0'; ++raw) {
-        code = 0;
-        usleep(100000);
-        isUpper = (*raw >= 'A' && *raw <= 'Z');
-        val = isUpper ? tolower(*raw) : *raw;
-        if (val=='a')      { code = RDP_SCANCODE_KEY_A; }
-        else if (val=='b') { code = RDP_SCANCODE_KEY_B; }
-        else if (val=='c') { code = RDP_SCANCODE_KEY_C; }
-        else if (val=='d') { code = RDP_SCANCODE_KEY_D; }
-        else if (val=='e') { code = RDP_SCANCODE_KEY_E; }
-        else if (val=='f') { code = RDP_SCANCODE_KEY_F; }
-        else if (val=='g') { code = RDP_SCANCODE_KEY_G; }
-        else if (val=='h') { code = RDP_SCANCODE_KEY_H; }
-        else if (val=='i') { code = RDP_SCANCODE_KEY_I; }
-        else if (val=='j') { code = RDP_SCANCODE_KEY_J; }
-        else if (val=='k') { code = RDP_SCANCODE_KEY_K; }
-        else if (val=='l') { code = RDP_SCANCODE_KEY_L; }
-        else if (val=='m') { code = RDP_SCANCODE_KEY_M; }
-        else if (val=='n') { code = RDP_SCANCODE_KEY_N; }
-        else if (val=='o') { code = RDP_SCANCODE_KEY_O; }
-        else if (val=='p') { code = RDP_SCANCODE_KEY_P; }
-        else if (val=='q') { code = RDP_SCANCODE_KEY_Q; }
-        else if (val=='r') { code = RDP_SCANCODE_KEY_R; }
-        else if (val=='s') { code = RDP_SCANCODE_KEY_S; }
-        else if (val=='t') { code = RDP_SCANCODE_KEY_T; }
-        else if (val=='u') { code = RDP_SCANCODE_KEY_U; }
-        else if (val=='v') { code = RDP_SCANCODE_KEY_V; }
-        else if (val=='w') { code = RDP_SCANCODE_KEY_W; }
-        else if (val=='x') { code = RDP_SCANCODE_KEY_X; }
-        else if (val=='y') { code = RDP_SCANCODE_KEY_Y; }
-        else if (val=='z') { code = RDP_SCANCODE_KEY_Z; }
-        else if (val=='1') { code = RDP_SCANCODE_KEY_1; }
-        else if (val=='2') { code = RDP_SCANCODE_KEY_2; }
-        else if (val=='3') { code = RDP_SCANCODE_KEY_3; }
-        else if (val=='4') { code = RDP_SCANCODE_KEY_4; }
-        else if (val=='5') { code = RDP_SCANCODE_KEY_5; }
-        else if (val=='6') { code = RDP_SCANCODE_KEY_6; }
-        else if (val=='7') { code = RDP_SCANCODE_KEY_7; }
-        else if (val=='8') { code = RDP_SCANCODE_KEY_8; }
-        else if (val=='9') { code = RDP_SCANCODE_KEY_9; }
-        else if (val=='0') { code = RDP_SCANCODE_KEY_0; }
-        else if (val=='-') { code = RDP_SCANCODE_OEM_MINUS; }
-        else if (val=='+') { code = RDP_SCANCODE_OEM_PLUS; }
-        else if (val=='[') { code = RDP_SCANCODE_OEM_4; }
-        else if (val==']') { code = RDP_SCANCODE_OEM_6; }
-        else if (val==';') { code = RDP_SCANCODE_OEM_1; }
-        else if (val=='\'') { code = RDP_SCANCODE_OEM_7; }
-        else if (val=='/') { code = RDP_SCANCODE_OEM_2; }
-        else if (val=='\\'){ code = RDP_SCANCODE_OEM_102; }
-        else if (val=='*'){ code = RDP_SCANCODE_MULTIPLY; }
-        else if (val==' '){ code = RDP_SCANCODE_SPACE; }
-        else if (val=='.') { code = RDP_SCANCODE_OEM_PERIOD; }
-        else if (val==',') { code = RDP_SCANCODE_OEM_COMMA; }
-        if (code != 0) {
-            if (isUpper) {
-                freerdp_input_send_keyboard_event_ex(instance->input, TRUE, RDP_SCANCODE_LSHIFT);
-                usleep(100);
-            }
-            freerdp_input_send_keyboard_event_ex(instance->input, TRUE, code); usleep(100);
-            freerdp_input_send_keyboard_event_ex(instance->input, FALSE, code); usleep(100);
-            if (isUpper) {
-                freerdp_input_send_keyboard_event_ex(instance->input, FALSE, RDP_SCANCODE_LSHIFT);
-                usleep(100);
+ * Drop the caller's hold on a session, its handle goes stale.
+ */
+void release(session_t session) {
+    Context* context = registry_remove(session);
+    if (context == NULL)
+        return;
+    /* the loop cannot close while the caller still holds the framebuffer */
+    if (fapi_fb_held(context)) {
+        __atomic_store_n(&context->fb_held, FALSE, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&context->fb_lock);
+    }
+    fapi_stop(context);
+    fapi_release(context);
+}
+
+/**
+ * Current framebuffer, zero until the session has connected.
+ */
+static int fapi_framebuffer(Context* context, framebuffer_t* fb) {
+    rdpGdi* gdi = context->_p.gdi;
+    if (gdi == NULL || gdi->primary_buffer == NULL)
+        return 0;
+    fb->data = gdi->primary_buffer;
+    fb->width = gdi->width;
+    fb->height = gdi->height;
+    fb->bpp = gdi->dstBpp;
+    fb->stride = gdi->width * ((gdi->dstBpp + 7) / 8);
+    return 1;
+}
+
+int get_framebuffer(session_t session, framebuffer_t* fb) {
+    int status;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    fapi_touch(context);
+    status = fapi_framebuffer(context, fb);
+    fapi_release(context);
+    return status;
+}
+
+/**
+ * Paint sequence, odd while a paint is in progress.
+ */
+unsigned int framebuffer_sequence(session_t session) {
+    unsigned int seq;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    seq = __atomic_load_n(&context->fb_seq, __ATOMIC_SEQ_CST);
+    fapi_release(context);
+    return seq;
+}
+
+BOOL fapi_fb_held(Context* ctx) {
+    pthread_t owner;
+    if (!__atomic_load_n(&ctx->fb_held, __ATOMIC_ACQUIRE))
+        return FALSE;
+    __atomic_load(&ctx->fb_owner, &owner, __ATOMIC_RELAXED);
+    return pthread_equal(owner, pthread_self());
+}
+
+/**
+ * Even paint sequence to check an unlocked read against, blocks on
+ * fb_lock while a paint holds it. A lock_framebuffer() holder keeps
+ * the sequence even, so never gets here with the lock taken.
+ */
+unsigned int fapi_read_begin(Context* ctx) {
+    unsigned int seq;
+    while ((seq = __atomic_load_n(&ctx->fb_seq, __ATOMIC_ACQUIRE)) & 1) {
+        pthread_mutex_lock(&ctx->fb_lock);
+        pthread_mutex_unlock(&ctx->fb_lock);
+    }
+    return seq;
+}
+
+BOOL fapi_read_retry(Context* ctx, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&ctx->fb_seq, __ATOMIC_RELAXED) != seq;
+}
+
+/**
+ * Block painting while the caller reads the framebuffer.
+ * Refuses a second lock from the thread holding it.
+ */
+int lock_framebuffer(session_t session) {
+    pthread_t self = pthread_self();
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    if (fapi_fb_held(context)) {
+        fapi_release(context);
+        return 0;
+    }
+    fapi_touch(context);
+    pthread_mutex_lock(&context->fb_lock);
+    __atomic_store(&context->fb_owner, &self, __ATOMIC_RELAXED);
+    __atomic_store_n(&context->fb_held, TRUE, __ATOMIC_RELEASE);
+    fapi_release(context);
+    return 1;
+}
+
+/**
+ * Let painting resume, a no-op unless the calling thread holds the lock.
+ */
+void unlock_framebuffer(session_t session) {
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return;
+    if (fapi_fb_held(context)) {
+        __atomic_store_n(&context->fb_held, FALSE, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&context->fb_lock);
+    }
+    fapi_release(context);
+}
+
+/**
+ * Last frame number.
+ */
+unsigned int current_frame(session_t session) {
+    unsigned int frame;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    frame = __atomic_load_n(&context->frame, __ATOMIC_ACQUIRE);
+    fapi_release(context);
+    return frame;
+}
+
+/**
+ * Connect phase timestamps.
+ */
+int connect_timings(session_t session, unsigned long long* stamps) {
+    int phase;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    for (phase = 0; phase < CONNECT_PHASES; ++phase)
+        stamps[phase] = __atomic_load_n(&context->timings[phase], __ATOMIC_ACQUIRE);
+    fapi_release(context);
+    return 1;
+}
+
+/**
+ * Collect frames after `since` into one coalesced list. Unlocked,
+ * so it also works for a lock_framebuffer() holder.
+ */
+static int fapi_dirty_regions(Context* context, unsigned int since, rect_t* rects, int max, unsigned int* frame) {
+    int i;
+    int count;
+    unsigned int seq;
+    unsigned int index;
+    struct dirty_frame* entry;
+    rdpGdi* gdi = context->_p.gdi;
+    do {
+        seq = fapi_read_begin(context);
+        count = 0;
+        *frame = context->frame;
+        if (since > *frame || *frame - since > FAPI_DIRTY_HISTORY) {
+            if (gdi != NULL && max > 0) {
+                rects[0].x = 0;
+                rects[0].y = 0;
+                rects[0].width = gdi->width;
+                rects[0].height = gdi->height;
+                count = 1;
             }
         } else {
-            if (val=='$') {
-                DWORD dollarKeys[2] = {RDP_SCANCODE_LSHIFT, RDP_SCANCODE_KEY_4};
-                press_keys(instance, 2, dollarKeys);
-            } else if (val=='_') {
-                DWORD underscoreKeys[2] = {RDP_SCANCODE_LSHIFT, RDP_SCANCODE_OEM_MINUS};
-                press_keys(instance, 2, underscoreKeys);
-            } else {
-                fprintf(stderr, "Unknown val %c", val);
-                return;
+            for (index = since + 1; index <= *frame; index++) {
+                entry = &context->dirty[index % FAPI_DIRTY_HISTORY];
+                for (i = 0; i < entry->count && i < FAPI_DIRTY_RECTS; i++)
+                    dirty_add(rects, &count, max, entry->rects[i]);
             }
         }
+    } while (fapi_read_retry(context, seq));
+    return count;
+}
+
+int dirty_regions(session_t session, unsigned int since, rect_t* rects, int max, unsigned int* frame) {
+    int count;
+    Context* context = registry_get(session);
+    *frame = 0;
+    if (context == NULL)
+        return 0;
+    fapi_touch(context);
+    count = fapi_dirty_regions(context, since, rects, max, frame);
+    fapi_release(context);
+    return count;
+}
+
+/**
+ * Whether a frame after `since` touched `rect`. Needs fb_lock.
+ */
+static BOOL fapi_changed(Context* ctx, unsigned int since, const rect_t* rect) {
+    int i;
+    unsigned int index;
+    const rect_t* r;
+    struct dirty_frame* entry;
+    if (ctx->frame == since)
+        return FALSE;
+    if (rect == NULL || since > ctx->frame || ctx->frame - since > FAPI_DIRTY_HISTORY)
+        return TRUE;
+    for (index = since + 1; index <= ctx->frame; index++) {
+        entry = &ctx->dirty[index % FAPI_DIRTY_HISTORY];
+        for (i = 0; i < entry->count; i++) {
+            r = &entry->rects[i];
+            if (r->x < rect->x + rect->width && rect->x < r->x + r->width &&
+                    r->y < rect->y + rect->height && rect->y < r->y + r->height)
+                return TRUE;
+        }
     }
-    freerdp_input_send_keyboard_event_ex(instance->input, TRUE, RDP_SCANCODE_RETURN); usleep(100);
-    freerdp_input_send_keyboard_event_ex(instance->input, FALSE, RDP_SCANCODE_RETURN);
+    return FALSE;
 }
 
 /**
- * Connect and start session.
+ * fapi_changed as an unlocked read checked against the paint sequence.
  */
-void* start(int argc, char* argv[], instance_callback_t onConnect) {
-    if (g_sem == NULL) {
-        g_sem = CreateSemaphore(NULL, 0, 1, NULL);
-        freerdp_channels_global_init();
+BOOL fapi_screen_changed(Context* ctx, unsigned int since, const rect_t* rect) {
+    BOOL changed;
+    unsigned int seq;
+    do {
+        seq = fapi_read_begin(ctx);
+        changed = fapi_changed(ctx, since, rect);
+    } while (fapi_read_retry(ctx, seq));
+    return changed;
+}
+
+/**
+ * Sleep on the paint condition until a matching change.
+ * Polls and lock_framebuffer() holders only get the answer at hand.
+ */
+int wait_for_change(session_t session, unsigned int since, const rect_t* rect, int ms_timeout) {
+    int status = 0;
+    struct timespec deadline;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    /* a blocked waiter keeps output flowing */
+    __atomic_add_fetch(&context->readers, 1, __ATOMIC_SEQ_CST);
+    fapi_touch(context);
+    if (ms_timeout == 0 || fapi_fb_held(context)) {
+        /* no paint can come while the caller holds the lock */
+        if (fapi_screen_changed(context, since, rect))
+            status = 1;
+        else if (ms_timeout != 0 && !__atomic_load_n(&context->closed, __ATOMIC_ACQUIRE))
+            status = -1;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += ms_timeout / 1000;
+        deadline.tv_nsec += (long)(ms_timeout % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&context->fb_lock);
+        for (;;) {
+            if (fapi_changed(context, since, rect)) {
+                status = 1;
+                break;
+            }
+            if (context->closed)
+                break;
+            if (ms_timeout < 0)
+                pthread_cond_wait(&context->fb_cond, &context->fb_lock);
+            else if (pthread_cond_timedwait(&context->fb_cond, &context->fb_lock, &deadline) == ETIMEDOUT) {
+                status = fapi_changed(context, since, rect) ? 1 : 0;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&context->fb_lock);
+    }
+    __atomic_sub_fetch(&context->readers, 1, __ATOMIC_SEQ_CST);
+    fapi_touch(context);
+    fapi_release(context);
+    return status;
+}
+
+/**
+ * Template search over the framebuffer without holding off paints.
+ * A search a paint overlapped is repeated, the last try under fb_lock.
+ */
+int fapi_find_image(Context* context, const unsigned char* pixels, int width, int height,
+                    const rect_t* region, const unsigned int* since, double threshold, match_t* match) {
+    int i;
+    int count = 1;
+    int attempt;
+    BOOL locked;
+    unsigned int seq = 0;
+    unsigned int frame;
+    unsigned long limit;
+    unsigned long best_sad;
+    rect_t bounds;
+    rect_t area;
+    rect_t rects[FAPI_DIRTY_RECTS * 4];
+    framebuffer_t fb;
+    if (width <= 0 || height <= 0 || !fapi_framebuffer(context, &fb) || fb.bpp != 32)
+        return 0;
+    bounds.x = 0;
+    bounds.y = 0;
+    bounds.width = fb.width;
+    bounds.height = fb.height;
+    if (region != NULL) {
+        area = *region;
+        if (!rect_clip(&area, &bounds))
+            return 0;
+        bounds = area;
+    }
+    if (since != NULL) {
+        count = fapi_dirty_regions(context, *since, rects, FAPI_DIRTY_RECTS * 4, &frame);
+        for (i = 0; i < count; i++) {
+            /* positions whose window overlaps the dirty rectangle */
+            rects[i].x -= width - 1;
+            rects[i].y -= height - 1;
+            rects[i].width += width - 1;
+            rects[i].height += height - 1;
+        }
+    } else {
+        rects[0] = bounds;
+    }
+
+    limit = (unsigned long)(threshold * width * height * 765.0);
+    for (attempt = 0;; attempt++) {
+        /* a lock_framebuffer() holder sees no paints, its first try stands */
+        locked = attempt == FAPI_SEARCH_RETRIES && !fapi_fb_held(context);
+        if (locked)
+            pthread_mutex_lock(&context->fb_lock);
+        else
+            seq = fapi_read_begin(context);
+        match->x = -1;
+        match->y = -1;
+        best_sad = limit;
+        for (i = 0; i < count; i++) {
+            area = rects[i];
+            if (!rect_clip(&area, &bounds))
+                continue;
+            /* keep the whole template inside the search bounds */
+            if (area.x + area.width > bounds.x + bounds.width - width + 1)
+                area.width = bounds.x + bounds.width - width + 1 - area.x;
+            if (area.y + area.height > bounds.y + bounds.height - height + 1)
+                area.height = bounds.y + bounds.height - height + 1 - area.y;
+            if (area.width <= 0 || area.height <= 0)
+                continue;
+            match_search(fb.data, fb.stride, pixels, width, height, area, &best_sad, match);
+            if (match->x >= 0 && best_sad == 0)
+                break;
+        }
+        if (locked) {
+            pthread_mutex_unlock(&context->fb_lock);
+            break;
+        }
+        if (!fapi_read_retry(context, seq))
+            break;
     }
-    if (g_thread_count+1 >= MAX_CONNECTIONS) { return NULL; }
-    
+    if (match->x < 0)
+        return 0;
+    match->score = (double)best_sad / ((double)width * height * 765.0);
+    return 1;
+}
+
+int find_image(session_t session, const unsigned char* pixels, int width, int height,
+               const rect_t* region, const unsigned int* since, double threshold, match_t* match) {
     int status;
-    pthread_t thread;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    fapi_touch(context);
+    status = fapi_find_image(context, pixels, width, height, region, since, threshold, match);
+    fapi_release(context);
+    return status;
+}
+
+/**
+ * Process-wide setup, once.
+ */
+static void fapi_global_init(void) {
+    g_sem = CreateSemaphore(NULL, 0, 1, NULL);
+    freerdp_channels_global_init();
+}
+
+/**
+ * Free a session that never started.
+ */
+void fapi_discard(freerdp* instance) {
+    Context* context = (Context*)instance->context;
+    freerdp_channels_free(instance->context->channels);
+    instance->context->channels = NULL;
+    context->refs = 1;
+    fapi_release(context);
+}
+
+/**
+ * Connect and start session.
+ */
+session_t start(int argc, char* argv[], instance_callback_t onConnect) {
+    return start_with(argc, argv, onConnect, NULL);
+}
+
+/**
+ * New session instance with its options applied, arguments not yet set.
+ */
+freerdp* fapi_instance_new(instance_callback_t onConnect, const session_options_t* options) {
+    pthread_once(&g_init_once, fapi_global_init);
+
     freerdp* instance;
-    //rdpChannels* channels;
-    struct thread_data* data;
     instance = freerdp_new();
     instance->PreConnect = fapi_pre_connect;
     instance->PostConnect = fapi_post_connect;
@@ -418,58 +1217,107 @@ void* start(int argc, char* argv[], instance_callback_t onConnect) {
     context = (Context*)instance->context;
     context->shutdown = FALSE;
     context->onConnect = onConnect;
-    //channels = instance->context->channels;
-    status = freerdp_client_parse_command_line_arguments(argc, argv, instance->settings);
-    if (status < 0) {
-        fprintf(stderr, "Bad start arguments");
-        return NULL;
-    }
+    context->headless = options != NULL && (options->flags & SESSION_HEADLESS) != 0;
+    /* the server sends output until told otherwise */
+    context->output_allowed = TRUE;
+    context->output_paused = context->headless;
+    if (options != NULL && options->idle_suppress_ms > 0)
+        context->idle_suppress = (UINT64)options->idle_suppress_ms * 1000000;
+    if (options != NULL && options->record != NULL)
+        context->record_path = strdup(options->record);
+    context->refs = 2;
+    context->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    context->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    instance->settings->RedirectClipboard = TRUE;
+    return instance;
+}
+
+/**
+ * Load channels, register and run a configured instance.
+ * Frees it and returns 0 on failure.
+ */
+session_t fapi_launch(freerdp* instance) {
+    session_t session;
+    pthread_t thread;
+    struct thread_data* data;
+    Context* context = (Context*)instance->context;
     freerdp_client_load_addins(instance->context->channels, instance->settings);
+    session = registry_add(context);
+    if (session == 0) {
+        fprintf(stderr, "start: session table full\n");
+        fapi_discard(instance);
+        return 0;
+    }
+    __atomic_add_fetch(&g_session_count, 1, __ATOMIC_ACQ_REL);
+    fapi_mark(context, CONNECT_PHASE_QUEUED);
+    /* replays have no descriptors to multiplex */
+    if (engine_running() && context->replay == NULL) {
+        engine_submit(instance);
+        return session;
+    }
     data = (struct thread_data*) malloc(sizeof(struct thread_data));
-    ZeroMemory(data, sizeof(sizeof(struct thread_data)));
+    ZeroMemory(data, sizeof(struct thread_data));
     data->instance = instance;
-    g_thread_count++;
-    int index;
-    for (index=0; index<MAX_CONNECTIONS; ++index) {
-        if (g_instances[index] == NULL) {
-            g_instances[index] = instance;
-            break;
-        }
-    }
     pthread_create(&thread, 0, thread_func, data);
-    return instance;
+    return session;
+}
+
+/**
+ * Connect and start session with options.
+ */
+session_t start_with(int argc, char* argv[], instance_callback_t onConnect, const session_options_t* options) {
+    int status;
+    freerdp* instance;
+    instance = fapi_instance_new(onConnect, options);
+    status = freerdp_client_parse_command_line_arguments(argc, argv, instance->settings);
+    if (status < 0) {
+        fprintf(stderr, "Bad start arguments");
+        fapi_discard(instance);
+        return 0;
+    }
+    return fapi_launch(instance);
+}
+
+/**
+ * Sessions started and not yet closed.
+ */
+int live_sessions(void) {
+    return __atomic_load_n(&g_session_count, __ATOMIC_ACQUIRE);
 }
 
 /**
  * Stop all sessions.
  */
 void destroy (int ms_timeout) {
-    if (g_thread_count == 0) { return; }
-    int index;
-    for (index=0; index<MAX_CONNECTIONS; ++index) {
-        if (g_instances[index] != NULL) {
-            internal_stop(g_instances[index], index);
-        }
-    }
+    if (live_sessions() == 0) { engine_stop(); return; }
+    registry_stop_all();
     int timeout = ms_timeout == 0 ? INFINITE : ms_timeout;
-    WaitForSingleObject(g_sem, timeout);
-    freerdp_channels_global_uninit();
-    g_thread_count = 0;
+    /* the semaphore may still be signalled from an earlier drain */
+    while (live_sessions() > 0) {
+        if (WaitForSingleObject(g_sem, timeout) != WAIT_OBJECT_0)
+            break;
+    }
+    /* the engine still owns sessions that are closing, a later
+       destroy() stops it; channel globals are set up once per
+       process and stay for sessions started after this */
+    if (live_sessions() == 0)
+        engine_stop();
 }
 
-void test_onConnect(void* instance) {
+void test_onConnect(session_t session) {
     fprintf(stderr, "Connected!\n");
 }
 
 int main(int argc, char* argv[])
 {
-    void * instance = start(argc, argv, test_onConnect);
-    while (g_thread_count > 0)
+    session_t instance = start(argc, argv, test_onConnect);
+    while (live_sessions() > 0)
     {
             WaitForSingleObject(g_sem, 10000);
             //run_command(instance, "calc");
             fprintf(stderr, "shutting down");
             stop(instance);
+            release(instance);
             destroy(0);
     }
     return 0;
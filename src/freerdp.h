@@ -1,32 +1,563 @@
+#ifndef FREERDP_PY_H
+#define FREERDP_PY_H
+
 typedef unsigned long DWORD;
 
 /**
- * Callback with instance pointer and no arguments.
+ * Session handle. Handles of released sessions are rejected,
+ * 0 is never a valid handle.
+ */
+typedef unsigned long long session_t;
+
+/**
+ * Callback with session handle and no arguments.
+ */
+typedef void (*instance_callback_t)(session_t session);
+
+/**
+ * Screen rectangle in pixels.
+ */
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} rect_t;
+
+/**
+ * Pointer position.
+ */
+typedef struct {
+    int x;
+    int y;
+} point_t;
+
+/**
+ * Template match position and normalized score,
+ * 0 for identical pixels up to 1.
+ */
+typedef struct {
+    int x;
+    int y;
+    double score;
+} match_t;
+
+/**
+ * Session events. FRAME carries the newest frame number, INPUT
+ * the newest input ticket sent, CLIPBOARD whether the server now
+ * offers text, ERROR one of the SESSION_ERROR codes, TIMING the
+ * CONNECT_PHASE just reached, RECONNECT the attempt that restored
+ * a dropped connection.
+ */
+#define EVENT_CONNECT    1
+#define EVENT_DISCONNECT 2
+#define EVENT_FRAME      3
+#define EVENT_CLIPBOARD  4
+#define EVENT_ERROR      5
+#define EVENT_INPUT      6
+#define EVENT_TIMING     7
+#define EVENT_RECONNECT  8
+
+#define SESSION_ERROR_CONNECT   1
+#define SESSION_ERROR_TRANSPORT 2
+
+/**
+ * Connect phases, in order. HANDSHAKE covers TCP, security
+ * negotiation, licensing and capability exchange, which
+ * freerdp_connect runs without a callback in between.
+ */
+#define CONNECT_PHASE_QUEUED      0
+#define CONNECT_PHASE_CONNECTING  1
+#define CONNECT_PHASE_PRE_CONNECT 2
+#define CONNECT_PHASE_HANDSHAKE   3
+#define CONNECT_PHASE_GDI_INIT    4
+#define CONNECT_PHASE_CONNECTED   5
+#define CONNECT_PHASE_FIRST_PAINT 6
+#define CONNECT_PHASES            7
+
+typedef struct {
+    session_t session;
+    int type;
+    unsigned int arg;
+} event_t;
+
+/**
+ * Runtime counters. Bytes and segments come from the kernel's
+ * TCP_INFO for the session socket; PDUS_OUT counts input PDUs.
+ * Input queue depth is SUBMITTED - SENT - DROPPED. ECHO_TIMEOUTS
+ * counts paced input that went on without a paint echo,
+ * MOUSE_COALESCED pointer moves replaced by a later one unsent.
+ */
+#define METRIC_BYTES_IN        0
+#define METRIC_BYTES_OUT       1
+#define METRIC_SEGMENTS_IN     2
+#define METRIC_SEGMENTS_OUT    3
+#define METRIC_PDUS_OUT        4
+#define METRIC_PAINTS          5
+#define METRIC_DIRTY_PIXELS    6
+#define METRIC_WAKEUPS         7
+#define METRIC_INPUT_SUBMITTED 8
+#define METRIC_INPUT_SENT      9
+#define METRIC_INPUT_DROPPED   10
+#define METRIC_ECHO_TIMEOUTS   11
+#define METRIC_MOUSE_COALESCED 12
+#define METRIC_COUNTERS        13
+
+/**
+ * Latency histograms, in nanoseconds: time in freerdp_check_fds
+ * per wakeup, and from queueing input to its last event sent.
+ */
+#define METRIC_CHECK_FDS       0
+#define METRIC_INPUT_LATENCY   1
+#define METRIC_HISTOGRAMS      2
+
+/**
+ * Bucket i counts values below 2^i ns, the last one everything else.
+ */
+#define METRIC_BUCKETS 32
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long buckets[METRIC_BUCKETS];
+} histogram_t;
+
+typedef struct {
+    unsigned long long counters[METRIC_COUNTERS];
+    histogram_t histograms[METRIC_HISTOGRAMS];
+} metrics_t;
+
+/**
+ * Decoded desktop, owned by the session.
  */
-typedef void (*instance_callback_t)(void* instance);
+typedef struct {
+    unsigned char* data;
+    int width;
+    int height;
+    int stride;
+    int bpp;
+} framebuffer_t;
+
+/**
+ * Box-filtered copy of the desktop, 32bpp like the framebuffer,
+ * and a 64-bit average hash of its luminance on an 8x8 grid.
+ */
+typedef struct {
+    unsigned char* data;
+    int width;
+    int height;
+    int stride;
+    const unsigned long long* hash;
+} thumbnail_t;
+
+/**
+ * Session flags. HEADLESS sessions only send input: they negotiate
+ * no drawing orders or caches, allocate no framebuffer and ask the
+ * server to suppress output once connected.
+ */
+#define SESSION_HEADLESS 0x1
+
+/**
+ * Session options, `idle_suppress_ms` as for set_idle_suppress().
+ * `record` is a file to record the session's display updates and
+ * channel data to for replay(), NULL for none.
+ */
+typedef struct {
+    unsigned int flags;
+    int idle_suppress_ms;
+    const char* record;
+} session_options_t;
 
 /**
  * Start a session with the given command line arguments.
+ * Returns 0 on failure.
+ */
+session_t start(int argc, char* argv[], instance_callback_t onConnect);
+
+/**
+ * start() with options, NULL for the defaults.
+ */
+session_t start_with(int argc, char* argv[], instance_callback_t onConnect, const session_options_t* options);
+
+/**
+ * Replay flags. REALTIME keeps the recorded pace instead of
+ * playing as fast as the session can paint.
+ */
+#define REPLAY_REALTIME 0x1
+
+/**
+ * Play a recording back in a new session with no network: its
+ * updates go through the same decode and paint path as a live
+ * session's. The session connects, paints and disconnects at the
+ * end of the file; input is not sent anywhere. Returns 0 if the
+ * file is not a recording.
+ */
+session_t replay(const char* path, int flags, instance_callback_t onConnect);
+
+/**
+ * Arguments parsed once for many sessions. Read-only once
+ * created, so sessions can be started from it on any thread.
+ */
+typedef struct session_template session_template_t;
+
+/**
+ * Per-session changes to a template, NULL or 0 keeps its value.
+ */
+typedef struct {
+    const char* host;
+    unsigned int port;
+    const char* username;
+    const char* password;
+    const char* domain;
+} session_override_t;
+
+/**
+ * Parse arguments into a template, NULL if they are bad. Each
+ * session gets a copy of every parsed setting.
+ */
+session_template_t* template_new(int argc, char* argv[], const session_options_t* options);
+void template_free(session_template_t* tpl);
+
+/**
+ * start() from a template, `override` may be NULL.
+ */
+session_t start_from(session_template_t* tpl, const session_override_t* override, instance_callback_t onConnect);
+
+/**
+ * Start `count` sessions, one per override or all alike for NULL
+ * overrides. `sessions` gets each handle, 0 where a start failed.
+ * Returns how many started.
+ */
+int start_many(session_template_t* tpl, const session_override_t* overrides, int count,
+               instance_callback_t onConnect, session_t* sessions);
+
+/**
+ * Pre-connected sessions from one template. The pool keeps `size`
+ * sessions connected and idle, with output paused, and checks them
+ * every `ms_health` from their own loops, 0 for never. Its sessions
+ * restore dropped connections with the server's auto-reconnect
+ * cookie. The template must outlive the pool.
+ */
+typedef struct session_pool session_pool_t;
+
+session_pool_t* pool_new(session_template_t* tpl, int size, int ms_health);
+
+/**
+ * Take an idle session, waiting up to `ms_timeout` for one, -1 for
+ * ever. Returns 0 on timeout or once the pool is freed.
+ */
+session_t pool_acquire(session_pool_t* pool, int ms_timeout);
+
+/**
+ * Hand an acquired session back, to be reused when `reuse` is set
+ * and it is still connected, else it is stopped and released.
+ */
+void pool_release(session_pool_t* pool, session_t session, int reuse);
+
+/**
+ * Sessions idle, still connecting and handed out.
+ */
+void pool_counts(session_pool_t* pool, int* idle, int* starting, int* busy);
+
+/**
+ * Stop the idle sessions and free the pool, once every acquired
+ * session was handed back.
+ */
+void pool_free(session_pool_t* pool);
+
+/**
+ * Run a command in the session. Input is queued and paced on the
+ * session's own loop, the returned ticket is 0 on failure.
+ */
+unsigned int run_command(session_t session, char* command);
+
+/**
+ * Type UTF-8 text, waiting `gap` microseconds before each character.
+ * US layout scancodes are used where they exist, Unicode keyboard
+ * events otherwise. Returns a ticket like run_command().
+ */
+unsigned int type_text(session_t session, const char* text, unsigned int gap);
+
+/**
+ * Offer UTF-8 text on the session clipboard as CF_UNICODETEXT, in
+ * turn with queued input so earlier pastes keep their text.
+ * Returns a ticket like run_command().
+ */
+unsigned int set_clipboard(session_t session, const char* text);
+
+/**
+ * Fetch the server's clipboard text, waiting up to `ms_timeout`
+ * (forever if negative). Returns a malloc'd UTF-8 string or NULL.
  */
-void* start(int argc, char* argv[], instance_callback_t onConnect);
+char* get_clipboard(session_t session, int ms_timeout);
 
 /**
- * Run a command in the session.
+ * Paste text with Ctrl+V, or run a command by pasting it into Win+R.
+ * Long text costs one clipboard round trip instead of a key per
+ * character. Return tickets like run_command().
  */
-void run_command(void* instance, char* command);
+unsigned int paste_text(session_t session, const char* text);
+unsigned int paste_command(session_t session, const char* command);
 
 /**
  * Press key combinations. Expects RDP scancodes from freerdp/scancode.h
+ * Returns a ticket like run_command().
+ */
+unsigned int press_keys(session_t session, int count, DWORD* codes);
+
+/**
+ * Mouse input, buttons numbered 1 left, 2 right, 3 middle. Moves
+ * queued back to back are coalesced: only the last one before the
+ * session's loop sends anything else or waits goes out.
+ *
+ * click() presses `count` times at x, y. drag() holds `button` from
+ * the first point to the second over `steps` moves `ms_interval`
+ * apart. scroll() turns the wheel `clicks` notches, up when positive.
+ * mouse_path() moves through `count` points `ms_interval` apart,
+ * all but the last coalesced when that is 0.
+ * Return tickets like run_command().
+ */
+unsigned int move_mouse(session_t session, int x, int y);
+unsigned int click(session_t session, int x, int y, int button, int count);
+unsigned int drag(session_t session, int x0, int y0, int x1, int y1, int button, int steps, int ms_interval);
+unsigned int scroll(session_t session, int x, int y, int clicks);
+unsigned int mouse_path(session_t session, int count, const point_t* points, int ms_interval);
+
+/**
+ * Input pacing. FIXED waits the full delay typing calls ask for
+ * after each character. ECHO goes on as soon as the screen paints
+ * in answer and then stays quiet for `ms_quiet`, backing off when
+ * echoes lag; the fixed delay is the longest it waits.
+ */
+#define INPUT_PACING_FIXED 0
+#define INPUT_PACING_ECHO  1
+
+void set_input_pacing(session_t session, int pacing, int ms_quiet);
+
+/**
+ * Block until input up to `ticket` has been sent, ticket 0 meaning
+ * everything queued so far. A negative timeout waits forever.
+ * Returns 1 when sent, 0 on timeout or when the session closes.
+ */
+int wait_input(session_t session, unsigned int ticket, int ms_timeout);
+
+/**
+ * Macro opcodes. A program is a string of steps, each an opcode
+ * byte followed by little-endian operands:
+ *
+ *   KEY_DOWN, KEY_UP      u16 scancode, 0x100 set if extended
+ *   TEXT                  u32 gap in microseconds, u32 length, UTF-8
+ *   MOVE                  u16 x, u16 y
+ *   BUTTON_DOWN, _UP      u8 button 1-3, u16 x, u16 y
+ *   CLICK                 u8 button 1-3, u16 x, u16 y
+ *   DELAY                 u32 milliseconds
+ *   WAIT_CHANGE           i32 x, y, width, height, u32 timeout ms
+ *   WAIT_IMAGE            u16 width, u16 height, u32 threshold in
+ *                         millionths, i32 x, y, width, height,
+ *                         u32 timeout ms, width * height BGRA pixels
+ *
+ * A zero width or height waits anywhere on the screen.
+ */
+#define MACRO_KEY_DOWN    1
+#define MACRO_KEY_UP      2
+#define MACRO_TEXT        3
+#define MACRO_MOVE        4
+#define MACRO_BUTTON_DOWN 5
+#define MACRO_BUTTON_UP   6
+#define MACRO_CLICK       7
+#define MACRO_DELAY       8
+#define MACRO_WAIT_CHANGE 9
+#define MACRO_WAIT_IMAGE  10
+
+/**
+ * How a macro ended. A wait that times out, or a wait in a session
+ * without a framebuffer, ends the program early.
+ */
+#define MACRO_DONE      0
+#define MACRO_TIMEOUT   1
+#define MACRO_NO_SCREEN 2
+
+/**
+ * Outcome of a macro: its end status, the step it ended on (the
+ * step count when done) and where the last WAIT_IMAGE matched,
+ * -1 when none did.
  */
-void press_keys(void* void_instance, int count, DWORD* codes);
+typedef struct {
+    int status;
+    int step;
+    int x;
+    int y;
+} macro_result_t;
+
+/**
+ * Queue a macro program, run step by step on the session's own
+ * loop. Returns a ticket like run_command(), 0 for a malformed
+ * program.
+ */
+unsigned int submit_macro(session_t session, const unsigned char* program, int length);
+
+/**
+ * Result of a finished macro, 0 when unknown or not finished yet.
+ * The last 16 results are kept.
+ */
+int macro_result(session_t session, unsigned int ticket, macro_result_t* result);
+
+/**
+ * Ask the server to stop sending graphics, or to resume them for
+ * `rect` (the whole desktop when NULL). Servers that do not support
+ * Suppress Output keep sending.
+ */
+void pause_updates(session_t session);
+void resume_updates(session_t session, const rect_t* rect);
+
+/**
+ * Suppress output once the framebuffer API has not been used for
+ * `ms_idle` milliseconds, resuming on the next use. 0 disables it.
+ */
+void set_idle_suppress(session_t session, int ms_idle);
 
 /**
  * Stop the session and disconnect.
  */
-void stop(void* instance);
+void stop(session_t session);
+
+/**
+ * Release the caller's reference once done with a session, stopping
+ * it if still running. The handle is invalid afterwards.
+ */
+void release(session_t session);
+
+/**
+ * Fill in the session framebuffer. Returns 0 before connect.
+ * The pixels stay valid until release().
+ */
+int get_framebuffer(session_t session, framebuffer_t* fb);
+
+/**
+ * Paint sequence number, odd while the session is painting.
+ * A read is consistent if the number was even and unchanged
+ * before and after it.
+ */
+unsigned int framebuffer_sequence(session_t session);
+
+/**
+ * Keep a thumbnail of the desktop at 1/scale its size, scale 4, 8
+ * or 16, refiltered only where paints land. Returns 0 before connect,
+ * for non-32bpp desktops or when already enabled at another scale.
+ * Both calls also work inside lock_framebuffer().
+ */
+int enable_thumbnail(session_t session, int scale);
+
+/**
+ * Fill in the thumbnail, 0 unless enabled. Pixels and hash change
+ * under the framebuffer sequence and stay valid until release().
+ */
+int get_thumbnail(session_t session, thumbnail_t* thumb);
+
+/**
+ * Hold off painting while reading the framebuffer. This stalls the
+ * session's loop, in engine mode every session on its worker, and
+ * closing the session waits for the unlock. Returns 0 when the
+ * calling thread already holds the lock. dirty_regions() and
+ * find_image() stay usable meanwhile, wait_for_change() only checks.
+ */
+int lock_framebuffer(session_t session);
+void unlock_framebuffer(session_t session);
+
+/**
+ * Number of the last frame that changed the screen.
+ */
+unsigned int current_frame(session_t session);
+
+/**
+ * Coalesced regions painted after frame `since`, at most `max`.
+ * Stores the current frame number in `frame`, 0 for an unknown
+ * session, and returns the rectangle count. Too old a `since`
+ * yields the whole screen.
+ */
+int dirty_regions(session_t session, unsigned int since, rect_t* rects, int max, unsigned int* frame);
+
+/**
+ * Block until a frame after `since` paints inside `rect`, or
+ * anywhere when `rect` is NULL. A negative timeout waits forever,
+ * 0 only checks. Returns 1 on change, 0 on timeout or when the
+ * session closes, and -1 instead of waiting when the calling
+ * thread holds lock_framebuffer().
+ */
+int wait_for_change(session_t session, unsigned int since, const rect_t* rect, int ms_timeout);
+
+/**
+ * Search the framebuffer for a width x height BGRA template, within
+ * `region` when not NULL and, when `since` is not NULL, only where
+ * frames after *since painted. Uses SSE2/AVX2 SAD kernels when the
+ * CPU has them. Returns 1 and fills `match` with the best position
+ * scoring at most `threshold`.
+ */
+int find_image(session_t session, const unsigned char* pixels, int width, int height,
+               const rect_t* region, const unsigned int* since, double threshold, match_t* match);
+
+/**
+ * Monotonic nanosecond timestamps of the connect phases reached,
+ * 0 for phases not reached yet. Fills CONNECT_PHASES entries and
+ * returns 0 for an unknown session.
+ */
+int connect_timings(session_t session, unsigned long long* stamps);
+
+/**
+ * Snapshot a session's metrics, 0 for an unknown session.
+ */
+int session_metrics(session_t session, metrics_t* metrics);
+
+/**
+ * Totals over every session since the process started.
+ */
+void process_metrics(metrics_t* metrics);
+
+/**
+ * Snake case names of a counter or histogram.
+ */
+const char* metric_name(int counter);
+const char* histogram_name(int histogram);
+
+/**
+ * Process metrics in Prometheus text format, plus per-session
+ * counters when `sessions` is set. Returns a malloc'd string.
+ */
+char* metrics_text(int sessions);
+
+/**
+ * Sessions started and not yet closed.
+ */
+int live_sessions(void);
+
+/**
+ * Events from all sessions funnel into one ring. The descriptor
+ * turns readable while events are pending; poll_events() drains
+ * up to `max` of them and must only be called from one thread.
+ */
+int event_fd(void);
+int poll_events(event_t* events, int max);
+
+/**
+ * Opaque pointer kept with a session, for finding the caller's
+ * object from an event. NULL once the session is released.
+ */
+void set_session_owner(session_t session, void* owner);
+void* session_owner(session_t session);
+
+/**
+ * Drive sessions from a fixed pool of epoll workers instead of
+ * a thread per session. Zero workers means one per core.
+ * Returns the worker count or -1 on failure.
+ */
+int engine_start(int workers);
 
 /**
- * Close all connections and shut down the client.
+ * Close all connections and shut down the client. Sessions may be
+ * started again afterwards. If some are still closing when
+ * `ms_timeout` runs out, the engine keeps running until a later
+ * destroy() finds none left.
  */
 void destroy(int ms_timeout);
 
+#endif
@@ -0,0 +1,487 @@
+#include <Python.h>
+#include "freerdp.h"
+#include "freerdp_py.h"
+
+/**
+ * FreeRDP driven by an asyncio loop: events are drained by a
+ * reader on the module's event descriptor, and input tickets
+ * and screen changes are awaited as futures.
+ */
+typedef struct {
+    FreeRDP base;
+    PyObject* loop;
+    PyObject* connected;
+    PyObject* closed;
+    PyObject* inputs;
+    PyObject* changes;
+} AsyncFreeRDP;
+
+/**
+ * Loop the event descriptor reader is registered with.
+ */
+static PyObject* g_reader_loop = NULL;
+
+/**
+ * Resolve a future unless it is done or cancelled.
+ */
+static void AsyncFreeRDP_settle(PyObject* future, PyObject* result, PyObject* error, const char* message) {
+    PyObject* done = PyObject_CallMethod(future, "done", NULL);
+    PyObject* outcome = NULL;
+    if (done == NULL) {
+        PyErr_WriteUnraisable(future);
+        return;
+    }
+    if (done == Py_False) {
+        if (error != NULL)
+            outcome = PyObject_CallMethod(future, "set_exception", "N", PyObject_CallFunction(error, "s", message));
+        else
+            outcome = PyObject_CallMethod(future, "set_result", "O", result);
+        if (outcome == NULL)
+            PyErr_WriteUnraisable(future);
+        Py_XDECREF(outcome);
+    }
+    Py_DECREF(done);
+}
+
+/**
+ * Whether the session already went away, waiters would never fire.
+ */
+static int AsyncFreeRDP_is_closed(AsyncFreeRDP* self) {
+    int closed;
+    PyObject* done = PyObject_CallMethod(self->closed, "done", NULL);
+    if (done == NULL) {
+        PyErr_Clear();
+        return 1;
+    }
+    closed = done == Py_True;
+    Py_DECREF(done);
+    return closed;
+}
+
+/**
+ * Settle every future of a waiter list, (key, ..., future) tuples,
+ * for which `ready` is true, and drop them.
+ */
+static int AsyncFreeRDP_sweep(PyObject* list, int (*ready)(AsyncFreeRDP*, PyObject*, const event_t*),
+                              AsyncFreeRDP* self, const event_t* event, PyObject* result) {
+    Py_ssize_t index;
+    Py_ssize_t kept = 0;
+    PyObject* waiter;
+    for (index = 0; index < PyList_GET_SIZE(list); ++index) {
+        waiter = PyList_GET_ITEM(list, index);
+        if (ready == NULL || ready(self, waiter, event)) {
+            AsyncFreeRDP_settle(PyTuple_GET_ITEM(waiter, PyTuple_GET_SIZE(waiter) - 1), result, NULL, NULL);
+            continue;
+        }
+        Py_INCREF(waiter);
+        PyList_SetItem(list, kept++, waiter);
+    }
+    return PyList_SetSlice(list, kept, PyList_GET_SIZE(list), NULL);
+}
+
+/**
+ * Ticket waiter, (ticket, future), done once the event's ticket passed it.
+ */
+static int AsyncFreeRDP_input_ready(AsyncFreeRDP* self, PyObject* waiter, const event_t* event) {
+    unsigned int ticket = (unsigned int)PyLong_AsUnsignedLong(PyTuple_GET_ITEM(waiter, 0));
+    return (int)(event->arg - ticket) >= 0;
+}
+
+/**
+ * Change waiter, (since, rect, future), checked without blocking.
+ */
+static int AsyncFreeRDP_change_ready(AsyncFreeRDP* self, PyObject* waiter, const event_t* event) {
+    rect_t rect;
+    PyObject* rect_object = PyTuple_GET_ITEM(waiter, 1);
+    unsigned int since = (unsigned int)PyLong_AsUnsignedLong(PyTuple_GET_ITEM(waiter, 0));
+    if (rect_object == Py_None)
+        return wait_for_change(self->base._session, since, NULL, 0);
+    if (!PyArg_ParseTuple(rect_object, "iiii", &rect.x, &rect.y, &rect.width, &rect.height)) {
+        PyErr_Clear();
+        return 1;
+    }
+    return wait_for_change(self->base._session, since, &rect, 0);
+}
+
+/**
+ * Event hook, runs under the GIL on the loop's thread.
+ */
+static void AsyncFreeRDP_handle(FreeRDP* base, const event_t* event) {
+    AsyncFreeRDP* self = (AsyncFreeRDP*)base;
+    int status = 0;
+    if (self->inputs == NULL || self->changes == NULL)
+        return;
+    switch (event->type) {
+    case EVENT_CONNECT:
+        AsyncFreeRDP_settle(self->connected, Py_True, NULL, NULL);
+        break;
+    case EVENT_ERROR:
+        if (event->arg == SESSION_ERROR_CONNECT)
+            AsyncFreeRDP_settle(self->connected, NULL, PyExc_ConnectionError, "connect failed");
+        break;
+    case EVENT_DISCONNECT:
+        AsyncFreeRDP_settle(self->connected, NULL, PyExc_ConnectionError, "session closed");
+        AsyncFreeRDP_settle(self->closed, Py_True, NULL, NULL);
+        status = AsyncFreeRDP_sweep(self->inputs, NULL, self, event, Py_False);
+        if (status == 0)
+            status = AsyncFreeRDP_sweep(self->changes, NULL, self, event, Py_False);
+        break;
+    case EVENT_INPUT:
+        status = AsyncFreeRDP_sweep(self->inputs, AsyncFreeRDP_input_ready, self, event, Py_True);
+        break;
+    case EVENT_FRAME:
+        if (PyList_GET_SIZE(self->changes) > 0)
+            status = AsyncFreeRDP_sweep(self->changes, AsyncFreeRDP_change_ready, self, event, Py_True);
+        break;
+    }
+    if (status != 0)
+        PyErr_WriteUnraisable((PyObject*)self);
+}
+
+/**
+ * Switch the module to loop-driven dispatch and watch the
+ * event descriptor from `loop`, once per loop.
+ */
+static int AsyncFreeRDP_watch(PyObject* loop) {
+    PyObject* fd;
+    PyObject* drain;
+    PyObject* result;
+    if (loop == g_reader_loop)
+        return 0;
+    fd = PyObject_CallMethod(__global_module, "event_fd", NULL);
+    if (fd == NULL)
+        return -1;
+    if (g_reader_loop != NULL) {
+        /* the previous loop may be closed already */
+        result = PyObject_CallMethod(g_reader_loop, "remove_reader", "O", fd);
+        if (result == NULL)
+            PyErr_Clear();
+        Py_XDECREF(result);
+        Py_CLEAR(g_reader_loop);
+    }
+    drain = PyObject_GetAttrString(__global_module, "dispatch_events");
+    result = drain == NULL ? NULL : PyObject_CallMethod(loop, "add_reader", "OO", fd, drain);
+    Py_XDECREF(drain);
+    Py_DECREF(fd);
+    if (result == NULL)
+        return -1;
+    Py_DECREF(result);
+    Py_INCREF(loop);
+    g_reader_loop = loop;
+    return 0;
+}
+
+/**
+ * Running loop, or the thread's default one outside a coroutine.
+ */
+static PyObject* AsyncFreeRDP_get_loop(void) {
+    PyObject* loop;
+    PyObject* asyncio = PyImport_ImportModule("asyncio");
+    if (asyncio == NULL)
+        return NULL;
+    loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+    if (loop == NULL && PyErr_ExceptionMatches(PyExc_RuntimeError)) {
+        PyErr_Clear();
+        loop = PyObject_CallMethod(asyncio, "get_event_loop", NULL);
+    }
+    Py_DECREF(asyncio);
+    return loop;
+}
+
+static int AsyncFreeRDP_trav(AsyncFreeRDP* self, visitproc visit, void* arg) {
+    Py_VISIT(self->loop);
+    Py_VISIT(self->connected);
+    Py_VISIT(self->closed);
+    Py_VISIT(self->inputs);
+    Py_VISIT(self->changes);
+    return FreeRDPType.tp_traverse((PyObject*)self, visit, arg);
+}
+
+static int AsyncFreeRDP_clear(AsyncFreeRDP* self) {
+    Py_CLEAR(self->loop);
+    Py_CLEAR(self->connected);
+    Py_CLEAR(self->closed);
+    Py_CLEAR(self->inputs);
+    Py_CLEAR(self->changes);
+    return FreeRDPType.tp_clear((PyObject*)self);
+}
+
+static void AsyncFreeRDP_dealloc(AsyncFreeRDP* self) {
+    PyObject_GC_UnTrack(self);
+    self->base._handler = NULL;
+    Py_CLEAR(self->loop);
+    Py_CLEAR(self->connected);
+    Py_CLEAR(self->closed);
+    Py_CLEAR(self->inputs);
+    Py_CLEAR(self->changes);
+    FreeRDPType.tp_dealloc((PyObject*)self);
+}
+
+/**
+ * Init AsyncFreeRDP, must run on (or be given) the loop that awaits it.
+ */
+static int AsyncFreeRDP_init(AsyncFreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"args", "on_event", "loop", "headless", "idle_suppress", "record", NULL};
+    int status;
+    int headless = 0;
+    double idle_suppress = 0.0;
+    char* record = NULL;
+    PyObject* command;
+    PyObject* onEvent = Py_None;
+    PyObject* loop = Py_None;
+    PyObject* base_args;
+    PyObject* base_kwargs;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOpdz:AsyncFreeRDP", keywords, &command, &onEvent, &loop,
+                                     &headless, &idle_suppress, &record))
+        return -1;
+    if (self->base._session != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "session already started");
+        return -1;
+    }
+    if (loop == Py_None)
+        loop = AsyncFreeRDP_get_loop();
+    else
+        Py_INCREF(loop);
+    if (loop == NULL)
+        return -1;
+    Py_XSETREF(self->loop, loop);
+    if (AsyncFreeRDP_watch(loop) != 0)
+        return -1;
+    Py_XSETREF(self->connected, PyObject_CallMethod(loop, "create_future", NULL));
+    Py_XSETREF(self->closed, PyObject_CallMethod(loop, "create_future", NULL));
+    Py_XSETREF(self->inputs, PyList_New(0));
+    Py_XSETREF(self->changes, PyList_New(0));
+    if (self->connected == NULL || self->closed == NULL || self->inputs == NULL || self->changes == NULL)
+        return -1;
+    /* set before the session exists so no event can miss it */
+    self->base._handler = AsyncFreeRDP_handle;
+    base_args = Py_BuildValue("(O)", command);
+    base_kwargs = Py_BuildValue("{sOsOsdsz}", "on_event", onEvent, "headless", headless ? Py_True : Py_False,
+                                "idle_suppress", idle_suppress, "record", record);
+    if (base_args == NULL || base_kwargs == NULL)
+        status = -1;
+    else
+        status = FreeRDPType.tp_init((PyObject*)self, base_args, base_kwargs);
+    Py_XDECREF(base_args);
+    Py_XDECREF(base_kwargs);
+    return status;
+}
+
+/**
+ * Call the FreeRDP method `name` and wrap the ticket it returns
+ * in a future resolved once that input was sent.
+ */
+static PyObject* AsyncFreeRDP_track(AsyncFreeRDP* self, const char* name, PyObject* args, PyObject* kwargs) {
+    Py_ssize_t index;
+    unsigned int ticket;
+    PyObject* method;
+    PyObject* full_args;
+    PyObject* ticket_object;
+    PyObject* future;
+    PyObject* waiter;
+    method = PyObject_GetAttrString((PyObject*)&FreeRDPType, name);
+    if (method == NULL)
+        return NULL;
+    full_args = PyTuple_New(PyTuple_GET_SIZE(args) + 1);
+    if (full_args == NULL) {
+        Py_DECREF(method);
+        return NULL;
+    }
+    Py_INCREF(self);
+    PyTuple_SET_ITEM(full_args, 0, (PyObject*)self);
+    for (index = 0; index < PyTuple_GET_SIZE(args); ++index) {
+        Py_INCREF(PyTuple_GET_ITEM(args, index));
+        PyTuple_SET_ITEM(full_args, index + 1, PyTuple_GET_ITEM(args, index));
+    }
+    ticket_object = PyObject_Call(method, full_args, kwargs);
+    Py_DECREF(full_args);
+    Py_DECREF(method);
+    if (ticket_object == NULL)
+        return NULL;
+    ticket = (unsigned int)PyLong_AsUnsignedLong(ticket_object);
+    future = PyObject_CallMethod(self->loop, "create_future", NULL);
+    if (future == NULL || PyErr_Occurred()) {
+        Py_DECREF(ticket_object);
+        Py_XDECREF(future);
+        return NULL;
+    }
+    if (ticket == 0) {
+        AsyncFreeRDP_settle(future, NULL, PyExc_RuntimeError, "input not queued");
+    } else if (wait_input(self->base._session, ticket, 0)) {
+        AsyncFreeRDP_settle(future, Py_True, NULL, NULL);
+    } else if (AsyncFreeRDP_is_closed(self)) {
+        AsyncFreeRDP_settle(future, Py_False, NULL, NULL);
+    } else {
+        waiter = PyTuple_Pack(2, ticket_object, future);
+        if (waiter == NULL || PyList_Append(self->inputs, waiter) != 0) {
+            Py_XDECREF(waiter);
+            Py_DECREF(ticket_object);
+            Py_DECREF(future);
+            return NULL;
+        }
+        Py_DECREF(waiter);
+    }
+    Py_DECREF(ticket_object);
+    return future;
+}
+
+static PyObject* AsyncFreeRDP_run_command(AsyncFreeRDP* self, PyObject* args, PyObject* kwargs) {
+    return AsyncFreeRDP_track(self, "run_command", args, kwargs);
+}
+
+static PyObject* AsyncFreeRDP_type_text(AsyncFreeRDP* self, PyObject* args, PyObject* kwargs) {
+    return AsyncFreeRDP_track(self, "type_text", args, kwargs);
+}
+
+static PyObject* AsyncFreeRDP_press_keys(AsyncFreeRDP* self, PyObject* args, PyObject* kwargs) {
+    return AsyncFreeRDP_track(self, "press_keys", args, kwargs);
+}
+
+static PyObject* AsyncFreeRDP_paste_text(AsyncFreeRDP* self, PyObject* args, PyObject* kwargs) {
+    return AsyncFreeRDP_track(self, "paste_text", args, kwargs);
+}
+
+static PyObject* AsyncFreeRDP_click(AsyncFreeRDP* self, PyObject* args, PyObject* kwargs) {
+    return AsyncFreeRDP_track(self, "click", args, kwargs);
+}
+
+static PyObject* AsyncFreeRDP_drag(AsyncFreeRDP* self, PyObject* args, PyObject* kwargs) {
+    return AsyncFreeRDP_track(self, "drag", args, kwargs);
+}
+
+static PyObject* AsyncFreeRDP_mouse_path(AsyncFreeRDP* self, PyObject* args, PyObject* kwargs) {
+    return AsyncFreeRDP_track(self, "mouse_path", args, kwargs);
+}
+
+/**
+ * Future resolved once the screen changes inside rect after
+ * frame `since`, by default the current one.
+ */
+static PyObject* AsyncFreeRDP_wait_for_change(AsyncFreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"rect", "since", NULL};
+    rect_t rect;
+    rect_t* watch = NULL;
+    unsigned int since;
+    PyObject* rect_object = Py_None;
+    PyObject* since_object = Py_None;
+    PyObject* future;
+    PyObject* waiter;
+    if (self->base._session == 0) {
+        PyErr_SetString(PyExc_RuntimeError, "session not started");
+        return NULL;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", keywords, &rect_object, &since_object))
+        return NULL;
+    if (rect_object != Py_None) {
+        if (!PyArg_ParseTuple(rect_object, "iiii;rect must be (x, y, width, height)",
+                              &rect.x, &rect.y, &rect.width, &rect.height))
+            return NULL;
+        watch = &rect;
+    }
+    if (since_object != Py_None) {
+        since = (unsigned int)PyLong_AsUnsignedLong(since_object);
+        if (PyErr_Occurred())
+            return NULL;
+    } else {
+        since = current_frame(self->base._session);
+    }
+    future = PyObject_CallMethod(self->loop, "create_future", NULL);
+    if (future == NULL)
+        return NULL;
+    if (wait_for_change(self->base._session, since, watch, 0)) {
+        AsyncFreeRDP_settle(future, Py_True, NULL, NULL);
+        return future;
+    }
+    if (AsyncFreeRDP_is_closed(self)) {
+        AsyncFreeRDP_settle(future, Py_False, NULL, NULL);
+        return future;
+    }
+    waiter = Py_BuildValue("(IOO)", since, rect_object, future);
+    if (waiter == NULL || PyList_Append(self->changes, waiter) != 0) {
+        Py_XDECREF(waiter);
+        Py_DECREF(future);
+        return NULL;
+    }
+    Py_DECREF(waiter);
+    return future;
+}
+
+static PyObject* AsyncFreeRDP_get_connected(AsyncFreeRDP* self, void* closure) {
+    Py_INCREF(self->connected);
+    return self->connected;
+}
+
+static PyObject* AsyncFreeRDP_get_closed(AsyncFreeRDP* self, void* closure) {
+    Py_INCREF(self->closed);
+    return self->closed;
+}
+
+static PyMethodDef AsyncFreeRDP_methods[] = {
+    {"run_command", (PyCFunction)AsyncFreeRDP_run_command, METH_VARARGS | METH_KEYWORDS, "Run a command, future of its input"},
+    {"type_text", (PyCFunction)AsyncFreeRDP_type_text, METH_VARARGS | METH_KEYWORDS, "Type text, future of its input"},
+    {"press_keys", (PyCFunction)AsyncFreeRDP_press_keys, METH_VARARGS | METH_KEYWORDS, "Press keys, future of their input"},
+    {"paste_text", (PyCFunction)AsyncFreeRDP_paste_text, METH_VARARGS | METH_KEYWORDS, "Paste text, future of its input"},
+    {"click", (PyCFunction)AsyncFreeRDP_click, METH_VARARGS | METH_KEYWORDS, "Click, future of its input"},
+    {"drag", (PyCFunction)AsyncFreeRDP_drag, METH_VARARGS | METH_KEYWORDS, "Drag, future of its input"},
+    {"mouse_path", (PyCFunction)AsyncFreeRDP_mouse_path, METH_VARARGS | METH_KEYWORDS, "Move through points, future of the input"},
+    {"wait_for_change", (PyCFunction)AsyncFreeRDP_wait_for_change, METH_VARARGS | METH_KEYWORDS, "Future of a screen change"},
+    {NULL}
+};
+
+static PyGetSetDef AsyncFreeRDP_getset[] = {
+    {"connected", (getter)AsyncFreeRDP_get_connected, NULL, "Future resolved on connect", NULL},
+    {"closed", (getter)AsyncFreeRDP_get_closed, NULL, "Future resolved on disconnect", NULL},
+    {NULL}
+};
+
+/**
+ * Define AsyncFreeRDP class type.
+ */
+static PyTypeObject AsyncFreeRDPType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "freerdp.AsyncFreeRDP",       /* tp_name */
+    sizeof(AsyncFreeRDP),         /* tp_basicsize */
+    0,                            /* tp_itemsize */
+    (destructor)AsyncFreeRDP_dealloc, /* tp_dealloc */
+    0,                            /* tp_print */
+    0,                            /* tp_getattr */
+    0,                            /* tp_setattr */
+    0,                            /* tp_reserved */
+    0,                            /* tp_repr */
+    0,                            /* tp_as_number */
+    0,                            /* tp_as_sequence */
+    0,                            /* tp_as_mapping */
+    0,                            /* tp_hash  */
+    0,                            /* tp_call */
+    0,                            /* tp_str */
+    0,                            /* tp_getattro */
+    0,                            /* tp_setattro */
+    0,                            /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT |
+        Py_TPFLAGS_BASETYPE |
+        Py_TPFLAGS_HAVE_GC,       /* tp_flags */
+    "FreeRDP session awaited from asyncio", /* tp_doc */
+    (traverseproc)AsyncFreeRDP_trav, /* tp_traverse */
+    (inquiry)AsyncFreeRDP_clear,  /* tp_clear */
+    0,                            /* tp_richcompare */
+    0,                            /* tp_weaklistoffset */
+    0,                            /* tp_iter */
+    0,                            /* tp_iternext */
+    AsyncFreeRDP_methods,         /* tp_methods */
+    0,                            /* tp_members */
+    AsyncFreeRDP_getset,          /* tp_getset */
+    0,                            /* tp_base */
+    0,                            /* tp_dict */
+    0,                            /* tp_descr_get */
+    0,                            /* tp_descr_set */
+    0,                            /* tp_dictoffset */
+    (initproc)AsyncFreeRDP_init,  /* tp_init */
+};
+
+int FreeRDP_AddAsync(PyObject* module) {
+    AsyncFreeRDPType.tp_base = &FreeRDPType;
+    if (PyType_Ready(&AsyncFreeRDPType) < 0)
+        return -1;
+    Py_INCREF(&AsyncFreeRDPType);
+    return PyModule_AddObject(module, "AsyncFreeRDP", (PyObject*)&AsyncFreeRDPType);
+}
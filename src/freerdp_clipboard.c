@@ -0,0 +1,253 @@
+#include <pthread.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <freerdp/freerdp.h>
+#include <freerdp/utils/event.h>
+#include <freerdp/client/cliprdr.h>
+#include <freerdp/channels/channels.h>
+#include <winpr/crt.h>
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * Text as CF_UNICODETEXT with CRLF line ends, NULL if it does
+ * not convert. `size` is in bytes with the terminator.
+ */
+BYTE* fapi_clipboard_encode(const char* text, UINT32* size) {
+    int count;
+    char* crlf;
+    char* out;
+    const char* in;
+    WCHAR* wide = NULL;
+    crlf = (char*)malloc(strlen(text) * 2 + 1);
+    if (crlf == NULL)
+        return NULL;
+    for (in = text, out = crlf; *in != '\0'; in++) {
+        if (*in == '\n' && (in == text || in[-1] != '\r'))
+            *out++ = '\r';
+        *out++ = *in;
+    }
+    *out = '\0';
+    count = ConvertToUnicode(CP_UTF8, 0, crlf, -1, &wide, 0);
+    free(crlf);
+    if (count <= 0)
+        return NULL;
+    *size = count * sizeof(WCHAR);
+    return (BYTE*)wide;
+}
+
+/**
+ * Replace the text offered to the server. Runs on the session
+ * loop just before the announce that offers it.
+ */
+void fapi_clipboard_take(Context* ctx, const BYTE* text, UINT32 size) {
+    BYTE* copy;
+    BYTE* old;
+    copy = (BYTE*)malloc(size);
+    if (copy == NULL)
+        return;
+    memcpy(copy, text, size);
+    pthread_mutex_lock(&ctx->lock);
+    old = ctx->clip_local;
+    ctx->clip_local = copy;
+    ctx->clip_local_size = size;
+    pthread_mutex_unlock(&ctx->lock);
+    free(old);
+}
+
+/**
+ * Announce our formats or ask for the server's text.
+ * Runs on the session loop, which owns the channels.
+ */
+void fapi_clipboard_send(Context* ctx, int op) {
+    BOOL text;
+    wMessage* event;
+    RDP_CB_FORMAT_LIST_EVENT* format_list;
+    RDP_CB_DATA_REQUEST_EVENT* data_request;
+    rdpChannels* channels = ctx->_p.channels;
+    if (channels == NULL)
+        return;
+    if (op == CLIP_ANNOUNCE) {
+        pthread_mutex_lock(&ctx->lock);
+        text = ctx->clip_local != NULL;
+        pthread_mutex_unlock(&ctx->lock);
+        event = freerdp_event_new(CliprdrChannel_Class, CliprdrChannel_FormatList, NULL, NULL);
+        format_list = (RDP_CB_FORMAT_LIST_EVENT*)event;
+        format_list->num_formats = 0;
+        if (text) {
+            format_list->formats = (UINT32*)malloc(sizeof(UINT32));
+            format_list->formats[0] = CB_FORMAT_UNICODETEXT;
+            format_list->num_formats = 1;
+        }
+    } else {
+        event = freerdp_event_new(CliprdrChannel_Class, CliprdrChannel_DataRequest, NULL, NULL);
+        data_request = (RDP_CB_DATA_REQUEST_EVENT*)event;
+        data_request->format = CB_FORMAT_UNICODETEXT;
+    }
+    freerdp_channels_send_event(channels, event);
+}
+
+/**
+ * Answer a server data request with our text, empty if we have none.
+ */
+static void clipboard_respond(Context* ctx, RDP_CB_DATA_REQUEST_EVENT* request) {
+    wMessage* event;
+    RDP_CB_DATA_RESPONSE_EVENT* response;
+    event = freerdp_event_new(CliprdrChannel_Class, CliprdrChannel_DataResponse, NULL, NULL);
+    response = (RDP_CB_DATA_RESPONSE_EVENT*)event;
+    response->data = NULL;
+    response->size = 0;
+    pthread_mutex_lock(&ctx->lock);
+    if (request->format == CB_FORMAT_UNICODETEXT && ctx->clip_local != NULL) {
+        response->data = (BYTE*)malloc(ctx->clip_local_size);
+        if (response->data != NULL) {
+            memcpy(response->data, ctx->clip_local, ctx->clip_local_size);
+            response->size = ctx->clip_local_size;
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    freerdp_channels_send_event(ctx->_p.channels, event);
+}
+
+/**
+ * Handle a cliprdr event, FALSE if it belongs to another channel.
+ */
+BOOL fapi_clipboard_event(Context* ctx, wMessage* event) {
+    UINT16 index;
+    BOOL text;
+    RDP_CB_FORMAT_LIST_EVENT* format_list;
+    RDP_CB_DATA_RESPONSE_EVENT* response;
+    if (GetMessageClass(event->id) != CliprdrChannel_Class)
+        return FALSE;
+    switch (GetMessageType(event->id)) {
+        case CliprdrChannel_MonitorReady:
+            fapi_clipboard_send(ctx, CLIP_ANNOUNCE);
+            break;
+        case CliprdrChannel_FormatList:
+            format_list = (RDP_CB_FORMAT_LIST_EVENT*)event;
+            text = FALSE;
+            for (index = 0; index < format_list->num_formats; ++index) {
+                if (format_list->formats[index] == CB_FORMAT_UNICODETEXT)
+                    text = TRUE;
+            }
+            pthread_mutex_lock(&ctx->lock);
+            ctx->clip_remote_text = text;
+            pthread_mutex_unlock(&ctx->lock);
+            fapi_emit(ctx, EVENT_CLIPBOARD, text);
+            break;
+        case CliprdrChannel_DataRequest:
+            clipboard_respond(ctx, (RDP_CB_DATA_REQUEST_EVENT*)event);
+            break;
+        case CliprdrChannel_DataResponse:
+            response = (RDP_CB_DATA_RESPONSE_EVENT*)event;
+            pthread_mutex_lock(&ctx->lock);
+            free(ctx->clip_remote);
+            ctx->clip_remote = NULL;
+            ctx->clip_remote_size = 0;
+            if (response->size > 0) {
+                ctx->clip_remote = (BYTE*)malloc(response->size);
+                if (ctx->clip_remote != NULL) {
+                    memcpy(ctx->clip_remote, response->data, response->size);
+                    ctx->clip_remote_size = response->size;
+                }
+            }
+            ctx->clip_responses++;
+            pthread_cond_broadcast(&ctx->cond);
+            pthread_mutex_unlock(&ctx->lock);
+            break;
+        default:
+            fprintf(stderr, "fapi_clipboard_event: unknown event type %d\n", GetMessageType(event->id));
+            break;
+    }
+    return TRUE;
+}
+
+/**
+ * Free clipboard buffers with the context.
+ */
+void fapi_clipboard_free(Context* ctx) {
+    free(ctx->clip_local);
+    free(ctx->clip_remote);
+    ctx->clip_local = NULL;
+    ctx->clip_remote = NULL;
+}
+
+/**
+ * Offer text on the session clipboard.
+ */
+unsigned int set_clipboard(session_t session, const char* text) {
+    unsigned int ticket;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    ticket = fapi_clipboard_submit(context, text);
+    fapi_release(context);
+    return ticket;
+}
+
+/**
+ * Fetch the server's clipboard text.
+ */
+static char* clipboard_fetch(Context* context, int ms_timeout) {
+    int count;
+    int waited = 0;
+    unsigned int seq;
+    BOOL remote;
+    char* text = NULL;
+    char* in;
+    char* out;
+    struct timespec deadline;
+    struct input_event event = { INPUT_CLIPBOARD, 0, CLIP_REQUEST, 0, 0 };
+    pthread_mutex_lock(&context->lock);
+    remote = context->clip_remote_text;
+    seq = context->clip_responses;
+    pthread_mutex_unlock(&context->lock);
+    if (!remote)
+        return NULL;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms_timeout / 1000;
+    deadline.tv_nsec += (long)(ms_timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    if (fapi_input_submit(context, &event, 1) == 0)
+        return NULL;
+    pthread_mutex_lock(&context->lock);
+    while (context->clip_responses == seq && !context->closed && waited != ETIMEDOUT) {
+        if (ms_timeout < 0)
+            pthread_cond_wait(&context->cond, &context->lock);
+        else
+            waited = pthread_cond_timedwait(&context->cond, &context->lock, &deadline);
+    }
+    if (context->clip_responses != seq && context->clip_remote != NULL) {
+        count = ConvertFromUnicode(CP_UTF8, 0, (WCHAR*)context->clip_remote, context->clip_remote_size / sizeof(WCHAR),
+                                   &text, 0, NULL, NULL);
+        if (count <= 0)
+            text = NULL;
+    }
+    pthread_mutex_unlock(&context->lock);
+    if (text == NULL)
+        return NULL;
+    /* back to LF line ends */
+    for (in = text, out = text; *in != '\0'; in++) {
+        if (*in != '\r' || in[1] != '\n')
+            *out++ = *in;
+    }
+    *out = '\0';
+    return text;
+}
+
+char* get_clipboard(session_t session, int ms_timeout) {
+    char* text;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return NULL;
+    text = clipboard_fetch(context, ms_timeout);
+    fapi_release(context);
+    return text;
+}
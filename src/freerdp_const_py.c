@@ -1,9 +1,37 @@
 #include <Python.h>
+#include <freerdp/freerdp.h>
 #include <freerdp/scancode.h>
+#include "freerdp.h"
 
 void FreeRDP_AddConstants(PyObject* module) {
     PyModule_AddIntConstant(module, "KEY_1", RDP_SCANCODE_KEY_1);
     PyModule_AddIntConstant(module, "KEY_R", RDP_SCANCODE_KEY_R);
     PyModule_AddIntConstant(module, "KEY_LMENU", RDP_SCANCODE_LMENU);
+    PyModule_AddIntConstant(module, "KEY_LCONTROL", RDP_SCANCODE_LCONTROL);
+    PyModule_AddIntConstant(module, "KEY_LSHIFT", RDP_SCANCODE_LSHIFT);
+    PyModule_AddIntConstant(module, "KEY_LWIN", RDP_SCANCODE_LWIN);
+    PyModule_AddIntConstant(module, "KEY_RETURN", RDP_SCANCODE_RETURN);
+    PyModule_AddIntConstant(module, "KEY_TAB", RDP_SCANCODE_TAB);
+    PyModule_AddIntConstant(module, "KEY_ESCAPE", RDP_SCANCODE_ESCAPE);
+    PyModule_AddIntConstant(module, "EVENT_CONNECT", EVENT_CONNECT);
+    PyModule_AddIntConstant(module, "EVENT_DISCONNECT", EVENT_DISCONNECT);
+    PyModule_AddIntConstant(module, "EVENT_FRAME", EVENT_FRAME);
+    PyModule_AddIntConstant(module, "EVENT_CLIPBOARD", EVENT_CLIPBOARD);
+    PyModule_AddIntConstant(module, "EVENT_ERROR", EVENT_ERROR);
+    PyModule_AddIntConstant(module, "EVENT_INPUT", EVENT_INPUT);
+    PyModule_AddIntConstant(module, "EVENT_TIMING", EVENT_TIMING);
+    PyModule_AddIntConstant(module, "EVENT_RECONNECT", EVENT_RECONNECT);
+    PyModule_AddIntConstant(module, "ERROR_CONNECT", SESSION_ERROR_CONNECT);
+    PyModule_AddIntConstant(module, "ERROR_TRANSPORT", SESSION_ERROR_TRANSPORT);
+    PyModule_AddIntConstant(module, "PHASE_QUEUED", CONNECT_PHASE_QUEUED);
+    PyModule_AddIntConstant(module, "PHASE_CONNECTING", CONNECT_PHASE_CONNECTING);
+    PyModule_AddIntConstant(module, "PHASE_PRE_CONNECT", CONNECT_PHASE_PRE_CONNECT);
+    PyModule_AddIntConstant(module, "PHASE_HANDSHAKE", CONNECT_PHASE_HANDSHAKE);
+    PyModule_AddIntConstant(module, "PHASE_GDI_INIT", CONNECT_PHASE_GDI_INIT);
+    PyModule_AddIntConstant(module, "PHASE_CONNECTED", CONNECT_PHASE_CONNECTED);
+    PyModule_AddIntConstant(module, "PHASE_FIRST_PAINT", CONNECT_PHASE_FIRST_PAINT);
+    PyModule_AddIntConstant(module, "MACRO_DONE", MACRO_DONE);
+    PyModule_AddIntConstant(module, "MACRO_TIMEOUT", MACRO_TIMEOUT);
+    PyModule_AddIntConstant(module, "MACRO_NO_SCREEN", MACRO_NO_SCREEN);
 }
 
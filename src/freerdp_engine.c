@@ -0,0 +1,382 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <freerdp/freerdp.h>
+#include <winpr/crt.h>
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+#define FAPI_MAX_EVENTS 256
+#define FAPI_CONNECTORS_PER_WORKER 2
+
+/**
+ * Epoll loop multiplexing many sessions.
+ */
+struct worker {
+    pthread_t thread;
+    int epfd;
+    int wakefd;
+    pthread_mutex_t lock;
+    Context* inbox;
+    volatile int sessions;
+};
+
+/**
+ * Worker pool plus the connector threads that run
+ * the blocking freerdp_connect handshakes.
+ */
+static struct {
+    BOOL running;
+    BOOL stopping;
+    int nworkers;
+    struct worker* workers;
+    int nconnectors;
+    pthread_t* connectors;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Context* pending_head;
+    Context* pending_tail;
+    Context* delayed;
+} g_engine;
+
+/**
+ * Least loaded worker.
+ */
+static struct worker* engine_pick_worker(void) {
+    int index;
+    struct worker* best = &g_engine.workers[0];
+    for (index = 1; index < g_engine.nworkers; ++index) {
+        if (g_engine.workers[index].sessions < best->sessions)
+            best = &g_engine.workers[index];
+    }
+    return best;
+}
+
+/**
+ * Queue a session for the connectors.
+ */
+static void engine_queue(Context* ctx) {
+    ctx->next = NULL;
+    pthread_mutex_lock(&g_engine.lock);
+    if (g_engine.pending_tail != NULL)
+        g_engine.pending_tail->next = ctx;
+    else
+        g_engine.pending_head = ctx;
+    g_engine.pending_tail = ctx;
+    pthread_cond_signal(&g_engine.cond);
+    pthread_mutex_unlock(&g_engine.lock);
+}
+
+/**
+ * Park a session until its next reconnect attempt is due.
+ */
+static void engine_delay(Context* ctx) {
+    pthread_mutex_lock(&g_engine.lock);
+    ctx->next = g_engine.delayed;
+    g_engine.delayed = ctx;
+    /* a waiting connector may have to wake up sooner */
+    pthread_cond_signal(&g_engine.cond);
+    pthread_mutex_unlock(&g_engine.lock);
+}
+
+/**
+ * Next session for a connector: the queue first, then a parked one
+ * that is due or stopped. Otherwise NULL with `due` set to the
+ * earliest parked attempt, 0 if none. Engine lock held.
+ */
+static Context* engine_next(UINT64* due) {
+    UINT64 now;
+    Context* ctx = g_engine.pending_head;
+    Context** link;
+    if (ctx != NULL) {
+        g_engine.pending_head = ctx->next;
+        if (g_engine.pending_head == NULL)
+            g_engine.pending_tail = NULL;
+        return ctx;
+    }
+    *due = 0;
+    if (g_engine.delayed == NULL)
+        return NULL;
+    now = fapi_now();
+    for (link = &g_engine.delayed; *link != NULL; link = &(*link)->next) {
+        ctx = *link;
+        if (ctx->shutdown || ctx->reconnect_at <= now) {
+            *link = ctx->next;
+            return ctx;
+        }
+        if (*due == 0 || ctx->reconnect_at < *due)
+            *due = ctx->reconnect_at;
+    }
+    return NULL;
+}
+
+/**
+ * Hand a connected session to its worker.
+ */
+static void engine_adopt(Context* ctx) {
+    UINT64 one = 1;
+    struct worker* worker = ctx->worker;
+    pthread_mutex_lock(&worker->lock);
+    ctx->next = worker->inbox;
+    worker->inbox = ctx;
+    pthread_mutex_unlock(&worker->lock);
+    if (write(worker->wakefd, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "engine_adopt: eventfd write failed (%d)\n", errno);
+}
+
+/**
+ * Drop a session from its worker and tear it down.
+ */
+static void engine_detach(struct worker* worker, Context* ctx) {
+    fapi_unwatch_fds(worker->epfd, ctx);
+    __atomic_sub_fetch(&worker->sessions, 1, __ATOMIC_RELAXED);
+    fapi_close(ctx->_p.instance);
+}
+
+/**
+ * Hand a dropped session back to the connectors to reconnect,
+ * it stays counted on its worker.
+ */
+static void engine_reconnect(struct worker* worker, Context* ctx) {
+    fapi_unwatch_fds(worker->epfd, ctx);
+    ctx->reconnecting = TRUE;
+    engine_queue(ctx);
+}
+
+/**
+ * Register sessions handed over by the connectors.
+ */
+static void worker_drain_inbox(struct worker* worker) {
+    UINT64 count;
+    Context* ctx;
+    Context* next;
+    while (read(worker->wakefd, &count, sizeof(count)) > 0)
+        ;
+    pthread_mutex_lock(&worker->lock);
+    ctx = worker->inbox;
+    worker->inbox = NULL;
+    pthread_mutex_unlock(&worker->lock);
+    for (; ctx != NULL; ctx = next) {
+        next = ctx->next;
+        ctx->next = NULL;
+        if (ctx->shutdown || !fapi_watch_fds(worker->epfd, ctx)) {
+            __atomic_sub_fetch(&worker->sessions, 1, __ATOMIC_RELAXED);
+            fapi_close(ctx->_p.instance);
+        }
+    }
+}
+
+/**
+ * Worker thread, services every ready session once per wakeup.
+ */
+static void* worker_func(void* param) {
+    int i;
+    int count;
+    int nready;
+    unsigned int epoch = 0;
+    struct watch* watch;
+    struct worker* worker = (struct worker*)param;
+    struct epoll_event events[FAPI_MAX_EVENTS];
+    Context* ready[FAPI_MAX_EVENTS];
+
+    while (!g_engine.stopping) {
+        count = epoll_wait(worker->epfd, events, FAPI_MAX_EVENTS, -1);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "worker_func: epoll_wait failed (%d)\n", errno);
+            break;
+        }
+        ++epoch;
+        nready = 0;
+        for (i = 0; i < count; i++) {
+            watch = (struct watch*)events[i].data.ptr;
+            if (watch == NULL) {
+                worker_drain_inbox(worker);
+                continue;
+            }
+            /* a session may fire on several descriptors */
+            if (watch->ctx->epoch != epoch) {
+                watch->ctx->epoch = epoch;
+                watch->ctx->ready = 0;
+                ready[nready++] = watch->ctx;
+            }
+            watch->ctx->ready |= watch->kind;
+        }
+        for (i = 0; i < nready; i++) {
+            if (fapi_dispatch(ready[i], ready[i]->ready))
+                continue;
+            if (fapi_can_reconnect(ready[i]))
+                engine_reconnect(worker, ready[i]);
+            else
+                engine_detach(worker, ready[i]);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Connector thread, runs handshakes and reconnects off the workers.
+ * A failed reconnect with attempts left is parked, never slept on.
+ */
+static void* connector_func(void* param) {
+    UINT64 due;
+    struct timespec until;
+    Context* ctx;
+    freerdp* instance;
+    for (;;) {
+        pthread_mutex_lock(&g_engine.lock);
+        while (!g_engine.stopping && (ctx = engine_next(&due)) == NULL) {
+            if (due == 0) {
+                pthread_cond_wait(&g_engine.cond, &g_engine.lock);
+                continue;
+            }
+            until.tv_sec = (time_t)(due / 1000000000);
+            until.tv_nsec = (long)(due % 1000000000);
+            pthread_cond_timedwait(&g_engine.cond, &g_engine.lock, &until);
+        }
+        if (g_engine.stopping) {
+            pthread_mutex_unlock(&g_engine.lock);
+            break;
+        }
+        pthread_mutex_unlock(&g_engine.lock);
+
+        ctx->next = NULL;
+        instance = ctx->_p.instance;
+        if (!ctx->shutdown && (ctx->reconnecting ? fapi_reconnect(instance) : fapi_connect(instance))) {
+            engine_adopt(ctx);
+            continue;
+        }
+        if (ctx->reconnecting && !ctx->shutdown) {
+            engine_delay(ctx);
+            continue;
+        }
+        ctx->reconnecting = FALSE;
+        __atomic_sub_fetch(&ctx->worker->sessions, 1, __ATOMIC_RELAXED);
+        fapi_close(instance);
+    }
+    return NULL;
+}
+
+/**
+ * Start the engine with a worker per core unless told otherwise.
+ */
+int engine_start(int workers) {
+    int index;
+    pthread_condattr_t attr;
+    struct epoll_event event;
+    if (g_engine.running)
+        return g_engine.nworkers;
+    if (workers <= 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers <= 0)
+        workers = 1;
+
+    ZeroMemory(&g_engine, sizeof(g_engine));
+    pthread_mutex_init(&g_engine.lock, NULL);
+    /* parked reconnects are due on fapi_now()'s clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_engine.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    g_engine.workers = (struct worker*)calloc(workers, sizeof(struct worker));
+    g_engine.connectors = (pthread_t*)calloc(workers * FAPI_CONNECTORS_PER_WORKER, sizeof(pthread_t));
+    if (g_engine.workers == NULL || g_engine.connectors == NULL) {
+        free(g_engine.workers);
+        free(g_engine.connectors);
+        return -1;
+    }
+
+    for (index = 0; index < workers; ++index) {
+        struct worker* worker = &g_engine.workers[index];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+        worker->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ZeroMemory(&event, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (worker->epfd == -1 || worker->wakefd == -1 ||
+                epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->wakefd, &event) == -1 ||
+                pthread_create(&worker->thread, 0, worker_func, worker) != 0) {
+            fprintf(stderr, "engine_start: worker %d failed (%d)\n", index, errno);
+            if (worker->epfd != -1) close(worker->epfd);
+            if (worker->wakefd != -1) close(worker->wakefd);
+            break;
+        }
+        g_engine.nworkers++;
+    }
+    for (index = 0; index < g_engine.nworkers * FAPI_CONNECTORS_PER_WORKER; ++index) {
+        if (pthread_create(&g_engine.connectors[index], 0, connector_func, NULL) != 0)
+            break;
+        g_engine.nconnectors++;
+    }
+    if (g_engine.nworkers == 0 || g_engine.nconnectors == 0) {
+        engine_stop();
+        return -1;
+    }
+    g_engine.running = TRUE;
+    return g_engine.nworkers;
+}
+
+/**
+ * Whether new sessions go to the engine.
+ */
+BOOL engine_running(void) {
+    return g_engine.running;
+}
+
+/**
+ * Queue a session for connect on the engine.
+ */
+void engine_submit(freerdp* instance) {
+    Context* ctx = (Context*)instance->context;
+    ctx->worker = engine_pick_worker();
+    __atomic_add_fetch(&ctx->worker->sessions, 1, __ATOMIC_RELAXED);
+    engine_queue(ctx);
+}
+
+/**
+ * Wake the connectors to look at parked sessions again.
+ */
+void engine_kick(void) {
+    pthread_mutex_lock(&g_engine.lock);
+    pthread_cond_broadcast(&g_engine.cond);
+    pthread_mutex_unlock(&g_engine.lock);
+}
+
+/**
+ * Stop workers and connectors. Only once no session is left: the
+ * workers and the pending queue still own any that are.
+ */
+void engine_stop(void) {
+    int index;
+    UINT64 one = 1;
+    if (g_engine.workers == NULL)
+        return;
+    pthread_mutex_lock(&g_engine.lock);
+    g_engine.stopping = TRUE;
+    pthread_cond_broadcast(&g_engine.cond);
+    pthread_mutex_unlock(&g_engine.lock);
+    for (index = 0; index < g_engine.nconnectors; ++index)
+        pthread_join(g_engine.connectors[index], NULL);
+    for (index = 0; index < g_engine.nworkers; ++index) {
+        if (write(g_engine.workers[index].wakefd, &one, sizeof(one)) != sizeof(one))
+            fprintf(stderr, "engine_stop: eventfd write failed (%d)\n", errno);
+        pthread_join(g_engine.workers[index].thread, NULL);
+        close(g_engine.workers[index].epfd);
+        close(g_engine.workers[index].wakefd);
+        pthread_mutex_destroy(&g_engine.workers[index].lock);
+    }
+    free(g_engine.workers);
+    free(g_engine.connectors);
+    pthread_mutex_destroy(&g_engine.lock);
+    pthread_cond_destroy(&g_engine.cond);
+    ZeroMemory(&g_engine, sizeof(g_engine));
+}
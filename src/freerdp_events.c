@@ -0,0 +1,183 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <freerdp/freerdp.h>
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * Ring capacity, a power of two. Events past it are dropped,
+ * frame events are coalesced so the ring rarely fills.
+ */
+#define EVENT_RING_BITS 14
+#define EVENT_RING (1 << EVENT_RING_BITS)
+
+/**
+ * Ring cell, `seq` tells producers and the consumer whose turn it is.
+ */
+struct event_cell {
+    volatile unsigned int seq;
+    event_t event;
+};
+
+/**
+ * Bounded multi-producer ring drained by one consumer. The eventfd
+ * is written only when the ring goes from idle to pending.
+ */
+static struct {
+    struct event_cell cells[EVENT_RING];
+    volatile unsigned int tail;
+    unsigned int head;
+    volatile int signalled;
+    volatile unsigned int dropped;
+    int fd;
+} g_events;
+
+static pthread_once_t g_events_once = PTHREAD_ONCE_INIT;
+
+static void events_init(void) {
+    unsigned int index;
+    for (index = 0; index < EVENT_RING; index++)
+        g_events.cells[index].seq = index;
+    g_events.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_events.fd == -1)
+        fprintf(stderr, "events_init: eventfd failed (%d)\n", errno);
+}
+
+/**
+ * Queue an event from any thread, FALSE if the ring is full.
+ */
+static BOOL events_push(const event_t* event) {
+    int diff;
+    UINT64 one = 1;
+    unsigned int pos;
+    unsigned int seq;
+    struct event_cell* cell;
+    pos = __atomic_load_n(&g_events.tail, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &g_events.cells[pos & (EVENT_RING - 1)];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (int)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&g_events.tail, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_add_fetch(&g_events.dropped, 1, __ATOMIC_RELAXED);
+            return FALSE;
+        } else {
+            pos = __atomic_load_n(&g_events.tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->event = *event;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    if (__atomic_exchange_n(&g_events.signalled, 1, __ATOMIC_ACQ_REL) == 0 &&
+            write(g_events.fd, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "events_push: eventfd write failed (%d)\n", errno);
+    return TRUE;
+}
+
+/**
+ * Event types that only report the newest value, at most one
+ * of each per session waits in the ring.
+ */
+static int events_coalesced(int type) {
+    if (type == EVENT_FRAME || type == EVENT_INPUT)
+        return 1 << type;
+    return 0;
+}
+
+/**
+ * Report a session event.
+ */
+void fapi_emit(Context* ctx, int type, unsigned int arg) {
+    event_t event;
+    int bit = events_coalesced(type);
+    pthread_once(&g_events_once, events_init);
+    if (bit != 0 && (__atomic_fetch_or(&ctx->coalesce, bit, __ATOMIC_ACQ_REL) & bit) != 0)
+        return;
+    event.session = ctx->session;
+    event.type = type;
+    event.arg = arg;
+    if (!events_push(&event) && bit != 0)
+        __atomic_fetch_and(&ctx->coalesce, ~bit, __ATOMIC_RELEASE);
+}
+
+/**
+ * Descriptor that turns readable while events are pending.
+ */
+int event_fd(void) {
+    pthread_once(&g_events_once, events_init);
+    return g_events.fd;
+}
+
+/**
+ * Drain up to `max` events, single consumer only.
+ */
+int poll_events(event_t* events, int max) {
+    int bit;
+    int count = 0;
+    UINT64 value;
+    Context* ctx;
+    struct event_cell* cell;
+    pthread_once(&g_events_once, events_init);
+    if (read(g_events.fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "poll_events: eventfd read failed (%d)\n", errno);
+    __atomic_store_n(&g_events.signalled, 0, __ATOMIC_SEQ_CST);
+    while (count < max) {
+        cell = &g_events.cells[g_events.head & (EVENT_RING - 1)];
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != g_events.head + 1)
+            break;
+        events[count] = cell->event;
+        __atomic_store_n(&cell->seq, g_events.head + EVENT_RING, __ATOMIC_RELEASE);
+        g_events.head++;
+        bit = events_coalesced(events[count].type);
+        if (bit != 0) {
+            /* rearm coalescing and report the newest value */
+            ctx = registry_get(events[count].session);
+            if (ctx == NULL)
+                continue;
+            __atomic_fetch_and(&ctx->coalesce, ~bit, __ATOMIC_SEQ_CST);
+            if (events[count].type == EVENT_FRAME)
+                events[count].arg = __atomic_load_n(&ctx->frame, __ATOMIC_ACQUIRE);
+            else
+                events[count].arg = __atomic_load_n(&ctx->input_done, __ATOMIC_ACQUIRE);
+            fapi_release(ctx);
+        }
+        count++;
+    }
+    /* more left over, keep the descriptor readable */
+    if (count == max && __atomic_exchange_n(&g_events.signalled, 1, __ATOMIC_ACQ_REL) == 0) {
+        value = 1;
+        if (write(g_events.fd, &value, sizeof(value)) != sizeof(value))
+            fprintf(stderr, "poll_events: eventfd write failed (%d)\n", errno);
+    }
+    return count;
+}
+
+/**
+ * Attach an opaque owner pointer to a session.
+ */
+void set_session_owner(session_t session, void* owner) {
+    Context* ctx = registry_get(session);
+    if (ctx == NULL)
+        return;
+    ctx->owner = owner;
+    fapi_release(ctx);
+}
+
+/**
+ * Owner pointer of a live session, NULL once released.
+ */
+void* session_owner(session_t session) {
+    void* owner;
+    Context* ctx = registry_get(session);
+    if (ctx == NULL)
+        return NULL;
+    owner = ctx->owner;
+    fapi_release(ctx);
+    return owner;
+}
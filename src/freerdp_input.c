@@ -0,0 +1,1139 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <freerdp/freerdp.h>
+#include <freerdp/input.h>
+#include <freerdp/scancode.h>
+#include <winpr/crt.h>
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * Shortest echo timeout, in nanoseconds. Echoes that take
+ * longer than four times the average are waited for up to
+ * twice the last timeout, never past the fixed delay.
+ */
+#define ECHO_MIN 5000000ULL
+
+/**
+ * Growable list of input events for one submission.
+ */
+struct input_builder {
+    struct input_event* events;
+    int count;
+    int capacity;
+};
+
+/**
+ * Data carried by a command, 8-aligned records that events
+ * find at their `arg` offset.
+ */
+struct input_data {
+    BYTE* bytes;
+    int size;
+    int capacity;
+};
+
+/**
+ * Room for a record of `size` bytes, returns its offset
+ * or -1 when memory runs out.
+ */
+static int input_data_add(struct input_data* d, int size) {
+    int offset = d->size;
+    BYTE* bytes;
+    size = (size + 7) & ~7;
+    if (d->size + size > d->capacity) {
+        d->capacity = d->size + size > d->capacity * 2 ? d->size + size : d->capacity * 2;
+        bytes = (BYTE*)realloc(d->bytes, d->capacity);
+        if (bytes == NULL)
+            return -1;
+        d->bytes = bytes;
+    }
+    d->size += size;
+    memset(d->bytes + offset, 0, size);
+    return offset;
+}
+
+/**
+ * Append an event, dropped if memory runs out.
+ */
+static struct input_event* input_append(struct input_builder* b, UINT16 type, UINT16 flags, UINT16 code, UINT32 delay) {
+    struct input_event* events;
+    if (b->count == b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 32;
+        events = (struct input_event*)realloc(b->events, b->capacity * sizeof(struct input_event));
+        if (events == NULL) {
+            b->capacity = b->count;
+            return NULL;
+        }
+        b->events = events;
+    }
+    events = &b->events[b->count++];
+    events->type = type;
+    events->flags = flags;
+    events->code = code;
+    events->y = 0;
+    events->delay = delay;
+    events->echo = FALSE;
+    events->arg = 0;
+    return events;
+}
+
+/**
+ * Key down or up.
+ */
+static void input_key(struct input_builder* b, BOOL down, DWORD code, UINT32 delay) {
+    input_append(b, INPUT_KEY, down ? KBD_FLAGS_DOWN : KBD_FLAGS_RELEASE, (UINT16)code, delay);
+}
+
+/**
+ * Pointer event at x, y, clamped to the 16-bit range.
+ */
+static void input_mouse(struct input_builder* b, UINT16 flags, int x, int y, UINT32 delay) {
+    struct input_event* event;
+    event = input_append(b, INPUT_MOUSE, flags, (UINT16)(x < 0 ? 0 : x > 0xFFFF ? 0xFFFF : x), delay);
+    if (event != NULL)
+        event->y = (UINT16)(y < 0 ? 0 : y > 0xFFFF ? 0xFFFF : y);
+}
+
+/**
+ * Stretch the gap after the last event, a wait for the screen
+ * to answer it.
+ */
+static void input_pause(struct input_builder* b, UINT32 delay) {
+    if (b->count > 0) {
+        b->events[b->count - 1].delay += delay;
+        b->events[b->count - 1].echo = TRUE;
+    }
+}
+
+/**
+ * Queue the built events on the session and free the builder.
+ */
+static unsigned int input_submit_to(Context* context, struct input_builder* b) {
+    unsigned int ticket = 0;
+    if (b->count > 0)
+        ticket = fapi_input_submit(context, b->events, b->count);
+    free(b->events);
+    return ticket;
+}
+
+static unsigned int input_submit(session_t session, struct input_builder* b) {
+    unsigned int ticket = 0;
+    Context* context = registry_get(session);
+    if (context != NULL) {
+        ticket = input_submit_to(context, b);
+        fapi_release(context);
+    } else {
+        free(b->events);
+    }
+    return ticket;
+}
+
+/**
+ * Queue setup, the stub node keeps the list non-empty.
+ */
+void fapi_input_init(Context* ctx) {
+    pthread_condattr_t attr;
+    ctx->queue_stub.next = NULL;
+    ctx->queue_head = &ctx->queue_stub;
+    ctx->queue_tail = &ctx->queue_stub;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/**
+ * Multi-producer push, one exchange and one store.
+ */
+static void queue_push(Context* ctx, struct command* cmd) {
+    struct command* prev;
+    cmd->next = NULL;
+    prev = __atomic_exchange_n(&ctx->queue_head, cmd, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, cmd, __ATOMIC_RELEASE);
+}
+
+/**
+ * Single-consumer pop, NULL when empty or when a producer has
+ * not finished linking yet (its wake will follow).
+ */
+static struct command* queue_pop(Context* ctx) {
+    struct command* tail = ctx->queue_tail;
+    struct command* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &ctx->queue_stub) {
+        if (next == NULL)
+            return NULL;
+        ctx->queue_tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        ctx->queue_tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&ctx->queue_head, __ATOMIC_ACQUIRE))
+        return NULL;
+    queue_push(ctx, &ctx->queue_stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        ctx->queue_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/**
+ * Next command in ticket order. Producers racing between taking a
+ * ticket and pushing can land out of order, so early arrivals wait
+ * in a sorted stash until the gap fills.
+ */
+static struct command* input_next(Context* ctx) {
+    struct command* cmd;
+    struct command** link;
+    for (;;) {
+        if (ctx->stash != NULL && ctx->stash->ticket == ctx->input_done + 1) {
+            cmd = ctx->stash;
+            ctx->stash = cmd->next;
+            if (ctx->stash == NULL)
+                ctx->stash_tail = NULL;
+            return cmd;
+        }
+        cmd = queue_pop(ctx);
+        if (cmd == NULL)
+            return NULL;
+        if (cmd->ticket == ctx->input_done + 1)
+            return cmd;
+        cmd->next = NULL;
+        /* arrivals are nearly sorted, append is the common case */
+        if (ctx->stash_tail != NULL && ctx->stash_tail->ticket < cmd->ticket) {
+            ctx->stash_tail->next = cmd;
+            ctx->stash_tail = cmd;
+            continue;
+        }
+        for (link = &ctx->stash; *link != NULL && (*link)->ticket < cmd->ticket; link = &(*link)->next)
+            ;
+        cmd->next = *link;
+        *link = cmd;
+        if (cmd->next == NULL)
+            ctx->stash_tail = cmd;
+    }
+}
+
+/**
+ * Copy events, and a macro's wait data, into a command and queue
+ * it, returns its ticket. The data goes first to keep its alignment.
+ */
+static unsigned int input_queue(Context* ctx, struct input_event* events, int count,
+                                const BYTE* data, int size, BOOL macro, int steps) {
+    unsigned int ticket;
+    struct command* cmd;
+    cmd = (struct command*)malloc(sizeof(struct command) + size + count * sizeof(struct input_event));
+    if (cmd == NULL)
+        return 0;
+    cmd->count = count;
+    cmd->pos = 0;
+    cmd->data = size > 0 ? (BYTE*)(cmd + 1) : NULL;
+    cmd->events = (struct input_event*)((BYTE*)(cmd + 1) + size);
+    if (size > 0)
+        memcpy(cmd->data, data, size);
+    memcpy(cmd->events, events, count * sizeof(struct input_event));
+    cmd->macro = macro;
+    cmd->result.status = MACRO_DONE;
+    cmd->result.step = steps;
+    cmd->result.x = -1;
+    cmd->result.y = -1;
+    cmd->submitted = fapi_now();
+    fapi_count(ctx, METRIC_INPUT_SUBMITTED, 1);
+    /* nothing may fail between taking the ticket and pushing, and
+       once pushed the loop may free the command */
+    ticket = __atomic_add_fetch(&ctx->input_ticket, 1, __ATOMIC_ACQ_REL);
+    cmd->ticket = ticket;
+    queue_push(ctx, cmd);
+    fapi_wake(ctx);
+    return ticket;
+}
+
+unsigned int fapi_input_submit(Context* ctx, struct input_event* events, int count) {
+    return input_queue(ctx, events, count, NULL, 0, FALSE, 0);
+}
+
+/**
+ * Queue the built events and their data, free both.
+ */
+static unsigned int input_submit_data(Context* ctx, struct input_builder* b, struct input_data* d) {
+    unsigned int ticket = 0;
+    if (b->count > 0)
+        ticket = input_queue(ctx, b->events, b->count, d->bytes, d->size, FALSE, 0);
+    free(b->events);
+    free(d->bytes);
+    return ticket;
+}
+
+/**
+ * Queue a decoded macro, `size` bytes of 8-aligned wait data.
+ */
+unsigned int fapi_macro_submit(Context* ctx, struct input_event* events, int count,
+                               const BYTE* data, int size, int steps) {
+    return input_queue(ctx, events, count, data, size, TRUE, steps);
+}
+
+/**
+ * Send the pointer move held back for coalescing, if any.
+ */
+static void input_flush_move(Context* ctx) {
+    if (!ctx->move_pending)
+        return;
+    ctx->move_pending = FALSE;
+    freerdp_input_send_mouse_event(ctx->_p.instance->input, PTR_FLAGS_MOVE, ctx->move_x, ctx->move_y);
+    fapi_count(ctx, METRIC_PDUS_OUT, 1);
+}
+
+/**
+ * Send one event on the session thread. A move with nothing to
+ * wait for after it is held back, a later one replaces it.
+ */
+static void input_send(Context* ctx, struct command* cmd, struct input_event* event) {
+    UINT32 size;
+    rdpInput* input = ctx->_p.instance->input;
+    if (event->type == INPUT_MOUSE && event->flags == PTR_FLAGS_MOVE && event->delay == 0) {
+        if (ctx->move_pending)
+            fapi_count(ctx, METRIC_MOUSE_COALESCED, 1);
+        ctx->move_pending = TRUE;
+        ctx->move_x = event->code;
+        ctx->move_y = event->y;
+        return;
+    }
+    input_flush_move(ctx);
+    switch (event->type) {
+        case INPUT_KEY:
+            freerdp_input_send_keyboard_event_ex(input, (event->flags & KBD_FLAGS_RELEASE) == 0, event->code);
+            fapi_count(ctx, METRIC_PDUS_OUT, 1);
+            break;
+        case INPUT_UNICODE:
+            freerdp_input_send_unicode_keyboard_event(input, event->flags, event->code);
+            fapi_count(ctx, METRIC_PDUS_OUT, 1);
+            break;
+        case INPUT_CLIPBOARD:
+            if (event->code == CLIP_ANNOUNCE) {
+                memcpy(&size, cmd->data + event->arg, sizeof(size));
+                fapi_clipboard_take(ctx, cmd->data + event->arg + sizeof(size), size);
+            }
+            fapi_clipboard_send(ctx, event->code);
+            break;
+        case INPUT_MOUSE:
+            freerdp_input_send_mouse_event(input, event->flags, event->code, event->y);
+            fapi_count(ctx, METRIC_PDUS_OUT, 1);
+            break;
+    }
+}
+
+/**
+ * Publish a finished command and wake any waiter.
+ */
+static void input_complete(Context* ctx, struct command* cmd) {
+    int slot = cmd->ticket % FAPI_MACRO_RESULTS;
+    fapi_observe(ctx, METRIC_INPUT_LATENCY, fapi_now() - cmd->submitted);
+    fapi_count(ctx, METRIC_INPUT_SENT, 1);
+    if (cmd->macro) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->macro_tickets[slot] = cmd->ticket;
+        ctx->macro_results[slot] = cmd->result;
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    __atomic_store_n(&ctx->input_done, cmd->ticket, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctx->input_waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&ctx->lock);
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    fapi_emit(ctx, EVENT_INPUT, cmd->ticket);
+    free(cmd);
+}
+
+/**
+ * Wait for the screen to answer `event`, just sent, up to its delay
+ * or the timeout learned from earlier echoes if that is shorter.
+ */
+static void input_echo_start(Context* ctx, struct input_event* event, UINT64 now) {
+    UINT64 limit = (UINT64)event->delay * 1000;
+    ctx->echo_wait = TRUE;
+    ctx->echo_frame = ctx->frame;
+    ctx->echo_sent = now;
+    ctx->echo_seen = 0;
+    ctx->echo_limit = now + limit;
+    ctx->echo_deadline = ctx->echo_timeout != 0 && ctx->echo_timeout < limit ? now + ctx->echo_timeout : now + limit;
+    ctx->input_due = ctx->echo_deadline;
+}
+
+/**
+ * Whether the paced wait is over: a frame was painted after the event
+ * and none for input_quiet since, or the deadline passed without one.
+ * Leaves input_due set while it is not.
+ */
+static BOOL input_echoed(Context* ctx, UINT64 now) {
+    UINT64 due;
+    UINT64 latency;
+    UINT64 timeout;
+    UINT64 quiet = __atomic_load_n(&ctx->input_quiet, __ATOMIC_RELAXED);
+    if (ctx->frame == ctx->echo_frame) {
+        if (now < ctx->echo_deadline) {
+            ctx->input_due = ctx->echo_deadline;
+            return FALSE;
+        }
+        /* the echo lags, give the next one longer */
+        timeout = (ctx->echo_deadline - ctx->echo_sent) * 2;
+        ctx->echo_timeout = timeout > ECHO_MIN ? timeout : ECHO_MIN;
+        fapi_count(ctx, METRIC_ECHO_TIMEOUTS, 1);
+    } else {
+        if (ctx->echo_seen == 0) {
+            ctx->echo_seen = now;
+            latency = now - ctx->echo_sent;
+            ctx->echo_avg = ctx->echo_avg != 0 ? (ctx->echo_avg * 7 + latency) / 8 : latency;
+            ctx->echo_timeout = ctx->echo_avg * 4 > ECHO_MIN ? ctx->echo_avg * 4 : ECHO_MIN;
+        }
+        /* a screen that keeps painting is waited out up to the delay */
+        due = ctx->last_paint + quiet;
+        if (due > ctx->echo_limit)
+            due = ctx->echo_limit;
+        if (now < due) {
+            ctx->input_due = due;
+            return FALSE;
+        }
+    }
+    ctx->echo_wait = FALSE;
+    ctx->input_due = 0;
+    return TRUE;
+}
+
+/**
+ * End a macro early at `wait`.
+ */
+static void macro_abort(struct command* cmd, struct macro_wait* wait, int status) {
+    cmd->result.status = status;
+    cmd->result.step = wait->step;
+    cmd->pos = cmd->count;
+}
+
+/**
+ * Look for the image a wait expects, only where frames after
+ * `since` painted unless `since` is NULL.
+ */
+static BOOL macro_find(Context* ctx, struct command* cmd, struct macro_wait* wait, const unsigned int* since) {
+    match_t match;
+    if (!fapi_find_image(ctx, (const unsigned char*)(wait + 1), wait->width, wait->height,
+                         wait->anywhere ? NULL : &wait->area, since, wait->threshold, &match))
+        return FALSE;
+    cmd->result.x = match.x;
+    cmd->result.y = match.y;
+    return TRUE;
+}
+
+/**
+ * Start the screen wait `event` of the current macro. Counts as a
+ * framebuffer reader so idle suppression keeps the paints coming.
+ */
+static void macro_wait_start(Context* ctx, struct command* cmd, struct input_event* event) {
+    struct macro_wait* wait = (struct macro_wait*)(cmd->data + event->arg);
+    if (ctx->headless || ctx->_p.gdi == NULL) {
+        macro_abort(cmd, wait, MACRO_NO_SCREEN);
+        return;
+    }
+    ctx->macro_frame = ctx->frame;
+    /* the image may be up already */
+    if (wait->width > 0 && macro_find(ctx, cmd, wait, NULL))
+        return;
+    ctx->macro_wait = TRUE;
+    ctx->macro_deadline = fapi_now() + (UINT64)wait->timeout * 1000000;
+    __atomic_add_fetch(&ctx->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Whether the current wait is over, checking frames painted since
+ * the last look. Leaves input_due set while it is not.
+ */
+static BOOL macro_waited(Context* ctx, struct command* cmd, UINT64 now) {
+    BOOL found;
+    unsigned int since = ctx->macro_frame;
+    struct macro_wait* wait = (struct macro_wait*)(cmd->data + cmd->events[cmd->pos - 1].arg);
+    ctx->macro_frame = ctx->frame;
+    if (wait->width > 0)
+        found = since != ctx->frame && macro_find(ctx, cmd, wait, &since);
+    else
+        found = fapi_screen_changed(ctx, since, wait->anywhere ? NULL : &wait->area);
+    if (!found) {
+        if (now < ctx->macro_deadline) {
+            ctx->input_due = ctx->macro_deadline;
+            return FALSE;
+        }
+        macro_abort(cmd, wait, MACRO_TIMEOUT);
+    }
+    ctx->macro_wait = FALSE;
+    ctx->input_due = 0;
+    __atomic_sub_fetch(&ctx->readers, 1, __ATOMIC_SEQ_CST);
+    return TRUE;
+}
+
+/**
+ * Send whatever input is due, leaving input_due set for the rest.
+ */
+static void input_service(Context* ctx) {
+    UINT64 now = 0;
+    struct command* cmd;
+    struct input_event* event;
+    for (;;) {
+        if (ctx->current == NULL) {
+            ctx->current = input_next(ctx);
+            if (ctx->current == NULL)
+                return;
+            /* a command's first wait, for a dialog say, gets the full delay */
+            ctx->echo_timeout = 0;
+        }
+        cmd = ctx->current;
+        if (ctx->macro_wait) {
+            now = fapi_now();
+            if (!macro_waited(ctx, cmd, now))
+                return;
+        } else if (ctx->echo_wait) {
+            now = fapi_now();
+            if (!input_echoed(ctx, now))
+                return;
+        } else if (ctx->input_due != 0) {
+            if (now < ctx->input_due)
+                now = fapi_now();
+            if (now < ctx->input_due)
+                return;
+            ctx->input_due = 0;
+        }
+        if (cmd->pos == cmd->count) {
+            ctx->current = NULL;
+            input_complete(ctx, cmd);
+            continue;
+        }
+        event = &cmd->events[cmd->pos++];
+        if (event->type == INPUT_WAIT) {
+            macro_wait_start(ctx, cmd, event);
+            continue;
+        }
+        input_send(ctx, cmd, event);
+        if (event->delay != 0) {
+            now = fapi_now();
+            /* sessions without a framebuffer never see an echo */
+            if (event->echo && !ctx->headless &&
+                __atomic_load_n(&ctx->input_pacing, __ATOMIC_RELAXED) == INPUT_PACING_ECHO)
+                input_echo_start(ctx, event, now);
+            else
+                ctx->input_due = now + (UINT64)event->delay * 1000;
+        }
+    }
+}
+
+/**
+ * Service the queue, then flush a held back move before
+ * the loop goes back to the network.
+ */
+void fapi_input_service(Context* ctx) {
+    input_service(ctx);
+    input_flush_move(ctx);
+}
+
+void set_input_pacing(session_t session, int pacing, int ms_quiet) {
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return;
+    __atomic_store_n(&context->input_quiet, ms_quiet > 0 ? (UINT64)ms_quiet * 1000000 : 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&context->input_pacing, pacing, __ATOMIC_RELAXED);
+    fapi_release(context);
+}
+
+/**
+ * Drop input that never ran, once the session is gone.
+ */
+void fapi_input_free(Context* ctx) {
+    UINT64 dropped = 0;
+    struct command* cmd;
+    if (ctx->current != NULL)
+        dropped++;
+    free(ctx->current);
+    ctx->current = NULL;
+    while ((cmd = queue_pop(ctx)) != NULL) {
+        dropped++;
+        free(cmd);
+    }
+    while ((cmd = ctx->stash) != NULL) {
+        ctx->stash = cmd->next;
+        dropped++;
+        free(cmd);
+    }
+    fapi_count(ctx, METRIC_INPUT_DROPPED, dropped);
+    ctx->stash_tail = NULL;
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+}
+
+/**
+ * Key combination, pressed in order and released in reverse.
+ */
+static void input_chord(struct input_builder* b, int count, DWORD* codes) {
+    int index;
+    for (index=0; index<count; ++index)
+        input_key(b, TRUE, codes[index], 100);
+    for (index=count-1; index>=0; --index)
+        input_key(b, FALSE, codes[index], 100);
+}
+
+/**
+ * Wrap key presses.
+ */
+unsigned int press_keys(session_t session, int count, DWORD* codes) {
+    struct input_builder b = { NULL, 0, 0 };
+    input_chord(&b, count, codes);
+    return input_submit(session, &b);
+}
+
+/**
+ * Pointer flags of mouse button 1-3, 0 for anything else.
+ */
+static UINT16 input_button(int button) {
+    switch (button) {
+        case 1: return PTR_FLAGS_BUTTON1;
+        case 2: return PTR_FLAGS_BUTTON2;
+        case 3: return PTR_FLAGS_BUTTON3;
+    }
+    return 0;
+}
+
+unsigned int move_mouse(session_t session, int x, int y) {
+    struct input_builder b = { NULL, 0, 0 };
+    input_mouse(&b, PTR_FLAGS_MOVE, x, y, 0);
+    return input_submit(session, &b);
+}
+
+/**
+ * Button events carry their own position, no move is sent first.
+ */
+unsigned int click(session_t session, int x, int y, int button, int count) {
+    int index;
+    UINT16 flags = input_button(button);
+    struct input_builder b = { NULL, 0, 0 };
+    if (flags == 0)
+        return 0;
+    for (index = 0; index < count; index++) {
+        input_mouse(&b, flags | PTR_FLAGS_DOWN, x, y, 100);
+        input_mouse(&b, flags, x, y, 100);
+    }
+    return input_submit(session, &b);
+}
+
+unsigned int drag(session_t session, int x0, int y0, int x1, int y1, int button, int steps, int ms_interval) {
+    int index;
+    UINT16 flags = input_button(button);
+    UINT32 gap = ms_interval > 0 ? (UINT32)ms_interval * 1000 : 0;
+    struct input_builder b = { NULL, 0, 0 };
+    if (flags == 0)
+        return 0;
+    if (steps < 1)
+        steps = 1;
+    input_mouse(&b, flags | PTR_FLAGS_DOWN, x0, y0, gap != 0 ? gap : 100);
+    for (index = 1; index <= steps; index++)
+        input_mouse(&b, PTR_FLAGS_MOVE, x0 + (x1 - x0) * index / steps, y0 + (y1 - y0) * index / steps, gap);
+    input_mouse(&b, flags, x1, y1, 100);
+    return input_submit(session, &b);
+}
+
+/**
+ * Wheel notches are 120 units, the rotation a 9-bit two's
+ * complement value in the flags.
+ */
+unsigned int scroll(session_t session, int x, int y, int clicks) {
+    int index;
+    UINT16 flags = clicks > 0 ? PTR_FLAGS_WHEEL | 0x0078 : PTR_FLAGS_WHEEL | PTR_FLAGS_WHEEL_NEGATIVE | 0x0088;
+    struct input_builder b = { NULL, 0, 0 };
+    for (index = 0; index < (clicks > 0 ? clicks : -clicks); index++)
+        input_mouse(&b, flags, x, y, 100);
+    return input_submit(session, &b);
+}
+
+unsigned int mouse_path(session_t session, int count, const point_t* points, int ms_interval) {
+    int index;
+    UINT32 gap = ms_interval > 0 ? (UINT32)ms_interval * 1000 : 0;
+    struct input_builder b = { NULL, 0, 0 };
+    for (index = 0; index < count; index++)
+        input_mouse(&b, PTR_FLAGS_MOVE, points[index].x, points[index].y, gap);
+    return input_submit(session, &b);
+}
+
+/**
+ * Scancode and shift state typing an ASCII character on a US layout.
+ * Zero entries go out as Unicode keyboard events instead.
+ */
+struct key_map {
+    UINT16 code;
+    BYTE shift;
+};
+
+static const struct key_map g_key_map[256] = {
+    ['\t'] = { RDP_SCANCODE_TAB, 0 }, ['\n'] = { RDP_SCANCODE_RETURN, 0 }, ['\r'] = { RDP_SCANCODE_RETURN, 0 },
+    [' '] = { RDP_SCANCODE_SPACE, 0 },
+    ['a'] = { RDP_SCANCODE_KEY_A, 0 }, ['b'] = { RDP_SCANCODE_KEY_B, 0 }, ['c'] = { RDP_SCANCODE_KEY_C, 0 }, ['d'] = { RDP_SCANCODE_KEY_D, 0 },
+    ['e'] = { RDP_SCANCODE_KEY_E, 0 }, ['f'] = { RDP_SCANCODE_KEY_F, 0 }, ['g'] = { RDP_SCANCODE_KEY_G, 0 }, ['h'] = { RDP_SCANCODE_KEY_H, 0 },
+    ['i'] = { RDP_SCANCODE_KEY_I, 0 }, ['j'] = { RDP_SCANCODE_KEY_J, 0 }, ['k'] = { RDP_SCANCODE_KEY_K, 0 }, ['l'] = { RDP_SCANCODE_KEY_L, 0 },
+    ['m'] = { RDP_SCANCODE_KEY_M, 0 }, ['n'] = { RDP_SCANCODE_KEY_N, 0 }, ['o'] = { RDP_SCANCODE_KEY_O, 0 }, ['p'] = { RDP_SCANCODE_KEY_P, 0 },
+    ['q'] = { RDP_SCANCODE_KEY_Q, 0 }, ['r'] = { RDP_SCANCODE_KEY_R, 0 }, ['s'] = { RDP_SCANCODE_KEY_S, 0 }, ['t'] = { RDP_SCANCODE_KEY_T, 0 },
+    ['u'] = { RDP_SCANCODE_KEY_U, 0 }, ['v'] = { RDP_SCANCODE_KEY_V, 0 }, ['w'] = { RDP_SCANCODE_KEY_W, 0 }, ['x'] = { RDP_SCANCODE_KEY_X, 0 },
+    ['y'] = { RDP_SCANCODE_KEY_Y, 0 }, ['z'] = { RDP_SCANCODE_KEY_Z, 0 },
+    ['A'] = { RDP_SCANCODE_KEY_A, 1 }, ['B'] = { RDP_SCANCODE_KEY_B, 1 }, ['C'] = { RDP_SCANCODE_KEY_C, 1 }, ['D'] = { RDP_SCANCODE_KEY_D, 1 },
+    ['E'] = { RDP_SCANCODE_KEY_E, 1 }, ['F'] = { RDP_SCANCODE_KEY_F, 1 }, ['G'] = { RDP_SCANCODE_KEY_G, 1 }, ['H'] = { RDP_SCANCODE_KEY_H, 1 },
+    ['I'] = { RDP_SCANCODE_KEY_I, 1 }, ['J'] = { RDP_SCANCODE_KEY_J, 1 }, ['K'] = { RDP_SCANCODE_KEY_K, 1 }, ['L'] = { RDP_SCANCODE_KEY_L, 1 },
+    ['M'] = { RDP_SCANCODE_KEY_M, 1 }, ['N'] = { RDP_SCANCODE_KEY_N, 1 }, ['O'] = { RDP_SCANCODE_KEY_O, 1 }, ['P'] = { RDP_SCANCODE_KEY_P, 1 },
+    ['Q'] = { RDP_SCANCODE_KEY_Q, 1 }, ['R'] = { RDP_SCANCODE_KEY_R, 1 }, ['S'] = { RDP_SCANCODE_KEY_S, 1 }, ['T'] = { RDP_SCANCODE_KEY_T, 1 },
+    ['U'] = { RDP_SCANCODE_KEY_U, 1 }, ['V'] = { RDP_SCANCODE_KEY_V, 1 }, ['W'] = { RDP_SCANCODE_KEY_W, 1 }, ['X'] = { RDP_SCANCODE_KEY_X, 1 },
+    ['Y'] = { RDP_SCANCODE_KEY_Y, 1 }, ['Z'] = { RDP_SCANCODE_KEY_Z, 1 },
+    ['1'] = { RDP_SCANCODE_KEY_1, 0 }, ['2'] = { RDP_SCANCODE_KEY_2, 0 }, ['3'] = { RDP_SCANCODE_KEY_3, 0 }, ['4'] = { RDP_SCANCODE_KEY_4, 0 }, ['5'] = { RDP_SCANCODE_KEY_5, 0 },
+    ['6'] = { RDP_SCANCODE_KEY_6, 0 }, ['7'] = { RDP_SCANCODE_KEY_7, 0 }, ['8'] = { RDP_SCANCODE_KEY_8, 0 }, ['9'] = { RDP_SCANCODE_KEY_9, 0 }, ['0'] = { RDP_SCANCODE_KEY_0, 0 },
+    ['!'] = { RDP_SCANCODE_KEY_1, 1 }, ['@'] = { RDP_SCANCODE_KEY_2, 1 }, ['#'] = { RDP_SCANCODE_KEY_3, 1 }, ['$'] = { RDP_SCANCODE_KEY_4, 1 }, ['%'] = { RDP_SCANCODE_KEY_5, 1 },
+    ['^'] = { RDP_SCANCODE_KEY_6, 1 }, ['&'] = { RDP_SCANCODE_KEY_7, 1 }, ['*'] = { RDP_SCANCODE_KEY_8, 1 }, ['('] = { RDP_SCANCODE_KEY_9, 1 }, [')'] = { RDP_SCANCODE_KEY_0, 1 },
+    ['-'] = { RDP_SCANCODE_OEM_MINUS, 0 }, ['_'] = { RDP_SCANCODE_OEM_MINUS, 1 },
+    ['='] = { RDP_SCANCODE_OEM_PLUS, 0 }, ['+'] = { RDP_SCANCODE_OEM_PLUS, 1 },
+    ['['] = { RDP_SCANCODE_OEM_4, 0 }, ['{'] = { RDP_SCANCODE_OEM_4, 1 },
+    [']'] = { RDP_SCANCODE_OEM_6, 0 }, ['}'] = { RDP_SCANCODE_OEM_6, 1 },
+    [';'] = { RDP_SCANCODE_OEM_1, 0 }, [':'] = { RDP_SCANCODE_OEM_1, 1 },
+    ['\''] = { RDP_SCANCODE_OEM_7, 0 }, ['"'] = { RDP_SCANCODE_OEM_7, 1 },
+    ['`'] = { RDP_SCANCODE_OEM_3, 0 }, ['~'] = { RDP_SCANCODE_OEM_3, 1 },
+    ['\\'] = { RDP_SCANCODE_OEM_5, 0 }, ['|'] = { RDP_SCANCODE_OEM_5, 1 },
+    [','] = { RDP_SCANCODE_OEM_COMMA, 0 }, ['<'] = { RDP_SCANCODE_OEM_COMMA, 1 },
+    ['.'] = { RDP_SCANCODE_OEM_PERIOD, 0 }, ['>'] = { RDP_SCANCODE_OEM_PERIOD, 1 },
+    ['/'] = { RDP_SCANCODE_OEM_2, 0 }, ['?'] = { RDP_SCANCODE_OEM_2, 1 },
+};
+
+/**
+ * Decode one UTF-8 character, invalid bytes decode as U+FFFD.
+ */
+static UINT32 utf8_next(const unsigned char** text) {
+    int extra;
+    UINT32 cp;
+    const unsigned char* p = *text;
+    if (p[0] < 0x80) {
+        *text = p + 1;
+        return p[0];
+    }
+    if (p[0] >= 0xF8) {
+        *text = p + 1;
+        return 0xFFFD;
+    }
+    if (p[0] >= 0xF0) {
+        cp = p[0] & 0x07;
+        extra = 3;
+    } else if (p[0] >= 0xE0) {
+        cp = p[0] & 0x0F;
+        extra = 2;
+    } else if (p[0] >= 0xC0) {
+        cp = p[0] & 0x1F;
+        extra = 1;
+    } else {
+        *text = p + 1;
+        return 0xFFFD;
+    }
+    for (p++; extra > 0; extra--, p++) {
+        if ((*p & 0xC0) != 0x80) {
+            *text = p;
+            return 0xFFFD;
+        }
+        cp = (cp << 6) | (*p & 0x3F);
+    }
+    *text = p;
+    return cp > 0x10FFFF ? 0xFFFD : cp;
+}
+
+/**
+ * Unicode key press, surrogate pairs above the BMP.
+ */
+static void input_unicode(struct input_builder* b, UINT32 cp, UINT32 delay) {
+    UINT16 units[2];
+    int count = 1;
+    int index;
+    units[0] = (UINT16)cp;
+    if (cp > 0xFFFF) {
+        cp -= 0x10000;
+        units[0] = (UINT16)(0xD800 | (cp >> 10));
+        units[1] = (UINT16)(0xDC00 | (cp & 0x3FF));
+        count = 2;
+    }
+    for (index = 0; index < count; ++index) {
+        input_append(b, INPUT_UNICODE, 0, units[index], delay);
+        input_append(b, INPUT_UNICODE, KBD_FLAGS_RELEASE, units[index], delay);
+    }
+}
+
+/**
+ * Encode UTF-8 text as key events, `gap` microseconds before each
+ * character. Shift is held across runs of shifted characters rather
+ * than pressed around each one.
+ */
+static void input_text(struct input_builder* b, const char* text, UINT32 gap) {
+    UINT32 cp;
+    BOOL shifted = FALSE;
+    const struct key_map* key;
+    const unsigned char* p = (const unsigned char*)text;
+    while (*p != '\0') {
+        input_pause(b, gap);
+        cp = utf8_next(&p);
+        /* CRLF is one Enter */
+        if (cp == '\r' && *p == '\n')
+            continue;
+        key = cp < 0x80 ? &g_key_map[cp] : NULL;
+        if (key == NULL || key->code == 0) {
+            if (shifted) {
+                input_key(b, FALSE, RDP_SCANCODE_LSHIFT, 100);
+                shifted = FALSE;
+            }
+            input_unicode(b, cp, 100);
+            continue;
+        }
+        if (key->shift != shifted) {
+            input_key(b, key->shift, RDP_SCANCODE_LSHIFT, 100);
+            shifted = key->shift;
+        }
+        input_key(b, TRUE, key->code, 100);
+        input_key(b, FALSE, key->code, 100);
+    }
+    if (shifted)
+        input_key(b, FALSE, RDP_SCANCODE_LSHIFT, 100);
+}
+
+/**
+ * Type UTF-8 text into the session.
+ */
+unsigned int type_text(session_t session, const char* text, unsigned int gap) {
+    struct input_builder b = { NULL, 0, 0 };
+    input_text(&b, text, gap);
+    return input_submit(session, &b);
+}
+
+/**
+ * Announce `text` on the clipboard, carried in the command's data
+ * as its byte size and CF_UNICODETEXT. The loop takes it into
+ * clip_local only when the announce runs, so a queued paste does
+ * not replace the text of one still waiting.
+ */
+static BOOL input_clip(struct input_builder* b, struct input_data* d, const char* text, UINT32 settle) {
+    int offset;
+    UINT32 size;
+    BYTE* wide;
+    struct input_event* event;
+    wide = fapi_clipboard_encode(text, &size);
+    if (wide == NULL)
+        return FALSE;
+    offset = input_data_add(d, (int)(sizeof(size) + size));
+    if (offset >= 0) {
+        memcpy(d->bytes + offset, &size, sizeof(size));
+        memcpy(d->bytes + offset + sizeof(size), wide, size);
+    }
+    free(wide);
+    event = input_append(b, INPUT_CLIPBOARD, 0, CLIP_ANNOUNCE, settle);
+    if (offset < 0 || event == NULL)
+        return FALSE;
+    event->arg = offset;
+    return TRUE;
+}
+
+/**
+ * Put text on the clipboard and press Ctrl+V, giving the server
+ * `settle` microseconds to take the new format list.
+ */
+static BOOL input_paste(struct input_builder* b, struct input_data* d, const char* text, UINT32 settle) {
+    DWORD paste[2] = { RDP_SCANCODE_LCONTROL, RDP_SCANCODE_KEY_V };
+    if (!input_clip(b, d, text, settle))
+        return FALSE;
+    input_chord(b, 2, paste);
+    return TRUE;
+}
+
+unsigned int fapi_clipboard_submit(Context* ctx, const char* text) {
+    struct input_builder b = { NULL, 0, 0 };
+    struct input_data d = { NULL, 0, 0 };
+    if (!input_clip(&b, &d, text, 0))
+        b.count = 0;
+    return input_submit_data(ctx, &b, &d);
+}
+
+/**
+ * Paste UTF-8 text into the session.
+ */
+unsigned int paste_text(session_t session, const char* text) {
+    unsigned int ticket;
+    struct input_builder b = { NULL, 0, 0 };
+    struct input_data d = { NULL, 0, 0 };
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    if (!input_paste(&b, &d, text, 100000))
+        b.count = 0;
+    ticket = input_submit_data(context, &b, &d);
+    fapi_release(context);
+    return ticket;
+}
+
+/**
+ * Run a command string through the clipboard, one round trip
+ * however long it is.
+ */
+unsigned int paste_command(session_t session, const char* command) {
+    unsigned int ticket;
+    struct input_builder b = { NULL, 0, 0 };
+    struct input_data d = { NULL, 0, 0 };
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    input_key(&b, TRUE, RDP_SCANCODE_LWIN, 100);
+    input_key(&b, TRUE, RDP_SCANCODE_KEY_R, 100);
+    input_key(&b, FALSE, RDP_SCANCODE_LWIN, 100);
+    input_key(&b, FALSE, RDP_SCANCODE_KEY_R, 100000);
+    if (input_paste(&b, &d, command, 100000)) {
+        input_pause(&b, 100000);
+        input_key(&b, TRUE, RDP_SCANCODE_RETURN, 100);
+        input_key(&b, FALSE, RDP_SCANCODE_RETURN, 0);
+    } else {
+        b.count = 0;
+    }
+    ticket = input_submit_data(context, &b, &d);
+    fapi_release(context);
+    return ticket;
+}
+
+/**
+ * Run a command string.
+ */
+unsigned int run_command(session_t session, char* command) {
+    struct input_builder b = { NULL, 0, 0 };
+    input_key(&b, TRUE, RDP_SCANCODE_LWIN, 100);
+    input_key(&b, TRUE, RDP_SCANCODE_KEY_R, 100);
+    input_key(&b, FALSE, RDP_SCANCODE_LWIN, 100);
+    input_key(&b, FALSE, RDP_SCANCODE_KEY_R, 100);
+    input_text(&b, command, 100000);
+    input_key(&b, TRUE, RDP_SCANCODE_RETURN, 100);
+    input_key(&b, FALSE, RDP_SCANCODE_RETURN, 0);
+    return input_submit(session, &b);
+}
+
+/**
+ * Block until the command with the given ticket has been sent.
+ */
+int wait_input(session_t session, unsigned int ticket, int ms_timeout) {
+    int status;
+    struct timespec deadline;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    if (ticket == 0)
+        ticket = __atomic_load_n(&context->input_ticket, __ATOMIC_ACQUIRE);
+    if ((int)(__atomic_load_n(&context->input_done, __ATOMIC_SEQ_CST) - ticket) >= 0) {
+        fapi_release(context);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms_timeout / 1000;
+    deadline.tv_nsec += (long)(ms_timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    __atomic_add_fetch(&context->input_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&context->lock);
+    for (;;) {
+        status = (int)(__atomic_load_n(&context->input_done, __ATOMIC_SEQ_CST) - ticket) >= 0;
+        if (status || context->closed)
+            break;
+        if (ms_timeout < 0)
+            pthread_cond_wait(&context->cond, &context->lock);
+        else if (pthread_cond_timedwait(&context->cond, &context->lock, &deadline) == ETIMEDOUT) {
+            status = (int)(__atomic_load_n(&context->input_done, __ATOMIC_SEQ_CST) - ticket) >= 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+    __atomic_sub_fetch(&context->input_waiters, 1, __ATOMIC_SEQ_CST);
+    fapi_release(context);
+    return status;
+}
+
+/**
+ * Little-endian reader over a macro program, `ok` drops
+ * on reading past the end.
+ */
+struct macro_reader {
+    const BYTE* p;
+    const BYTE* end;
+    BOOL ok;
+};
+
+static UINT32 macro_read(struct macro_reader* r, int size) {
+    int i;
+    UINT32 value = 0;
+    if (r->end - r->p < size) {
+        r->ok = FALSE;
+        r->p = r->end;
+        return 0;
+    }
+    for (i = 0; i < size; i++)
+        value |= (UINT32)r->p[i] << (8 * i);
+    r->p += size;
+    return value;
+}
+
+/**
+ * Decode one wait step into `d` and a wait event.
+ */
+static BOOL macro_wait(struct input_builder* b, struct input_data* d, struct macro_reader* r, int op, int step) {
+    int offset;
+    int width = 0;
+    int height = 0;
+    UINT32 threshold = 0;
+    struct macro_wait* wait;
+    struct input_event* event;
+    if (op == MACRO_WAIT_IMAGE) {
+        width = (int)macro_read(r, 2);
+        height = (int)macro_read(r, 2);
+        threshold = macro_read(r, 4);
+        /* the area and timeout, then the pixels */
+        if (width == 0 || height == 0 || (size_t)(r->end - r->p) < 20 + (size_t)width * height * 4)
+            return FALSE;
+    }
+    offset = input_data_add(d, (int)sizeof(struct macro_wait) + width * height * 4);
+    if (offset < 0)
+        return FALSE;
+    wait = (struct macro_wait*)(d->bytes + offset);
+    wait->step = step;
+    wait->area.x = (INT32)macro_read(r, 4);
+    wait->area.y = (INT32)macro_read(r, 4);
+    wait->area.width = (INT32)macro_read(r, 4);
+    wait->area.height = (INT32)macro_read(r, 4);
+    wait->anywhere = wait->area.width <= 0 || wait->area.height <= 0;
+    wait->timeout = macro_read(r, 4);
+    wait->width = width;
+    wait->height = height;
+    wait->threshold = threshold / 1000000.0;
+    if (width > 0) {
+        memcpy(wait + 1, r->p, width * height * 4);
+        r->p += width * height * 4;
+    }
+    event = input_append(b, INPUT_WAIT, 0, 0, 0);
+    if (event == NULL)
+        return FALSE;
+    event->arg = offset;
+    return r->ok;
+}
+
+/**
+ * Decode a macro program into events and wait data.
+ * Returns the step count, -1 for a malformed program.
+ */
+static int macro_decode(struct input_builder* b, struct input_data* d, const BYTE* program, int length) {
+    int op;
+    int step;
+    UINT32 a;
+    UINT32 x;
+    UINT32 y;
+    UINT32 gap;
+    UINT16 button;
+    char* text;
+    struct macro_reader r = { program, program + length, TRUE };
+    for (step = 0; r.p < r.end; step++) {
+        op = *r.p++;
+        switch (op) {
+            case MACRO_KEY_DOWN:
+            case MACRO_KEY_UP:
+                a = macro_read(&r, 2);
+                input_key(b, op == MACRO_KEY_DOWN, a, 100);
+                break;
+            case MACRO_TEXT:
+                gap = macro_read(&r, 4);
+                a = macro_read(&r, 4);
+                if (!r.ok || (UINT32)(r.end - r.p) < a)
+                    return -1;
+                text = (char*)malloc(a + 1);
+                if (text == NULL)
+                    return -1;
+                memcpy(text, r.p, a);
+                text[a] = '\0';
+                r.p += a;
+                input_text(b, text, gap);
+                free(text);
+                break;
+            case MACRO_MOVE:
+                x = macro_read(&r, 2);
+                y = macro_read(&r, 2);
+                input_mouse(b, PTR_FLAGS_MOVE, x, y, 0);
+                break;
+            case MACRO_BUTTON_DOWN:
+            case MACRO_BUTTON_UP:
+            case MACRO_CLICK:
+                button = input_button((int)macro_read(&r, 1));
+                x = macro_read(&r, 2);
+                y = macro_read(&r, 2);
+                if (button == 0)
+                    return -1;
+                if (op != MACRO_BUTTON_UP)
+                    input_mouse(b, button | PTR_FLAGS_DOWN, x, y, 100);
+                if (op != MACRO_BUTTON_DOWN)
+                    input_mouse(b, button, x, y, 100);
+                break;
+            case MACRO_DELAY:
+                /* a plain pause, echo pacing leaves it alone */
+                a = macro_read(&r, 4);
+                input_append(b, INPUT_DELAY, 0, 0, a < 4294967 ? a * 1000 : 4294967295U);
+                break;
+            case MACRO_WAIT_CHANGE:
+            case MACRO_WAIT_IMAGE:
+                if (!macro_wait(b, d, &r, op, step))
+                    return -1;
+                break;
+            default:
+                return -1;
+        }
+        if (!r.ok)
+            return -1;
+    }
+    return step;
+}
+
+/**
+ * Decode on the caller's thread, run on the session's.
+ */
+unsigned int submit_macro(session_t session, const unsigned char* program, int length) {
+    int steps;
+    unsigned int ticket = 0;
+    struct input_builder b = { NULL, 0, 0 };
+    struct input_data d = { NULL, 0, 0 };
+    Context* context;
+    steps = macro_decode(&b, &d, program, length);
+    if (steps >= 0 && (context = registry_get(session)) != NULL) {
+        ticket = fapi_macro_submit(context, b.events, b.count, d.bytes, d.size, steps);
+        fapi_release(context);
+    }
+    free(b.events);
+    free(d.bytes);
+    return ticket;
+}
+
+int macro_result(session_t session, unsigned int ticket, macro_result_t* result) {
+    int found;
+    int slot = ticket % FAPI_MACRO_RESULTS;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    pthread_mutex_lock(&context->lock);
+    found = ticket != 0 && context->macro_tickets[slot] == ticket;
+    if (found)
+        *result = context->macro_results[slot];
+    pthread_mutex_unlock(&context->lock);
+    fapi_release(context);
+    return found;
+}
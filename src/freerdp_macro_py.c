@@ -0,0 +1,202 @@
+#include <Python.h>
+#include "freerdp.h"
+#include "freerdp_py.h"
+
+/**
+ * Macro program being encoded.
+ */
+struct macro_writer {
+    unsigned char* bytes;
+    Py_ssize_t size;
+    Py_ssize_t capacity;
+};
+
+static int macro_put(struct macro_writer* w, const void* data, Py_ssize_t size) {
+    unsigned char* bytes;
+    if (w->size + size > w->capacity) {
+        w->capacity = w->size + size > w->capacity * 2 ? w->size + size : w->capacity * 2;
+        bytes = (unsigned char*)PyMem_Realloc(w->bytes, w->capacity);
+        if (bytes == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        w->bytes = bytes;
+    }
+    memcpy(w->bytes + w->size, data, size);
+    w->size += size;
+    return 0;
+}
+
+/**
+ * Little-endian operand of `size` bytes.
+ */
+static int macro_put_int(struct macro_writer* w, unsigned long value, int size) {
+    int i;
+    unsigned char bytes[4];
+    for (i = 0; i < size; i++)
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    return macro_put(w, bytes, size);
+}
+
+/**
+ * Seconds as u32 milliseconds, None for as long as that goes.
+ */
+static int macro_put_ms(struct macro_writer* w, PyObject* seconds) {
+    double value;
+    if (seconds == NULL || seconds == Py_None)
+        return macro_put_int(w, 0xFFFFFFFFUL, 4);
+    value = PyFloat_AsDouble(seconds);
+    if (value == -1.0 && PyErr_Occurred())
+        return -1;
+    value = value < 0 ? 0 : value * 1000;
+    return macro_put_int(w, value >= 4294967295.0 ? 0xFFFFFFFFUL : (unsigned long)value, 4);
+}
+
+/**
+ * (x, y, width, height) or None for the whole screen.
+ */
+static int macro_put_rect(struct macro_writer* w, PyObject* rect) {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    if (rect != NULL && rect != Py_None &&
+            !PyArg_ParseTuple(rect, "iiii;rect must be (x, y, width, height)", &x, &y, &width, &height))
+        return -1;
+    if (macro_put_int(w, (unsigned long)x, 4) != 0 || macro_put_int(w, (unsigned long)y, 4) != 0 ||
+            macro_put_int(w, (unsigned long)width, 4) != 0 || macro_put_int(w, (unsigned long)height, 4) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Encode one step tuple, see compile_macro().
+ */
+static int macro_step(struct macro_writer* w, PyObject* step) {
+    const char* name;
+    unsigned char op;
+    int code;
+    int x;
+    int y;
+    int button = 1;
+    int width;
+    double delay = 0.0;
+    double threshold = 0.0;
+    const char* text;
+    Py_ssize_t length;
+    Py_ssize_t count;
+    PyObject* args;
+    PyObject* rect = Py_None;
+    PyObject* seconds = Py_None;
+    PyObject* pixels;
+    Py_buffer template;
+    int status = -1;
+    if (!PyTuple_Check(step) || PyTuple_GET_SIZE(step) == 0 || !PyUnicode_Check(PyTuple_GET_ITEM(step, 0))) {
+        PyErr_SetString(PyExc_TypeError, "macro steps are tuples starting with a name");
+        return -1;
+    }
+    name = PyUnicode_AsUTF8(PyTuple_GET_ITEM(step, 0));
+    if (name == NULL)
+        return -1;
+    args = PyTuple_GetSlice(step, 1, PyTuple_GET_SIZE(step));
+    if (args == NULL)
+        return -1;
+    if (strcmp(name, "key_down") == 0 || strcmp(name, "key_up") == 0) {
+        op = name[4] == 'd' ? MACRO_KEY_DOWN : MACRO_KEY_UP;
+        if (PyArg_ParseTuple(args, "i:key", &code)) {
+            if (code <= 0 || code > 0x1FF)
+                PyErr_SetString(PyExc_ValueError, "key must be a scancode, 0x100 set for extended keys");
+            else
+                status = macro_put(w, &op, 1) || macro_put_int(w, (unsigned long)code, 2) ? -1 : 0;
+        }
+    } else if (strcmp(name, "text") == 0) {
+        op = MACRO_TEXT;
+        if (PyArg_ParseTuple(args, "s|d:text", &text, &delay)) {
+            length = strlen(text);
+            status = macro_put(w, &op, 1) || macro_put_int(w, delay > 0 ? (unsigned long)(delay * 1000000) : 0, 4) ||
+                     macro_put_int(w, (unsigned long)length, 4) || macro_put(w, text, length) ? -1 : 0;
+        }
+    } else if (strcmp(name, "move") == 0) {
+        op = MACRO_MOVE;
+        if (PyArg_ParseTuple(args, "ii:move", &x, &y))
+            status = macro_put(w, &op, 1) || macro_put_int(w, (unsigned long)x, 2) ||
+                     macro_put_int(w, (unsigned long)y, 2) ? -1 : 0;
+    } else if (strcmp(name, "click") == 0 || strcmp(name, "button_down") == 0 || strcmp(name, "button_up") == 0) {
+        op = name[0] == 'c' ? MACRO_CLICK : name[7] == 'd' ? MACRO_BUTTON_DOWN : MACRO_BUTTON_UP;
+        if (PyArg_ParseTuple(args, "ii|i:click", &x, &y, &button)) {
+            if (button < 1 || button > 3)
+                PyErr_SetString(PyExc_ValueError, "button must be 1, 2 or 3");
+            else
+                status = macro_put(w, &op, 1) || macro_put_int(w, (unsigned long)button, 1) ||
+                         macro_put_int(w, (unsigned long)x, 2) || macro_put_int(w, (unsigned long)y, 2) ? -1 : 0;
+        }
+    } else if (strcmp(name, "delay") == 0) {
+        op = MACRO_DELAY;
+        if (PyArg_ParseTuple(args, "O:delay", &seconds))
+            status = macro_put(w, &op, 1) || macro_put_ms(w, seconds) ? -1 : 0;
+    } else if (strcmp(name, "wait_change") == 0) {
+        op = MACRO_WAIT_CHANGE;
+        if (PyArg_ParseTuple(args, "|OO:wait_change", &rect, &seconds))
+            status = macro_put(w, &op, 1) || macro_put_rect(w, rect) || macro_put_ms(w, seconds) ? -1 : 0;
+    } else if (strcmp(name, "wait_image") == 0) {
+        op = MACRO_WAIT_IMAGE;
+        if (PyArg_ParseTuple(args, "Oi|OdO:wait_image", &pixels, &width, &rect, &threshold, &seconds) &&
+                PyObject_GetBuffer(pixels, &template, PyBUF_SIMPLE) == 0) {
+            count = width > 0 ? template.len / ((Py_ssize_t)width * 4) : 0;
+            if (width <= 0 || width > 0xFFFF || count == 0 || count > 0xFFFF ||
+                    template.len != count * width * 4)
+                PyErr_SetString(PyExc_ValueError, "template must be width * height BGRA pixels");
+            else
+                status = macro_put(w, &op, 1) || macro_put_int(w, (unsigned long)width, 2) ||
+                         macro_put_int(w, (unsigned long)count, 2) ||
+                         macro_put_int(w, (unsigned long)(threshold * 1000000), 4) ||
+                         macro_put_rect(w, rect) || macro_put_ms(w, seconds) ||
+                         macro_put(w, template.buf, template.len) ? -1 : 0;
+            PyBuffer_Release(&template);
+        }
+    } else {
+        PyErr_Format(PyExc_ValueError, "unknown macro step %s", name);
+    }
+    Py_DECREF(args);
+    return status;
+}
+
+/**
+ * Encode a list of step tuples into a macro program:
+ *
+ *   ("key_down", scancode), ("key_up", scancode), extended keys with 0x100
+ *   ("text", text[, delay])
+ *   ("move", x, y)
+ *   ("click", x, y[, button]), ("button_down", ...), ("button_up", ...)
+ *   ("delay", seconds)
+ *   ("wait_change"[, rect[, timeout]])
+ *   ("wait_image", template, width[, rect[, threshold[, timeout]]])
+ *
+ * Rects are (x, y, width, height) or None for the whole screen,
+ * timeouts None to wait as long as it takes.
+ */
+PyObject* FreeRDP_compile_macro(PyObject* module, PyObject* steps) {
+    Py_ssize_t i;
+    PyObject* items;
+    PyObject* program = NULL;
+    struct macro_writer w = { NULL, 0, 0 };
+    items = PySequence_Fast(steps, "macro steps must be a sequence");
+    if (items == NULL)
+        return NULL;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(items); i++) {
+        if (macro_step(&w, PySequence_Fast_GET_ITEM(items, i)) != 0)
+            goto done;
+    }
+    program = PyBytes_FromStringAndSize((const char*)w.bytes, w.size);
+
+done:
+    PyMem_Free(w.bytes);
+    Py_DECREF(items);
+    return program;
+}
+
+PyObject* FreeRDP_macro_program(PyObject* program) {
+    if (PyObject_CheckBuffer(program))
+        return PyBytes_FromObject(program);
+    return FreeRDP_compile_macro(NULL, program);
+}
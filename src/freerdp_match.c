@@ -0,0 +1,114 @@
+#include <limits.h>
+#include <freerdp/freerdp.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAPI_X86 1
+#endif
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * Sum of absolute differences over a row of 32bpp pixels,
+ * ignoring the alpha byte.
+ */
+typedef unsigned long (*sad_row_fn)(const BYTE* a, const BYTE* b, int pixels);
+
+static unsigned long sad_row_scalar(const BYTE* a, const BYTE* b, int pixels) {
+    int i;
+    unsigned long sad = 0;
+    for (i = 0; i < pixels * 4; i += 4) {
+        sad += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        sad += a[i + 1] > b[i + 1] ? a[i + 1] - b[i + 1] : b[i + 1] - a[i + 1];
+        sad += a[i + 2] > b[i + 2] ? a[i + 2] - b[i + 2] : b[i + 2] - a[i + 2];
+    }
+    return sad;
+}
+
+#ifdef FAPI_X86
+static unsigned long sad_row_sse2(const BYTE* a, const BYTE* b, int pixels) {
+    int i = 0;
+    __m128i va;
+    __m128i vb;
+    __m128i acc = _mm_setzero_si128();
+    const __m128i mask = _mm_set1_epi32(0x00FFFFFF);
+    for (; i + 4 <= pixels; i += 4) {
+        va = _mm_and_si128(_mm_loadu_si128((const __m128i*)(a + i * 4)), mask);
+        vb = _mm_and_si128(_mm_loadu_si128((const __m128i*)(b + i * 4)), mask);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    acc = _mm_add_epi64(acc, _mm_srli_si128(acc, 8));
+    return (unsigned long)_mm_cvtsi128_si32(acc) + sad_row_scalar(a + i * 4, b + i * 4, pixels - i);
+}
+
+__attribute__((target("avx2")))
+static unsigned long sad_row_avx2(const BYTE* a, const BYTE* b, int pixels) {
+    int i = 0;
+    __m256i va;
+    __m256i vb;
+    __m256i acc = _mm256_setzero_si256();
+    const __m256i mask = _mm256_set1_epi32(0x00FFFFFF);
+    __m128i sum;
+    for (; i + 8 <= pixels; i += 8) {
+        va = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(a + i * 4)), mask);
+        vb = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(b + i * 4)), mask);
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+    }
+    sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi64(sum, _mm_srli_si128(sum, 8));
+    return (unsigned long)_mm_cvtsi128_si32(sum) + sad_row_sse2(a + i * 4, b + i * 4, pixels - i);
+}
+#endif
+
+/**
+ * Widest kernel the CPU supports, picked once.
+ */
+static sad_row_fn match_kernel(void) {
+    static sad_row_fn kernel = NULL;
+    if (kernel != NULL)
+        return kernel;
+#ifdef FAPI_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernel = sad_row_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        kernel = sad_row_sse2;
+    else
+#endif
+        kernel = sad_row_scalar;
+    return kernel;
+}
+
+/**
+ * Exhaustive SAD search of template positions whose top-left corner
+ * lies in `area`. Rows stop early once they exceed the best score so
+ * far, so the cost is dominated by near matches. Returns TRUE if
+ * `best` improved.
+ */
+BOOL match_search(const BYTE* frame, int stride, const BYTE* tpl, int tw, int th,
+                  rect_t area, unsigned long* best_sad, match_t* best) {
+    int x;
+    int y;
+    int row;
+    unsigned long sad;
+    BOOL found = FALSE;
+    sad_row_fn kernel = match_kernel();
+    for (y = area.y; y < area.y + area.height; y++) {
+        for (x = area.x; x < area.x + area.width; x++) {
+            sad = 0;
+            for (row = 0; row < th && sad <= *best_sad; row++)
+                sad += kernel(frame + (size_t)(y + row) * stride + (size_t)x * 4, tpl + (size_t)row * tw * 4, tw);
+            /* first position wins ties */
+            if (sad > *best_sad || (best->x >= 0 && sad == *best_sad))
+                continue;
+            *best_sad = sad;
+            best->x = x;
+            best->y = y;
+            found = TRUE;
+            if (sad == 0)
+                return TRUE;
+        }
+    }
+    return found;
+}
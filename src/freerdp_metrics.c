@@ -0,0 +1,244 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <freerdp/freerdp.h>
+#include <winpr/crt.h>
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * How often the session loop samples TCP_INFO, in nanoseconds.
+ */
+#define METRICS_TCP_INTERVAL 250000000ULL
+
+/**
+ * tcpi_state of an established connection, the kernel's TCP_ESTABLISHED
+ * which <linux/tcp.h> does not define.
+ */
+#define METRICS_TCP_ESTABLISHED 1
+
+/**
+ * Totals over all sessions, never reset.
+ */
+static metrics_t g_metrics;
+
+static const char* g_counter_names[METRIC_COUNTERS] = {
+    "bytes_in", "bytes_out", "segments_in", "segments_out", "pdus_out",
+    "paints", "dirty_pixels", "wakeups",
+    "input_submitted", "input_sent", "input_dropped",
+    "input_echo_timeouts", "mouse_moves_coalesced"
+};
+
+static const char* g_histogram_names[METRIC_HISTOGRAMS] = {
+    "check_fds", "input_latency"
+};
+
+const char* metric_name(int counter) {
+    return counter >= 0 && counter < METRIC_COUNTERS ? g_counter_names[counter] : NULL;
+}
+
+const char* histogram_name(int histogram) {
+    return histogram >= 0 && histogram < METRIC_HISTOGRAMS ? g_histogram_names[histogram] : NULL;
+}
+
+/**
+ * Add to a session counter and the process total.
+ */
+void fapi_count(Context* ctx, int counter, UINT64 n) {
+    __atomic_add_fetch(&ctx->metrics.counters[counter], n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_metrics.counters[counter], n, __ATOMIC_RELAXED);
+}
+
+static void histogram_add(histogram_t* h, int bucket, UINT64 ns) {
+    __atomic_add_fetch(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Record a duration in its log2 bucket.
+ */
+void fapi_observe(Context* ctx, int histogram, UINT64 ns) {
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= METRIC_BUCKETS)
+        bucket = METRIC_BUCKETS - 1;
+    histogram_add(&ctx->metrics.histograms[histogram], bucket, ns);
+    histogram_add(&g_metrics.histograms[histogram], bucket, ns);
+}
+
+/**
+ * Move a cumulative kernel figure into a counter as a delta,
+ * `slot` remembers the figure seen last for this socket.
+ */
+static void metrics_advance(Context* ctx, int counter, int slot, UINT64 value) {
+    if (value > ctx->tcp_seen[slot])
+        fapi_count(ctx, counter, value - ctx->tcp_seen[slot]);
+    ctx->tcp_seen[slot] = value;
+}
+
+/**
+ * Sample the session socket's TCP_INFO, at most every
+ * METRICS_TCP_INTERVAL. Runs on the session loop.
+ */
+void fapi_sample_tcp(Context* ctx) {
+    struct tcp_info info;
+    socklen_t size = sizeof(info);
+    UINT64 now = fapi_now();
+    if (ctx->sockfd < 0 || now - ctx->sampled < METRICS_TCP_INTERVAL)
+        return;
+    ctx->sampled = now;
+    ZeroMemory(&info, sizeof(info));
+    if (getsockopt(ctx->sockfd, IPPROTO_TCP, TCP_INFO, &info, &size) != 0)
+        return;
+    /* older kernels fill in a shorter struct */
+    if (size >= offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received)) {
+        metrics_advance(ctx, METRIC_BYTES_OUT, 0, info.tcpi_bytes_acked);
+        metrics_advance(ctx, METRIC_BYTES_IN, 1, info.tcpi_bytes_received);
+    }
+    if (size >= offsetof(struct tcp_info, tcpi_segs_in) + sizeof(info.tcpi_segs_in)) {
+        metrics_advance(ctx, METRIC_SEGMENTS_OUT, 2, info.tcpi_segs_out);
+        metrics_advance(ctx, METRIC_SEGMENTS_IN, 3, info.tcpi_segs_in);
+    }
+}
+
+/**
+ * Whether the session socket is still an established connection.
+ */
+BOOL fapi_tcp_alive(Context* ctx) {
+    struct tcp_info info;
+    socklen_t size = sizeof(info);
+    if (ctx->sockfd < 0 || getsockopt(ctx->sockfd, IPPROTO_TCP, TCP_INFO, &info, &size) != 0)
+        return FALSE;
+    return info.tcpi_state == METRICS_TCP_ESTABLISHED;
+}
+
+/**
+ * Relaxed copy, each value is consistent on its own.
+ */
+static void metrics_copy(metrics_t* out, metrics_t* in) {
+    int i;
+    int b;
+    for (i = 0; i < METRIC_COUNTERS; i++)
+        out->counters[i] = __atomic_load_n(&in->counters[i], __ATOMIC_RELAXED);
+    for (i = 0; i < METRIC_HISTOGRAMS; i++) {
+        out->histograms[i].count = __atomic_load_n(&in->histograms[i].count, __ATOMIC_RELAXED);
+        out->histograms[i].sum = __atomic_load_n(&in->histograms[i].sum, __ATOMIC_RELAXED);
+        for (b = 0; b < METRIC_BUCKETS; b++)
+            out->histograms[i].buckets[b] = __atomic_load_n(&in->histograms[i].buckets[b], __ATOMIC_RELAXED);
+    }
+}
+
+int session_metrics(session_t session, metrics_t* metrics) {
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    metrics_copy(metrics, &context->metrics);
+    fapi_release(context);
+    return 1;
+}
+
+void process_metrics(metrics_t* metrics) {
+    metrics_copy(metrics, &g_metrics);
+}
+
+/**
+ * Growable text buffer, NULL data once memory ran out.
+ */
+struct text {
+    char* data;
+    size_t length;
+    size_t capacity;
+};
+
+static void text_printf(struct text* t, const char* format, ...) {
+    int n;
+    char* grown;
+    va_list args;
+    if (t->data == NULL)
+        return;
+    for (;;) {
+        va_start(args, format);
+        n = vsnprintf(t->data + t->length, t->capacity - t->length, format, args);
+        va_end(args);
+        if (n < 0) {
+            free(t->data);
+            t->data = NULL;
+            return;
+        }
+        if ((size_t)n < t->capacity - t->length) {
+            t->length += n;
+            return;
+        }
+        grown = (char*)realloc(t->data, t->capacity * 2 + n);
+        if (grown == NULL) {
+            free(t->data);
+            t->data = NULL;
+            return;
+        }
+        t->data = grown;
+        t->capacity = t->capacity * 2 + n;
+    }
+}
+
+/**
+ * One counter of every session, samples of a family stay together.
+ */
+struct session_text {
+    struct text* text;
+    int counter;
+};
+
+static void metrics_session_text(Context* ctx, void* arg) {
+    struct session_text* st = (struct session_text*)arg;
+    text_printf(st->text, "freerdp_session_%s_total{session=\"%llu\"} %llu\n",
+                g_counter_names[st->counter], (unsigned long long)ctx->session,
+                (unsigned long long)__atomic_load_n(&ctx->metrics.counters[st->counter], __ATOMIC_RELAXED));
+}
+
+char* metrics_text(int sessions) {
+    int i;
+    int b;
+    UINT64 cumulative;
+    metrics_t m;
+    struct text t;
+    struct session_text st;
+    t.capacity = 4096;
+    t.length = 0;
+    t.data = (char*)malloc(t.capacity);
+    process_metrics(&m);
+    for (i = 0; i < METRIC_COUNTERS; i++) {
+        text_printf(&t, "# TYPE freerdp_%s_total counter\n", g_counter_names[i]);
+        text_printf(&t, "freerdp_%s_total %llu\n", g_counter_names[i], m.counters[i]);
+    }
+    text_printf(&t, "# TYPE freerdp_input_queue_depth gauge\nfreerdp_input_queue_depth %lld\n",
+                (long long)(m.counters[METRIC_INPUT_SUBMITTED] - m.counters[METRIC_INPUT_SENT] -
+                            m.counters[METRIC_INPUT_DROPPED]));
+    text_printf(&t, "# TYPE freerdp_live_sessions gauge\nfreerdp_live_sessions %d\n", live_sessions());
+    for (i = 0; i < METRIC_HISTOGRAMS; i++) {
+        text_printf(&t, "# TYPE freerdp_%s_seconds histogram\n", g_histogram_names[i]);
+        cumulative = 0;
+        for (b = 0; b < METRIC_BUCKETS - 1; b++) {
+            cumulative += m.histograms[i].buckets[b];
+            text_printf(&t, "freerdp_%s_seconds_bucket{le=\"%.9g\"} %llu\n",
+                        g_histogram_names[i], (double)(1ULL << b) / 1e9, cumulative);
+        }
+        cumulative += m.histograms[i].buckets[METRIC_BUCKETS - 1];
+        text_printf(&t, "freerdp_%s_seconds_bucket{le=\"+Inf\"} %llu\n", g_histogram_names[i], cumulative);
+        text_printf(&t, "freerdp_%s_seconds_sum %.9f\n", g_histogram_names[i], (double)m.histograms[i].sum / 1e9);
+        text_printf(&t, "freerdp_%s_seconds_count %llu\n", g_histogram_names[i], cumulative);
+    }
+    st.text = &t;
+    for (i = 0; sessions && i < METRIC_COUNTERS; i++) {
+        text_printf(&t, "# TYPE freerdp_session_%s_total counter\n", g_counter_names[i]);
+        st.counter = i;
+        registry_each(metrics_session_text, &st);
+    }
+    return t.data;
+}
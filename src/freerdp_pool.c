@@ -0,0 +1,366 @@
+#include <pthread.h>
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <freerdp/freerdp.h>
+#include <winpr/crt.h>
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * Where a pool session is, kept in its pool_state
+ * and only changed under the pool lock.
+ */
+#define POOL_NONE     0
+#define POOL_STARTING 1
+#define POOL_IDLE     2
+#define POOL_BUSY     3
+
+/**
+ * Pause after a failed connect before starting
+ * another session, in nanoseconds.
+ */
+#define POOL_RETRY 1000000000ULL
+
+/**
+ * Idle sessions are kept newest last and handed out from
+ * there. Every session the pool started holds a reference
+ * until it closes, the pool's owner holds one more.
+ */
+struct session_pool {
+    session_template_t* tpl;
+    int size;
+    UINT64 health;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t wake;
+    pthread_t thread;
+    session_t* idle;
+    session_t* drop;
+    int nidle;
+    int starting;
+    int busy;
+    int refs;
+    BOOL closing;
+    UINT64 retry_at;
+};
+
+/**
+ * Wait on a pool condition until an absolute monotonic time.
+ */
+static void pool_wait(struct session_pool* pool, pthread_cond_t* cond, UINT64 deadline) {
+    struct timespec until;
+    until.tv_sec = deadline / 1000000000ULL;
+    until.tv_nsec = deadline % 1000000000ULL;
+    pthread_cond_timedwait(cond, &pool->lock, &until);
+}
+
+static void pool_destroy(struct session_pool* pool) {
+    pthread_cond_destroy(&pool->ready);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->idle);
+    free(pool->drop);
+    free(pool);
+}
+
+/**
+ * Take the idle session at `index` out of the list. Pool lock held.
+ */
+static session_t pool_take(struct session_pool* pool, int index) {
+    session_t session = pool->idle[index];
+    memmove(&pool->idle[index], &pool->idle[index + 1], (pool->nidle - index - 1) * sizeof(session_t));
+    pool->nidle--;
+    return session;
+}
+
+/**
+ * Park a session as idle with its output paused. Pool lock held.
+ */
+static void pool_park(struct session_pool* pool, Context* ctx) {
+    ctx->pool_state = POOL_IDLE;
+    pool->idle[pool->nidle++] = ctx->session;
+    if (!ctx->headless)
+        pause_updates(ctx->session);
+    pthread_cond_signal(&pool->ready);
+}
+
+/**
+ * Start one session from the template. Pool lock held.
+ */
+static void pool_start(struct session_pool* pool) {
+    Context* ctx;
+    freerdp* instance = fapi_template_instance(pool->tpl, NULL, NULL);
+    if (instance == NULL) {
+        pool->retry_at = fapi_now() + POOL_RETRY;
+        return;
+    }
+    ctx = (Context*)instance->context;
+    ctx->pool = pool;
+    ctx->pool_state = POOL_STARTING;
+    /* dropped connections come back with the server's cookie */
+    instance->settings->AutoReconnectionEnabled = TRUE;
+    pool->starting++;
+    pool->refs++;
+    if (fapi_launch(instance) == 0) {
+        pool->starting--;
+        pool->refs--;
+        pool->retry_at = fapi_now() + POOL_RETRY;
+    }
+}
+
+/**
+ * Probe every idle session on its own loop. One that has not
+ * answered the previous probe is moved to the drop list.
+ * Returns how many were. Pool lock held.
+ */
+static int pool_probe(struct session_pool* pool) {
+    int i;
+    int dropped = 0;
+    Context* ctx;
+    for (i = pool->nidle - 1; i >= 0; i--) {
+        ctx = registry_get(pool->idle[i]);
+        if (ctx == NULL)
+            continue;
+        if (ctx->reconnecting) {
+            /* the loop is busy in the handshake */
+        } else if (__atomic_load_n(&ctx->probe_done, __ATOMIC_ACQUIRE) != ctx->probe_request) {
+            ctx->pool_state = POOL_NONE;
+            pool->drop[dropped++] = pool_take(pool, i);
+        } else {
+            __atomic_add_fetch(&ctx->probe_request, 1, __ATOMIC_RELEASE);
+            fapi_wake(ctx);
+        }
+        fapi_release(ctx);
+    }
+    return dropped;
+}
+
+/**
+ * Pool thread, keeps the idle sessions topped up and probed.
+ */
+static void* pool_func(void* param) {
+    int i;
+    int dropped;
+    UINT64 now;
+    UINT64 deadline;
+    struct session_pool* pool = (struct session_pool*)param;
+    UINT64 probe_at = fapi_now() + pool->health;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->closing) {
+        now = fapi_now();
+        while (pool->nidle + pool->starting < pool->size && now >= pool->retry_at)
+            pool_start(pool);
+        if (pool->health != 0 && now >= probe_at) {
+            probe_at = now + pool->health;
+            dropped = pool_probe(pool);
+            if (dropped > 0) {
+                pthread_mutex_unlock(&pool->lock);
+                for (i = 0; i < dropped; i++)
+                    release(pool->drop[i]);
+                pthread_mutex_lock(&pool->lock);
+                continue;
+            }
+        }
+        deadline = pool->health != 0 ? probe_at : now + 60 * 1000000000ULL;
+        if (pool->nidle + pool->starting < pool->size && pool->retry_at < deadline)
+            deadline = pool->retry_at;
+        pool_wait(pool, &pool->wake, deadline);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+session_pool_t* pool_new(session_template_t* tpl, int size, int ms_health) {
+    pthread_condattr_t attr;
+    struct session_pool* pool;
+    if (tpl == NULL || size <= 0)
+        return NULL;
+    pool = (struct session_pool*)calloc(1, sizeof(struct session_pool));
+    if (pool == NULL)
+        return NULL;
+    pool->idle = (session_t*)calloc(size, sizeof(session_t));
+    pool->drop = (session_t*)calloc(size, sizeof(session_t));
+    if (pool->idle == NULL || pool->drop == NULL) {
+        free(pool->idle);
+        free(pool->drop);
+        free(pool);
+        return NULL;
+    }
+    pool->tpl = tpl;
+    pool->size = size;
+    pool->health = ms_health > 0 ? (UINT64)ms_health * 1000000 : 0;
+    pool->refs = 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->ready, &attr);
+    pthread_cond_init(&pool->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&pool->thread, 0, pool_func, pool) != 0) {
+        fprintf(stderr, "pool_new: thread start failed\n");
+        pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+session_t pool_acquire(session_pool_t* pool, int ms_timeout) {
+    int i;
+    Context* ctx = NULL;
+    session_t session = 0;
+    UINT64 deadline = ms_timeout > 0 ? fapi_now() + (UINT64)ms_timeout * 1000000 : 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        for (i = pool->nidle - 1; i >= 0 && session == 0; i--) {
+            ctx = registry_get(pool->idle[i]);
+            if (ctx != NULL && !ctx->reconnecting && !ctx->closed && !ctx->shutdown)
+                session = pool_take(pool, i);
+            else if (ctx != NULL)
+                fapi_release(ctx);
+        }
+        if (session != 0 || pool->closing || ms_timeout == 0)
+            break;
+        if (ms_timeout < 0)
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        else if (fapi_now() >= deadline)
+            break;
+        else
+            pool_wait(pool, &pool->ready, deadline);
+    }
+    if (session != 0) {
+        ctx->pool_state = POOL_BUSY;
+        pool->busy++;
+        if (!ctx->headless)
+            resume_updates(session, NULL);
+        fapi_release(ctx);
+        /* start a replacement */
+        pthread_cond_signal(&pool->wake);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return session;
+}
+
+void pool_release(session_pool_t* pool, session_t session, int reuse) {
+    BOOL keep = FALSE;
+    Context* ctx = registry_get(session);
+    if (ctx == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    if (ctx->pool == pool && ctx->pool_state == POOL_BUSY) {
+        pool->busy--;
+        ctx->pool_state = POOL_NONE;
+        keep = reuse && !pool->closing && !ctx->closed && !ctx->shutdown && pool->nidle < pool->size;
+        if (keep)
+            pool_park(pool, ctx);
+        pthread_cond_signal(&pool->wake);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    fapi_release(ctx);
+    if (!keep)
+        release(session);
+}
+
+void pool_counts(session_pool_t* pool, int* idle, int* starting, int* busy) {
+    pthread_mutex_lock(&pool->lock);
+    *idle = pool->nidle;
+    *starting = pool->starting;
+    *busy = pool->busy;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(session_pool_t* pool) {
+    int i;
+    int count;
+    BOOL last;
+    Context* ctx;
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = TRUE;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    /* the drop list is the pool thread's until it is gone */
+    pthread_join(pool->thread, NULL);
+    pthread_mutex_lock(&pool->lock);
+    count = pool->nidle;
+    for (i = 0; i < count; i++) {
+        pool->drop[i] = pool->idle[i];
+        ctx = registry_get(pool->idle[i]);
+        if (ctx != NULL) {
+            ctx->pool_state = POOL_NONE;
+            fapi_release(ctx);
+        }
+    }
+    pool->nidle = 0;
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < count; i++)
+        release(pool->drop[i]);
+    /* sessions still connecting are stopped as they come up */
+    pthread_mutex_lock(&pool->lock);
+    last = --pool->refs == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (last)
+        pool_destroy(pool);
+}
+
+/**
+ * A pool session finished connecting, park it.
+ */
+void fapi_pool_connected(Context* ctx) {
+    BOOL drop = FALSE;
+    struct session_pool* pool = ctx->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (ctx->pool_state == POOL_STARTING) {
+        pool->starting--;
+        ctx->pool_state = POOL_NONE;
+        if (pool->closing || pool->nidle >= pool->size)
+            drop = TRUE;
+        else
+            pool_park(pool, ctx);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (drop)
+        release(ctx->session);
+}
+
+/**
+ * A pool session is closing, forget it and let go of the pool.
+ */
+void fapi_pool_closed(Context* ctx) {
+    int i;
+    BOOL last;
+    BOOL drop = FALSE;
+    struct session_pool* pool = ctx->pool;
+    pthread_mutex_lock(&pool->lock);
+    switch (ctx->pool_state) {
+    case POOL_STARTING:
+        /* the connect failed, don't retry at once */
+        pool->starting--;
+        pool->retry_at = fapi_now() + POOL_RETRY;
+        break;
+    case POOL_IDLE:
+        for (i = 0; i < pool->nidle; i++) {
+            if (pool->idle[i] == ctx->session) {
+                pool_take(pool, i);
+                break;
+            }
+        }
+        drop = TRUE;
+        break;
+    case POOL_BUSY:
+        pool->busy--;
+        break;
+    }
+    ctx->pool_state = POOL_NONE;
+    ctx->pool = NULL;
+    last = --pool->refs == 0;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    if (drop)
+        release(ctx->session);
+    if (last)
+        pool_destroy(pool);
+}
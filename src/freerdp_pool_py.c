@@ -0,0 +1,269 @@
+#include <Python.h>
+#include "freerdp.h"
+#include "freerdp_py.h"
+
+/**
+ * Warm sessions from a SessionTemplate. Keeps the template and
+ * every handed out FreeRDP alive, by session, until released.
+ */
+typedef struct {
+    PyObject_HEAD
+    session_pool_t* _pool;
+    PyObject* _template;
+    PyObject* _acquired;
+} SessionPool;
+
+/**
+ * Hand back every acquired session and free the pool.
+ */
+static void SessionPool_free(SessionPool* self) {
+    Py_ssize_t pos = 0;
+    PyObject* key;
+    PyObject* value;
+    FreeRDP* client;
+    if (self->_pool == NULL)
+        return;
+    while (self->_acquired != NULL && PyDict_Next(self->_acquired, &pos, &key, &value)) {
+        client = (FreeRDP*)value;
+        set_session_owner(client->_session, NULL);
+        pool_release(self->_pool, client->_session, 0);
+        client->_session = 0;
+    }
+    if (self->_acquired != NULL)
+        PyDict_Clear(self->_acquired);
+    Py_BEGIN_ALLOW_THREADS
+    pool_free(self->_pool);
+    Py_END_ALLOW_THREADS
+    self->_pool = NULL;
+}
+
+static int SessionPool_trav(SessionPool* self, visitproc visit, void* arg) {
+    Py_VISIT(self->_template);
+    Py_VISIT(self->_acquired);
+    return 0;
+}
+
+static int SessionPool_clear(SessionPool* self) {
+    SessionPool_free(self);
+    Py_CLEAR(self->_acquired);
+    Py_CLEAR(self->_template);
+    return 0;
+}
+
+static void SessionPool_dealloc(SessionPool* self) {
+    PyObject_GC_UnTrack(self);
+    SessionPool_clear(self);
+    Py_TYPE(self)->tp_free(self);
+}
+
+/**
+ * Start `size` sessions from the template, probed every `health` seconds.
+ */
+static int SessionPool_init(SessionPool* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"template", "size", "health", NULL};
+    int size;
+    double health = 5.0;
+    PyObject* tpl;
+    session_template_t* native;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|d:SessionPool", keywords, &tpl, &size, &health))
+        return -1;
+    if (self->_pool != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "pool already started");
+        return -1;
+    }
+    native = FreeRDP_template(tpl);
+    if (native == NULL)
+        return -1;
+    if (size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "size must be positive");
+        return -1;
+    }
+    Py_XSETREF(self->_acquired, PyDict_New());
+    if (self->_acquired == NULL)
+        return -1;
+    self->_pool = pool_new(native, size, health > 0 ? (int)(health * 1000) : 0);
+    if (self->_pool == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "failed to start pool");
+        return -1;
+    }
+    Py_INCREF(tpl);
+    Py_XSETREF(self->_template, tpl);
+    return 0;
+}
+
+static int SessionPool_check(SessionPool* self) {
+    if (self->_pool != NULL)
+        return 0;
+    PyErr_SetString(PyExc_RuntimeError, "pool closed");
+    return -1;
+}
+
+/**
+ * Take a connected session, waiting without the GIL up to `timeout`
+ * seconds, for ever by default. Returns a FreeRDP, None on timeout.
+ */
+static PyObject* SessionPool_acquire(SessionPool* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"timeout", "on_event", NULL};
+    int ms_timeout = -1;
+    double seconds;
+    session_t session;
+    PyObject* key;
+    PyObject* timeout = Py_None;
+    PyObject* onEvent = Py_None;
+    FreeRDP* client;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO:acquire", keywords, &timeout, &onEvent))
+        return NULL;
+    if (SessionPool_check(self) != 0)
+        return NULL;
+    if (onEvent != Py_None && !PyCallable_Check(onEvent)) {
+        PyErr_SetString(PyExc_TypeError, "callbacks must be callable");
+        return NULL;
+    }
+    if (timeout != Py_None) {
+        seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1.0 && PyErr_Occurred())
+            return NULL;
+        ms_timeout = seconds < 0 ? 0 : (int)(seconds * 1000);
+    }
+    if (FreeRDP_start_dispatcher() != 0)
+        return NULL;
+    client = (FreeRDP*)FreeRDPType.tp_alloc(&FreeRDPType, 0);
+    if (client == NULL)
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    session = pool_acquire(self->_pool, ms_timeout);
+    Py_END_ALLOW_THREADS
+    if (session == 0) {
+        Py_DECREF(client);
+        Py_RETURN_NONE;
+    }
+    key = PyLong_FromUnsignedLongLong(session);
+    if (key == NULL || PyDict_SetItem(self->_acquired, key, (PyObject*)client) != 0) {
+        Py_XDECREF(key);
+        Py_DECREF(client);
+        pool_release(self->_pool, session, 1);
+        return NULL;
+    }
+    Py_DECREF(key);
+    if (onEvent != Py_None) {
+        Py_INCREF(onEvent);
+        client->_onEvent = onEvent;
+    }
+    set_session_owner(session, client);
+    client->_session = session;
+    return (PyObject*)client;
+}
+
+/**
+ * Hand a session back, for reuse unless `reuse` is False. The
+ * FreeRDP object is detached from it either way.
+ */
+static PyObject* SessionPool_release(SessionPool* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"client", "reuse", NULL};
+    int reuse = 1;
+    session_t session;
+    PyObject* key;
+    PyObject* found;
+    FreeRDP* client;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|p:release", keywords, &FreeRDPType, &client, &reuse))
+        return NULL;
+    if (SessionPool_check(self) != 0)
+        return NULL;
+    session = client->_session;
+    key = PyLong_FromUnsignedLongLong(session);
+    if (key == NULL)
+        return NULL;
+    found = PyDict_GetItem(self->_acquired, key);
+    if (found != (PyObject*)client) {
+        Py_DECREF(key);
+        PyErr_SetString(PyExc_ValueError, "session not acquired from this pool");
+        return NULL;
+    }
+    set_session_owner(session, NULL);
+    client->_session = 0;
+    Py_CLEAR(client->_onEvent);
+    pool_release(self->_pool, session, reuse);
+    /* may drop the last reference to client */
+    if (PyDict_DelItem(self->_acquired, key) != 0) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    Py_DECREF(key);
+    Py_RETURN_NONE;
+}
+
+static PyObject* SessionPool_close(SessionPool* self, PyObject* unused) {
+    SessionPool_free(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject* SessionPool_get_counts(SessionPool* self, void* closure) {
+    int idle;
+    int starting;
+    int busy;
+    if (SessionPool_check(self) != 0)
+        return NULL;
+    pool_counts(self->_pool, &idle, &starting, &busy);
+    return Py_BuildValue("{sisisi}", "idle", idle, "starting", starting, "busy", busy);
+}
+
+static PyMethodDef SessionPool_methods[] = {
+    {"acquire", (PyCFunction)SessionPool_acquire, METH_VARARGS | METH_KEYWORDS, "Take a connected session"},
+    {"release", (PyCFunction)SessionPool_release, METH_VARARGS | METH_KEYWORDS, "Hand a session back"},
+    {"close", (PyCFunction)SessionPool_close, METH_NOARGS, "Release everything and stop the pool"},
+    {NULL}
+};
+
+static PyGetSetDef SessionPool_getset[] = {
+    {"counts", (getter)SessionPool_get_counts, NULL, "Sessions idle, starting and busy", NULL},
+    {NULL}
+};
+
+static PyTypeObject SessionPoolType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "freerdp.SessionPool",        /* tp_name */
+    sizeof(SessionPool),          /* tp_basicsize */
+    0,                            /* tp_itemsize */
+    (destructor)SessionPool_dealloc, /* tp_dealloc */
+    0,                            /* tp_print */
+    0,                            /* tp_getattr */
+    0,                            /* tp_setattr */
+    0,                            /* tp_reserved */
+    0,                            /* tp_repr */
+    0,                            /* tp_as_number */
+    0,                            /* tp_as_sequence */
+    0,                            /* tp_as_mapping */
+    0,                            /* tp_hash */
+    0,                            /* tp_call */
+    0,                            /* tp_str */
+    0,                            /* tp_getattro */
+    0,                            /* tp_setattro */
+    0,                            /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT |
+        Py_TPFLAGS_HAVE_GC,       /* tp_flags */
+    "Pre-connected sessions from a SessionTemplate", /* tp_doc */
+    (traverseproc)SessionPool_trav, /* tp_traverse */
+    (inquiry)SessionPool_clear,   /* tp_clear */
+    0,                            /* tp_richcompare */
+    0,                            /* tp_weaklistoffset */
+    0,                            /* tp_iter */
+    0,                            /* tp_iternext */
+    SessionPool_methods,          /* tp_methods */
+    0,                            /* tp_members */
+    SessionPool_getset,           /* tp_getset */
+    0,                            /* tp_base */
+    0,                            /* tp_dict */
+    0,                            /* tp_descr_get */
+    0,                            /* tp_descr_set */
+    0,                            /* tp_dictoffset */
+    (initproc)SessionPool_init,   /* tp_init */
+    0,                            /* tp_alloc */
+    PyType_GenericNew,            /* tp_new */
+};
+
+int FreeRDP_AddPool(PyObject* module) {
+    if (PyType_Ready(&SessionPoolType) < 0)
+        return -1;
+    Py_INCREF(&SessionPoolType);
+    return PyModule_AddObject(module, "SessionPool", (PyObject*)&SessionPoolType);
+}
@@ -1,42 +1,185 @@
 #include <Python.h>
 #include <structmember.h>
 #include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include "freerdp.h"
+#include "freerdp_py.h"
 #include "freerdp_const_py.h"
 
 #define FR_LOG(MSG) fprintf(stderr, "%s\n", MSG); 
-#define FR_DEBUG(MSG) fprintf(stderr, "%s\n", MSG);
+
+/**
+ * Entry point tracing, built with FAPI_TRACE and
+ * switched on by FREERDP_DEBUG in the environment.
+ */
+#ifdef FAPI_TRACE
+static int g_trace = 0;
+#define FR_DEBUG(MSG) if (g_trace) fprintf(stderr, "%s\n", MSG);
+#else
+#define FR_DEBUG(MSG)
+#endif
 #define GETSTATE(m) ((struct module_state*)PyModule_GetState(m))
 
+/**
+ * Events handed to Python per GIL acquisition.
+ */
+#define DISPATCH_BATCH 256
+
 /**
  * Global pointer to module.
  */
 PyObject* __global_module = NULL;
 
 /**
- * Module level mapping tracking C pointers
- * for callbacks.
+ * Module level state, the event dispatcher thread.
  */
 struct module_state {
-    PyObject* _module_instanceMap;
+    pthread_t _dispatcher;
+    int _dispatching;
+    int _external;
+    int _stopfd;
 };
 
 /**
- * Defines the FreeRDP class data.
+ * Exports session memory through the buffer protocol
+ * without copying. Keeps its FreeRDP owner, and so the
+ * session, alive while any view exists.
  */
 typedef struct {
     PyObject_HEAD
-    PyObject* _instance;
-    PyObject* _onConnect;
-} FreeRDP;
+    PyObject* owner;
+    void* buf;
+    Py_ssize_t len;
+    char* format;
+    int ndim;
+    Py_ssize_t shape[3];
+    Py_ssize_t strides[3];
+} BufferView;
+
+static void BufferView_dealloc(BufferView* self) {
+    Py_XDECREF(self->owner);
+    Py_TYPE(self)->tp_free(self);
+}
+
+/**
+ * Fill in a read-only view, flattened if the consumer
+ * does not ask for shape.
+ */
+static int BufferView_getbuffer(BufferView* self, Py_buffer* view, int flags) {
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "session buffers are read-only");
+        view->obj = NULL;
+        return -1;
+    }
+    view->obj = (PyObject*)self;
+    Py_INCREF(self);
+    view->buf = self->buf;
+    view->len = self->len;
+    view->readonly = 1;
+    view->itemsize = self->strides[self->ndim - 1];
+    view->format = (flags & PyBUF_FORMAT) ? self->format : NULL;
+    view->ndim = self->ndim;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    if (view->shape == NULL) {
+        view->ndim = 1;
+        view->itemsize = 1;
+        view->format = (flags & PyBUF_FORMAT) ? "B" : NULL;
+    }
+    return 0;
+}
+
+static PyBufferProcs BufferView_as_buffer = {
+    (getbufferproc)BufferView_getbuffer,
+    NULL
+};
+
+static PyTypeObject BufferViewType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "freerdp._BufferView",        /* tp_name */
+    sizeof(BufferView),           /* tp_basicsize */
+    0,                            /* tp_itemsize */
+    (destructor)BufferView_dealloc, /* tp_dealloc */
+    0,                            /* tp_print */
+    0,                            /* tp_getattr */
+    0,                            /* tp_setattr */
+    0,                            /* tp_reserved */
+    0,                            /* tp_repr */
+    0,                            /* tp_as_number */
+    0,                            /* tp_as_sequence */
+    0,                            /* tp_as_mapping */
+    0,                            /* tp_hash  */
+    0,                            /* tp_call */
+    0,                            /* tp_str */
+    0,                            /* tp_getattro */
+    0,                            /* tp_setattro */
+    &BufferView_as_buffer,        /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,           /* tp_flags */
+    "Session memory export",      /* tp_doc */
+};
+
+/**
+ * Memoryview over session memory, rows of pixels, or one row
+ * of `width` items for a height of 0.
+ */
+static PyObject* BufferView_memoryview(PyObject* owner, void* buf, int width, int height,
+                                       int stride, int bytes_per_pixel, char* format) {
+    PyObject* memory;
+    BufferView* view = PyObject_New(BufferView, &BufferViewType);
+    if (view == NULL)
+        return NULL;
+    Py_INCREF(owner);
+    view->owner = owner;
+    view->buf = buf;
+    view->len = (Py_ssize_t)height * stride;
+    view->format = format;
+    if (height == 0) {
+        view->len = (Py_ssize_t)width * bytes_per_pixel;
+        view->ndim = 1;
+        view->shape[0] = width;
+        view->strides[0] = bytes_per_pixel;
+        memory = PyMemoryView_FromObject((PyObject*)view);
+        Py_DECREF(view);
+        return memory;
+    }
+    if (format[0] == 'B') {
+        view->ndim = 3;
+        view->shape[2] = bytes_per_pixel;
+        view->strides[2] = 1;
+    } else {
+        view->ndim = 2;
+    }
+    view->shape[0] = height;
+    view->shape[1] = width;
+    view->strides[0] = stride;
+    view->strides[1] = bytes_per_pixel;
+    memory = PyMemoryView_FromObject((PyObject*)view);
+    Py_DECREF(view);
+    return memory;
+}
+
+/**
+ * Session handle held by the object.
+ */
+static session_t FreeRDP_session(FreeRDP* self) {
+    if (self->_session == 0)
+        PyErr_SetString(PyExc_RuntimeError, "session not started");
+    return self->_session;
+}
 
 /**
  * Cyclic garbace collection.
  */
 static int FreeRDP_trav(FreeRDP* self, visitproc visit, void* arg) {
     FR_DEBUG("FreeRDP_trav+")
-    Py_VISIT(self->_instance);
     Py_VISIT(self->_onConnect);
+    Py_VISIT(self->_onEvent);
     //Py_XDECREF(self);
     FR_DEBUG("-FreeRDP_trav")
     return 0;
@@ -47,8 +190,8 @@ static int FreeRDP_trav(FreeRDP* self, visitproc visit, void* arg) {
  */
 static int FreeRDP_clear(FreeRDP* self) {
     FR_DEBUG("FreeRDP_clear+")
-    Py_CLEAR(self->_instance);
     Py_CLEAR(self->_onConnect);
+    Py_CLEAR(self->_onEvent);
     FR_DEBUG("-FreeRDP_clear")
     return 0;
 }
@@ -58,32 +201,151 @@ static int FreeRDP_clear(FreeRDP* self) {
  */
 static void FreeRDP_dealloc(FreeRDP* self) {
     FR_DEBUG("FreeRDP_dealloc+")
-    stop(PyCapsule_GetPointer(self->_instance, NULL));
+    if (self->_session != 0) {
+        stop(self->_session);
+        release(self->_session);
+        self->_session = 0;
+    }
     FreeRDP_clear(self);
     Py_TYPE(self)->tp_free(self);
     FR_DEBUG("-FreeRDP_dealloc")
 }
 
 /**
- * Static callback point for 'onConnect' event.
- * Maps the callback back to the instance that
- * initiated it.
+ * Call one handler, reporting rather than raising its errors.
+ */
+static void FreeRDP_call(PyObject* callable, PyObject* self, PyObject* type, PyObject* arg) {
+    PyObject* result = PyObject_CallFunctionObjArgs(callable, self, type, arg, NULL);
+    if (result == NULL)
+        PyErr_WriteUnraisable(callable);
+    Py_XDECREF(result);
+}
+
+/**
+ * Hand a batch of events to their sessions' objects. Needs the GIL.
+ * Owners are looked up per event, so objects released meanwhile
+ * are skipped.
+ */
+static void FreeRDP_dispatch(const event_t* events, int count) {
+    int index;
+    FreeRDP* self;
+    PyObject* type;
+    PyObject* arg;
+    for (index = 0; index < count; ++index) {
+        self = (FreeRDP*)session_owner(events[index].session);
+        if (self == NULL)
+            continue;
+        Py_INCREF(self);
+        if (self->_handler != NULL)
+            self->_handler(self, &events[index]);
+        if (events[index].type == EVENT_CONNECT && self->_onConnect != NULL)
+            FreeRDP_call(self->_onConnect, (PyObject*)self, NULL, NULL);
+        if (self->_onEvent != NULL) {
+            type = PyLong_FromLong(events[index].type);
+            arg = PyLong_FromUnsignedLong(events[index].arg);
+            if (type != NULL && arg != NULL)
+                FreeRDP_call(self->_onEvent, (PyObject*)self, type, arg);
+            else
+                PyErr_Clear();
+            Py_XDECREF(type);
+            Py_XDECREF(arg);
+        }
+        Py_DECREF(self);
+    }
+}
+
+/**
+ * Dispatcher thread, sleeps on the event descriptor and takes the
+ * GIL once per batch instead of once per callback.
+ */
+static void* FreeRDP_dispatcher(void* param) {
+    int count;
+    PyGILState_STATE gil;
+    struct pollfd fds[2];
+    event_t events[DISPATCH_BATCH];
+    struct module_state* state = (struct module_state*)param;
+    fds[0].fd = event_fd();
+    fds[0].events = POLLIN;
+    fds[1].fd = state->_stopfd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents != 0)
+            break;
+        count = poll_events(events, DISPATCH_BATCH);
+        if (count == 0)
+            continue;
+        gil = PyGILState_Ensure();
+        FreeRDP_dispatch(events, count);
+        PyGILState_Release(gil);
+    }
+    return NULL;
+}
+
+/**
+ * Start the dispatcher with the first session.
+ */
+int FreeRDP_start_dispatcher(void) {
+    struct module_state* state = GETSTATE(__global_module);
+    if (state->_dispatching || state->_external)
+        return 0;
+    if (state->_stopfd == -1)
+        state->_stopfd = eventfd(0, EFD_CLOEXEC);
+    if (state->_stopfd == -1 || pthread_create(&state->_dispatcher, 0, FreeRDP_dispatcher, state) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "failed to start event dispatcher");
+        return -1;
+    }
+    state->_dispatching = 1;
+    return 0;
+}
+
+/**
+ * Hand event draining over to the caller, joining the
+ * dispatcher thread if it already runs.
+ */
+int FreeRDP_external_dispatch(void) {
+    uint64_t one = 1;
+    struct module_state* state = GETSTATE(__global_module);
+    state->_external = 1;
+    if (!state->_dispatching)
+        return 0;
+    state->_dispatching = 0;
+    if (write(state->_stopfd, &one, sizeof(one)) != sizeof(one)) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    /* it may be waiting for the GIL to finish a batch */
+    Py_BEGIN_ALLOW_THREADS
+    pthread_join(state->_dispatcher, NULL);
+    Py_END_ALLOW_THREADS
+    return 0;
+}
+
+/**
+ * Split an argument string on whitespace into argv, after a dummy
+ * program name. Splits a copy, free `buffer` with PyMem_Free once
+ * the arguments are parsed. Returns argc, -1 with an exception set.
  */
-static void onConnect_callback(void* instance) {
-    FR_DEBUG("onConnect_callback+")
-    PyObject* self = PyDict_GetItem(GETSTATE(__global_module)->_module_instanceMap, PyUnicode_FromFormat("%d", instance));
-    if (self==NULL) { fprintf(stderr,"SELF NULL!!!!");}
-    PyObject* args = PyTuple_New(1);
-    if (PyTuple_SetItem(args, 0, self) != 0) {
-        fprintf(stderr, "TUPLE ERROR!!");
+int FreeRDP_split_args(const char* string, char* argv[FREERDP_MAX_ARGS], char** buffer) {
+    int argc = 1;
+    char* save;
+    char* arg;
+    *buffer = (char*)PyMem_Malloc(strlen(string) + 1);
+    if (*buffer == NULL) {
+        PyErr_NoMemory();
+        return -1;
     }
-    FreeRDP* realSelf = (FreeRDP*)self;
-    PyGILState_STATE state;
-    state = PyGILState_Ensure();
-    PyEval_CallObject(realSelf->_onConnect, args);
-    Py_XDECREF(args);
-    PyGILState_Release(state);
-    FR_DEBUG("-onConnect_callback")
+    strcpy(*buffer, string);
+    argv[0] = "DUMMY";     //if called in main would be the program name
+    for (arg = strtok_r(*buffer, " \t\n", &save); arg != NULL && argc < FREERDP_MAX_ARGS - 1;
+         arg = strtok_r(NULL, " \t\n", &save))
+        argv[argc++] = arg;
+    argv[argc] = NULL;
+    return argc;
 }
 
 /**
@@ -101,68 +363,842 @@ static PyObject* FreeRDP_new(PyTypeObject* type, PyObject* args, PyObject* kwarg
  */
 static int FreeRDP_init(FreeRDP* self, PyObject* args, PyObject* kwargs) {
     FR_DEBUG("FreeRDP_init+")
+    static char* keywords[] = {"args", "onConnect", "on_event", "headless", "idle_suppress", "record", NULL};
     char* args_string;
-    PyObject* onConnect;
-    if (!PyArg_ParseTuple(args, "sO:set_callback", &args_string, &onConnect))
+    char* record = NULL;
+    int headless = 0;
+    double idle_suppress = 0.0;
+    session_options_t options;
+    PyObject* onConnect = Py_None;
+    PyObject* onEvent = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|OOpdz:FreeRDP", keywords, &args_string, &onConnect, &onEvent,
+                                     &headless, &idle_suppress, &record))
+        return -1;
+    if ((onConnect != Py_None && !PyCallable_Check(onConnect)) || (onEvent != Py_None && !PyCallable_Check(onEvent))) {
+        PyErr_SetString(PyExc_TypeError, "callbacks must be callable");
         return -1;
-    if (!PyCallable_Check(onConnect)) {
-        PyErr_SetString(PyExc_TypeError, "onConnect must be callable");
+    }
+    if (self->_session != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "session already started");
         return -1;
     }
-    Py_XINCREF(onConnect);
+    if (FreeRDP_start_dispatcher() != 0)
+        return -1;
     Py_XDECREF(self->_onConnect);
-    self->_onConnect = onConnect;
-
-    char *argv[100];
-    int argc = 1;
-    argv[0] = "DUMMY";     //if called in main would be the program name
-    char *arg = strtok(args_string, " ");
-    while (arg != NULL && argc < 99) {
-        argv[argc++] = arg;
-        arg = strtok(NULL, " ");
+    Py_XDECREF(self->_onEvent);
+    self->_onConnect = NULL;
+    self->_onEvent = NULL;
+    if (onConnect != Py_None) {
+        Py_INCREF(onConnect);
+        self->_onConnect = onConnect;
+    }
+    if (onEvent != Py_None) {
+        Py_INCREF(onEvent);
+        self->_onEvent = onEvent;
     }
 
-    void* instance = start(argc, argv, onConnect_callback);
-    if (PyDict_SetItem(GETSTATE(__global_module)->_module_instanceMap, PyUnicode_FromFormat("%d", instance), (PyObject*)self) != 0) {
+    char* argv[FREERDP_MAX_ARGS];
+    char* buffer;
+    int argc = FreeRDP_split_args(args_string, argv, &buffer);
+    if (argc < 0)
+        return -1;
+
+    options.flags = headless ? SESSION_HEADLESS : 0;
+    options.idle_suppress_ms = idle_suppress > 0 ? (int)(idle_suppress * 1000) : 0;
+    options.record = record;
+    session_t session = start_with(argc, argv, NULL, &options);
+    PyMem_Free(buffer);
+    if (session == 0) {
+        PyErr_SetString(PyExc_RuntimeError, "failed to start session");
         return -1;
     }
-    PyObject* temp = self->_instance;
-    self->_instance = PyCapsule_New(instance, NULL, NULL);
-    Py_XDECREF(temp);
+    /* events are dispatched under the GIL, so none can miss the owner */
+    set_session_owner(session, self);
+    self->_session = session;
     FR_DEBUG("FreeRDP_init-")
     return 0;
 }    
 
 /**
- * Run a command in remote session.
+ * Run a command in remote session, returns the input ticket.
+ * Pasting sends it in one clipboard round trip instead of typing.
  */
-static PyObject* FreeRDP_run_command(FreeRDP* self, PyObject* command) {
+static PyObject* FreeRDP_run_command(FreeRDP* self, PyObject* args, PyObject* kwargs) {
     FR_DEBUG("FreeRDP_run_command+")
+    static char* keywords[] = {"command", "paste", NULL};
     char* command_string;
-    if (!PyArg_ParseTuple(command, "s", &command_string))
-        PyErr_SetString(PyExc_RuntimeError, "expect command");
-    run_command(PyCapsule_GetPointer(self->_instance, NULL), command_string);
+    int paste = 0;
+    unsigned int ticket;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|p", keywords, &command_string, &paste))
+        return NULL;
+    ticket = paste ? paste_command(session, command_string) : run_command(session, command_string);
     FR_DEBUG("-FreeRDP_run_command")
-    Py_RETURN_NONE;
+    return PyLong_FromUnsignedLong(ticket);
+}
+
+/**
+ * Offer text on the remote clipboard, returns the input ticket.
+ */
+static PyObject* FreeRDP_set_clipboard(FreeRDP* self, PyObject* args) {
+    char* text;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTuple(args, "s", &text))
+        return NULL;
+    return PyLong_FromUnsignedLong(set_clipboard(session, text));
+}
+
+/**
+ * Remote clipboard text, or None if it holds none.
+ */
+static PyObject* FreeRDP_get_clipboard(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"timeout", NULL};
+    char* text;
+    double timeout = 1.0;
+    PyObject* result;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|d", keywords, &timeout))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    text = get_clipboard(session, timeout < 0 ? -1 : (int)(timeout * 1000));
+    Py_END_ALLOW_THREADS
+    if (text == NULL)
+        Py_RETURN_NONE;
+    result = PyUnicode_DecodeUTF8(text, strlen(text), "replace");
+    free(text);
+    return result;
+}
+
+/**
+ * Paste text with Ctrl+V, returns the input ticket.
+ */
+static PyObject* FreeRDP_paste_text(FreeRDP* self, PyObject* args) {
+    char* text;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTuple(args, "s", &text))
+        return NULL;
+    return PyLong_FromUnsignedLong(paste_text(session, text));
+}
+
+/**
+ * Type text, any characters, returns the input ticket.
+ */
+static PyObject* FreeRDP_type_text(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"text", "delay", NULL};
+    char* text;
+    double delay = 0.0;
+    unsigned int ticket;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|d", keywords, &text, &delay))
+        return NULL;
+    ticket = type_text(session, text, delay > 0 ? (unsigned int)(delay * 1000000) : 0);
+    return PyLong_FromUnsignedLong(ticket);
 }
 
 static PyObject* FreeRDP_press_keys(FreeRDP* self, PyObject* args) {
     FR_DEBUG("FreeRDP_press_keys+")
     PyObject* list;
+    PyObject* seq;
+    unsigned int ticket;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
     if (!PyArg_ParseTuple(args, "O", &list))
-        PyErr_SetString(PyExc_RuntimeError, "expect keys");
-    int count = PySequence_Fast_GET_SIZE(list);
-    DWORD keys[count];
+        return NULL;
+    seq = PySequence_Fast(list, "expect keys");
+    if (seq == NULL)
+        return NULL;
+    int count = PySequence_Fast_GET_SIZE(seq);
+    DWORD keys[count > 0 ? count : 1];
     int index;
     for (index=0; index < count; ++index) {
-        keys[index] = PyLong_AsUnsignedLong(PySequence_Fast_GET_ITEM(list, index));
+        keys[index] = PyLong_AsUnsignedLong(PySequence_Fast_GET_ITEM(seq, index));
     }
-    press_keys(PyCapsule_GetPointer(self->_instance, NULL), count, keys);
-    Py_XDECREF(list);
+    Py_DECREF(seq);
+    if (PyErr_Occurred())
+        return NULL;
+    ticket = press_keys(session, count, keys);
     FR_DEBUG("-FreeRDP_press_keys")
+    return PyLong_FromUnsignedLong(ticket);
+}
+
+/**
+ * Wait for queued input to be sent, by default all of it.
+ */
+static PyObject* FreeRDP_wait_input(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"ticket", "timeout", NULL};
+    int sent;
+    int ms_timeout = -1;
+    unsigned int ticket = 0;
+    PyObject* ticket_object = Py_None;
+    PyObject* timeout = Py_None;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", keywords, &ticket_object, &timeout))
+        return NULL;
+    if (ticket_object != Py_None) {
+        ticket = (unsigned int)PyLong_AsUnsignedLong(ticket_object);
+        if (PyErr_Occurred())
+            return NULL;
+    }
+    if (timeout != Py_None) {
+        double seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1.0 && PyErr_Occurred())
+            return NULL;
+        ms_timeout = seconds < 0 ? 0 : (int)(seconds * 1000);
+    }
+    Py_BEGIN_ALLOW_THREADS
+    sent = wait_input(session, ticket, ms_timeout);
+    Py_END_ALLOW_THREADS
+    return PyBool_FromLong(sent);
+}
+
+/**
+ * Move the pointer, returns the input ticket.
+ */
+static PyObject* FreeRDP_move_mouse(FreeRDP* self, PyObject* args) {
+    int x;
+    int y;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTuple(args, "ii", &x, &y))
+        return NULL;
+    return PyLong_FromUnsignedLong(move_mouse(session, x, y));
+}
+
+static int FreeRDP_check_button(int button) {
+    if (button >= 1 && button <= 3)
+        return 1;
+    PyErr_SetString(PyExc_ValueError, "button must be 1, 2 or 3");
+    return 0;
+}
+
+/**
+ * Click `count` times, returns the input ticket.
+ */
+static PyObject* FreeRDP_click(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"x", "y", "button", "count", NULL};
+    int x;
+    int y;
+    int button = 1;
+    int count = 1;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ii|ii", keywords, &x, &y, &button, &count))
+        return NULL;
+    if (!FreeRDP_check_button(button))
+        return NULL;
+    return PyLong_FromUnsignedLong(click(session, x, y, button, count));
+}
+
+/**
+ * Drag with a button held, `steps` moves `interval` seconds apart.
+ */
+static PyObject* FreeRDP_drag(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"x0", "y0", "x1", "y1", "button", "steps", "interval", NULL};
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    int button = 1;
+    int steps = 10;
+    double interval = 0.01;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iiii|iid", keywords, &x0, &y0, &x1, &y1,
+                                     &button, &steps, &interval))
+        return NULL;
+    if (!FreeRDP_check_button(button))
+        return NULL;
+    return PyLong_FromUnsignedLong(drag(session, x0, y0, x1, y1, button, steps,
+                                        interval > 0 ? (int)(interval * 1000) : 0));
+}
+
+/**
+ * Turn the wheel, up for positive clicks.
+ */
+static PyObject* FreeRDP_scroll(FreeRDP* self, PyObject* args) {
+    int x;
+    int y;
+    int clicks;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTuple(args, "iii", &x, &y, &clicks))
+        return NULL;
+    return PyLong_FromUnsignedLong(scroll(session, x, y, clicks));
+}
+
+/**
+ * Move through (x, y) points in one submission.
+ */
+static PyObject* FreeRDP_mouse_path(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"points", "interval", NULL};
+    Py_ssize_t i;
+    Py_ssize_t count;
+    unsigned int ticket;
+    double interval = 0.0;
+    point_t* points;
+    PyObject* list;
+    PyObject* seq;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|d", keywords, &list, &interval))
+        return NULL;
+    seq = PySequence_Fast(list, "points must be a sequence of (x, y)");
+    if (seq == NULL)
+        return NULL;
+    count = PySequence_Fast_GET_SIZE(seq);
+    points = (point_t*)PyMem_Malloc((count + 1) * sizeof(point_t));
+    if (points == NULL) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < count; i++) {
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "ii;points must be (x, y)",
+                              &points[i].x, &points[i].y)) {
+            PyMem_Free(points);
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+    ticket = mouse_path(session, (int)count, points, interval > 0 ? (int)(interval * 1000) : 0);
+    PyMem_Free(points);
+    return PyLong_FromUnsignedLong(ticket);
+}
+
+/**
+ * Pace typed text by the screen's echo instead of a fixed delay,
+ * waiting for `quiet` seconds without a paint after each echo.
+ */
+static PyObject* FreeRDP_set_input_pacing(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"adaptive", "quiet", NULL};
+    int adaptive = 1;
+    double quiet = 0.0;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pd", keywords, &adaptive, &quiet))
+        return NULL;
+    set_input_pacing(session, adaptive ? INPUT_PACING_ECHO : INPUT_PACING_FIXED,
+                     quiet > 0 ? (int)(quiet * 1000) : 0);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Queue a macro, steps or a compiled program, returns its ticket.
+ */
+static PyObject* FreeRDP_submit_macro(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"program", NULL};
+    unsigned int ticket;
+    PyObject* program;
+    PyObject* bytes;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", keywords, &program))
+        return NULL;
+    bytes = FreeRDP_macro_program(program);
+    if (bytes == NULL)
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    ticket = submit_macro(session, (const unsigned char*)PyBytes_AS_STRING(bytes), (int)PyBytes_GET_SIZE(bytes));
+    Py_END_ALLOW_THREADS
+    Py_DECREF(bytes);
+    if (ticket == 0) {
+        PyErr_SetString(PyExc_ValueError, "malformed macro program");
+        return NULL;
+    }
+    return PyLong_FromUnsignedLong(ticket);
+}
+
+static PyObject* FreeRDP_macro_dict(const macro_result_t* result) {
+    return Py_BuildValue("{sisisisi}", "status", result->status, "step", result->step,
+                         "x", result->x, "y", result->y);
+}
+
+/**
+ * Result of a finished macro as a dict, None when not known.
+ */
+static PyObject* FreeRDP_macro_result(FreeRDP* self, PyObject* args) {
+    unsigned int ticket;
+    macro_result_t result;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTuple(args, "I", &ticket))
+        return NULL;
+    if (!macro_result(session, ticket, &result))
+        Py_RETURN_NONE;
+    return FreeRDP_macro_dict(&result);
+}
+
+/**
+ * Queue a macro and wait for it without the GIL. Returns its
+ * result, None on timeout or when the session closes.
+ */
+static PyObject* FreeRDP_run_macro(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"program", "timeout", NULL};
+    int found = 0;
+    int ms_timeout = -1;
+    unsigned int ticket;
+    macro_result_t result;
+    PyObject* program;
+    PyObject* bytes;
+    PyObject* timeout = Py_None;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", keywords, &program, &timeout))
+        return NULL;
+    if (timeout != Py_None) {
+        double seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1.0 && PyErr_Occurred())
+            return NULL;
+        ms_timeout = seconds < 0 ? 0 : (int)(seconds * 1000);
+    }
+    bytes = FreeRDP_macro_program(program);
+    if (bytes == NULL)
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    ticket = submit_macro(session, (const unsigned char*)PyBytes_AS_STRING(bytes), (int)PyBytes_GET_SIZE(bytes));
+    if (ticket != 0 && wait_input(session, ticket, ms_timeout))
+        found = macro_result(session, ticket, &result);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(bytes);
+    if (ticket == 0) {
+        PyErr_SetString(PyExc_ValueError, "malformed macro program");
+        return NULL;
+    }
+    if (!found)
+        Py_RETURN_NONE;
+    return FreeRDP_macro_dict(&result);
+}
+
+/**
+ * Parse an optional (x, y, w, h) tuple, returns NULL for None.
+ */
+static int FreeRDP_parse_rect(PyObject* object, rect_t* rect, rect_t** out) {
+    *out = NULL;
+    if (object == NULL || object == Py_None)
+        return 1;
+    if (!PyArg_ParseTuple(object, "iiii;rect must be (x, y, width, height)",
+                          &rect->x, &rect->y, &rect->width, &rect->height))
+        return 0;
+    *out = rect;
+    return 1;
+}
+
+/**
+ * Ask the server to stop sending graphics.
+ */
+static PyObject* FreeRDP_pause_updates(FreeRDP* self, PyObject* unused) {
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    pause_updates(session);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Resume graphics, for rect (x, y, w, h) or the whole desktop.
+ */
+static PyObject* FreeRDP_resume_updates(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"rect", NULL};
+    rect_t rect;
+    rect_t* area;
+    PyObject* rect_object = NULL;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", keywords, &rect_object))
+        return NULL;
+    if (!FreeRDP_parse_rect(rect_object, &rect, &area))
+        return NULL;
+    resume_updates(session, area);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Take the framebuffer lock, waits out an in-progress paint.
+ */
+static PyObject* FreeRDP_lock_framebuffer(FreeRDP* self, PyObject* unused) {
+    int locked;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    locked = lock_framebuffer(session);
+    Py_END_ALLOW_THREADS
+    if (!locked) {
+        PyErr_SetString(PyExc_RuntimeError, "framebuffer already locked by this thread");
+        return NULL;
+    }
     Py_RETURN_NONE;
 }
 
+/**
+ * Release the framebuffer lock, from the thread that took it.
+ */
+static PyObject* FreeRDP_unlock_framebuffer(FreeRDP* self, PyObject* unused) {
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    unlock_framebuffer(session);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Zero-copy view of the decoded desktop, (height, width, 4) BGRA bytes.
+ */
+static PyObject* FreeRDP_get_framebuffer(FreeRDP* self, void* closure) {
+    framebuffer_t fb;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!get_framebuffer(session, &fb)) {
+        PyErr_SetString(PyExc_RuntimeError, "not connected");
+        return NULL;
+    }
+    return BufferView_memoryview((PyObject*)self, fb.data, fb.width, fb.height,
+                                 fb.stride, fb.bpp / 8, "B");
+}
+
+/**
+ * Framebuffer geometry, (width, height, stride).
+ */
+static PyObject* FreeRDP_get_framebuffer_size(FreeRDP* self, void* closure) {
+    framebuffer_t fb;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!get_framebuffer(session, &fb)) {
+        PyErr_SetString(PyExc_RuntimeError, "not connected");
+        return NULL;
+    }
+    return Py_BuildValue("(iii)", fb.width, fb.height, fb.stride);
+}
+
+/**
+ * Keep a downscaled copy of the desktop from now on, returns
+ * its (width, height).
+ */
+static PyObject* FreeRDP_enable_thumbnail(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"scale", NULL};
+    int scale = 8;
+    int enabled;
+    thumbnail_t thumb;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:enable_thumbnail", keywords, &scale))
+        return NULL;
+    if (scale != 4 && scale != 8 && scale != 16) {
+        PyErr_SetString(PyExc_ValueError, "scale must be 4, 8 or 16");
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    enabled = enable_thumbnail(session, scale);
+    Py_END_ALLOW_THREADS
+    if (!enabled || !get_thumbnail(session, &thumb)) {
+        PyErr_SetString(PyExc_RuntimeError, "no 32bpp desktop or enabled at another scale");
+        return NULL;
+    }
+    return Py_BuildValue("(ii)", thumb.width, thumb.height);
+}
+
+/**
+ * Zero-copy view of the thumbnail, (height, width, 4) BGRA bytes.
+ */
+static PyObject* FreeRDP_get_thumbnail(FreeRDP* self, void* closure) {
+    thumbnail_t thumb;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!get_thumbnail(session, &thumb)) {
+        PyErr_SetString(PyExc_RuntimeError, "thumbnail not enabled");
+        return NULL;
+    }
+    return BufferView_memoryview((PyObject*)self, thumb.data, thumb.width, thumb.height, thumb.stride, 4, "B");
+}
+
+/**
+ * Zero-copy view of the 64-bit screen hash, 8 bytes, bit i
+ * set where cell i of the 8x8 grid is brighter than average.
+ */
+static PyObject* FreeRDP_get_screen_hash(FreeRDP* self, void* closure) {
+    thumbnail_t thumb;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!get_thumbnail(session, &thumb)) {
+        PyErr_SetString(PyExc_RuntimeError, "thumbnail not enabled");
+        return NULL;
+    }
+    return BufferView_memoryview((PyObject*)self, (void*)thumb.hash, 8, 0, 0, 1, "B");
+}
+
+/**
+ * Number of the last frame that changed the screen.
+ */
+static PyObject* FreeRDP_get_frame(FreeRDP* self, void* closure) {
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    return PyLong_FromUnsignedLong(current_frame(session));
+}
+
+/**
+ * Metrics as a dict of counters, the input queue depth and
+ * histograms of (count, sum, [(upper bound, cumulative count)])
+ * in seconds.
+ */
+static PyObject* FreeRDP_metrics_dict(const metrics_t* m) {
+    int i;
+    int b;
+    unsigned long long cumulative;
+    PyObject* dict = PyDict_New();
+    PyObject* buckets;
+    PyObject* value;
+    if (dict == NULL)
+        return NULL;
+    for (i = 0; i < METRIC_COUNTERS; i++) {
+        value = PyLong_FromUnsignedLongLong(m->counters[i]);
+        if (value == NULL || PyDict_SetItemString(dict, metric_name(i), value) != 0)
+            goto error;
+        Py_DECREF(value);
+    }
+    value = PyLong_FromLongLong((long long)(m->counters[METRIC_INPUT_SUBMITTED] -
+                                            m->counters[METRIC_INPUT_SENT] - m->counters[METRIC_INPUT_DROPPED]));
+    if (value == NULL || PyDict_SetItemString(dict, "input_depth", value) != 0)
+        goto error;
+    Py_DECREF(value);
+    for (i = 0; i < METRIC_HISTOGRAMS; i++) {
+        buckets = PyList_New(0);
+        if (buckets == NULL)
+            goto fail;
+        cumulative = 0;
+        for (b = 0; b < METRIC_BUCKETS; b++) {
+            cumulative += m->histograms[i].buckets[b];
+            value = b == METRIC_BUCKETS - 1
+                ? Py_BuildValue("(dK)", Py_HUGE_VAL, cumulative)
+                : Py_BuildValue("(dK)", (double)(1ULL << b) / 1e9, cumulative);
+            if (value == NULL || PyList_Append(buckets, value) != 0) {
+                Py_XDECREF(value);
+                Py_DECREF(buckets);
+                goto fail;
+            }
+            Py_DECREF(value);
+        }
+        value = Py_BuildValue("(KdN)", m->histograms[i].count, (double)m->histograms[i].sum / 1e9, buckets);
+        if (value == NULL || PyDict_SetItemString(dict, histogram_name(i), value) != 0)
+            goto error;
+        Py_DECREF(value);
+    }
+    return dict;
+error:
+    Py_XDECREF(value);
+fail:
+    Py_DECREF(dict);
+    return NULL;
+}
+
+/**
+ * Session metrics, see freerdp.metrics().
+ */
+static PyObject* FreeRDP_get_metrics(FreeRDP* self, void* closure) {
+    metrics_t metrics;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!session_metrics(session, &metrics)) {
+        PyErr_SetString(PyExc_RuntimeError, "session released");
+        return NULL;
+    }
+    return FreeRDP_metrics_dict(&metrics);
+}
+
+/**
+ * Seconds from start() to each connect phase reached so far.
+ */
+static PyObject* FreeRDP_get_connect_timings(FreeRDP* self, void* closure) {
+    static const char* names[CONNECT_PHASES] = {
+        "queued", "connecting", "pre_connect", "handshake", "gdi_init", "connected", "first_paint"
+    };
+    int phase;
+    PyObject* timings;
+    PyObject* value;
+    unsigned long long stamps[CONNECT_PHASES];
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!connect_timings(session, stamps)) {
+        PyErr_SetString(PyExc_RuntimeError, "session released");
+        return NULL;
+    }
+    timings = PyDict_New();
+    if (timings == NULL)
+        return NULL;
+    for (phase = 0; phase < CONNECT_PHASES; ++phase) {
+        if (stamps[phase] == 0)
+            continue;
+        value = PyFloat_FromDouble((double)(stamps[phase] - stamps[CONNECT_PHASE_QUEUED]) / 1e9);
+        if (value == NULL || PyDict_SetItemString(timings, names[phase], value) != 0) {
+            Py_XDECREF(value);
+            Py_DECREF(timings);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+    return timings;
+}
+
+/**
+ * Paint sequence, odd while painting.
+ */
+static PyObject* FreeRDP_get_framebuffer_sequence(FreeRDP* self, void* closure) {
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    return PyLong_FromUnsignedLong(framebuffer_sequence(session));
+}
+
+/**
+ * Regions painted after a frame number, (frame, [(x, y, w, h), ...]).
+ */
+static PyObject* FreeRDP_dirty_regions(FreeRDP* self, PyObject* args) {
+    int index;
+    int count;
+    unsigned int since = 0;
+    unsigned int frame = 0;
+    rect_t rects[64];
+    PyObject* list;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTuple(args, "|I", &since))
+        return NULL;
+    count = dirty_regions(session, since, rects, 64, &frame);
+    list = PyList_New(count);
+    if (list == NULL)
+        return NULL;
+    for (index = 0; index < count; ++index) {
+        PyList_SET_ITEM(list, index, Py_BuildValue("(iiii)", rects[index].x, rects[index].y,
+                                                   rects[index].width, rects[index].height));
+    }
+    return Py_BuildValue("(IN)", frame, list);
+}
+
+/**
+ * Block without the GIL until the screen changes inside rect.
+ */
+static PyObject* FreeRDP_wait_for_change(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"rect", "timeout", "since", NULL};
+    int changed;
+    int ms_timeout = -1;
+    rect_t rect;
+    rect_t* watch;
+    PyObject* rect_object = NULL;
+    PyObject* timeout = Py_None;
+    PyObject* since_object = Py_None;
+    unsigned int since;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOO", keywords, &rect_object, &timeout, &since_object))
+        return NULL;
+    if (!FreeRDP_parse_rect(rect_object, &rect, &watch))
+        return NULL;
+    if (timeout != Py_None) {
+        double seconds = PyFloat_AsDouble(timeout);
+        if (seconds == -1.0 && PyErr_Occurred())
+            return NULL;
+        ms_timeout = seconds < 0 ? 0 : (int)(seconds * 1000);
+    }
+    if (since_object != Py_None) {
+        since = (unsigned int)PyLong_AsUnsignedLong(since_object);
+        if (PyErr_Occurred())
+            return NULL;
+    } else {
+        since = current_frame(session);
+    }
+    Py_BEGIN_ALLOW_THREADS
+    changed = wait_for_change(session, since, watch, ms_timeout);
+    Py_END_ALLOW_THREADS
+    if (changed < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot wait for a change while holding the framebuffer lock");
+        return NULL;
+    }
+    return PyBool_FromLong(changed);
+}
+
+/**
+ * Native template search, returns (x, y, score) or None.
+ */
+static PyObject* FreeRDP_find_image(FreeRDP* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"template", "width", "region", "threshold", "since", NULL};
+    int found;
+    int width;
+    int height;
+    double threshold = 0.0;
+    unsigned int since;
+    unsigned int* since_ptr = NULL;
+    rect_t rect;
+    rect_t* region;
+    match_t match;
+    Py_buffer template;
+    PyObject* region_object = NULL;
+    PyObject* since_object = Py_None;
+    session_t session = FreeRDP_session(self);
+    if (session == 0)
+        return NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*i|OdO", keywords, &template, &width,
+                                     &region_object, &threshold, &since_object))
+        return NULL;
+    if (width <= 0 || template.len == 0 || template.len % ((Py_ssize_t)width * 4) != 0) {
+        PyBuffer_Release(&template);
+        PyErr_SetString(PyExc_ValueError, "template must be width * height BGRA pixels");
+        return NULL;
+    }
+    height = (int)(template.len / ((Py_ssize_t)width * 4));
+    if (!FreeRDP_parse_rect(region_object, &rect, &region)) {
+        PyBuffer_Release(&template);
+        return NULL;
+    }
+    if (since_object != Py_None) {
+        since = (unsigned int)PyLong_AsUnsignedLong(since_object);
+        if (PyErr_Occurred()) {
+            PyBuffer_Release(&template);
+            return NULL;
+        }
+        since_ptr = &since;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    found = find_image(session, (const unsigned char*)template.buf, width, height,
+                       region, since_ptr, threshold, &match);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&template);
+    if (!found)
+        Py_RETURN_NONE;
+    return Py_BuildValue("(iid)", match.x, match.y, match.score);
+}
+
 /**
  * Class representation string.
  */
@@ -181,15 +1217,52 @@ static PyMemberDef FreeRDP_members[] = {
  * Class methods.
  */
 static PyMethodDef FreeRDP_methods[] = {
-    {"run_command", (PyCFunction)FreeRDP_run_command, METH_VARARGS, "Run command"},
+    {"run_command", (PyCFunction)FreeRDP_run_command, METH_VARARGS | METH_KEYWORDS, "Run command"},
+    {"set_clipboard", (PyCFunction)FreeRDP_set_clipboard, METH_VARARGS, "Set remote clipboard text"},
+    {"get_clipboard", (PyCFunction)FreeRDP_get_clipboard, METH_VARARGS | METH_KEYWORDS, "Get remote clipboard text"},
+    {"paste_text", (PyCFunction)FreeRDP_paste_text, METH_VARARGS, "Paste text"},
+    {"type_text", (PyCFunction)FreeRDP_type_text, METH_VARARGS | METH_KEYWORDS, "Type text"},
     {"press_keys", (PyCFunction)FreeRDP_press_keys, METH_VARARGS, "Press keys"},
+    {"wait_input", (PyCFunction)FreeRDP_wait_input, METH_VARARGS | METH_KEYWORDS, "Wait for queued input"},
+    {"move_mouse", (PyCFunction)FreeRDP_move_mouse, METH_VARARGS, "Move the pointer"},
+    {"click", (PyCFunction)FreeRDP_click, METH_VARARGS | METH_KEYWORDS, "Click a mouse button"},
+    {"drag", (PyCFunction)FreeRDP_drag, METH_VARARGS | METH_KEYWORDS, "Drag with a mouse button held"},
+    {"scroll", (PyCFunction)FreeRDP_scroll, METH_VARARGS, "Turn the mouse wheel"},
+    {"mouse_path", (PyCFunction)FreeRDP_mouse_path, METH_VARARGS | METH_KEYWORDS, "Move the pointer through points"},
+    {"set_input_pacing", (PyCFunction)FreeRDP_set_input_pacing, METH_VARARGS | METH_KEYWORDS, "Pace typing by screen echo"},
+    {"submit_macro", (PyCFunction)FreeRDP_submit_macro, METH_VARARGS | METH_KEYWORDS, "Queue a macro program"},
+    {"macro_result", (PyCFunction)FreeRDP_macro_result, METH_VARARGS, "Result of a finished macro"},
+    {"run_macro", (PyCFunction)FreeRDP_run_macro, METH_VARARGS | METH_KEYWORDS, "Run a macro program and wait for it"},
+    {"pause_updates", (PyCFunction)FreeRDP_pause_updates, METH_NOARGS, "Ask the server to stop sending graphics"},
+    {"resume_updates", (PyCFunction)FreeRDP_resume_updates, METH_VARARGS | METH_KEYWORDS, "Resume graphics, optionally for a rect"},
+    {"lock_framebuffer", (PyCFunction)FreeRDP_lock_framebuffer, METH_NOARGS, "Hold off painting"},
+    {"unlock_framebuffer", (PyCFunction)FreeRDP_unlock_framebuffer, METH_NOARGS, "Resume painting"},
+    {"dirty_regions", (PyCFunction)FreeRDP_dirty_regions, METH_VARARGS, "Regions painted after a frame"},
+    {"wait_for_change", (PyCFunction)FreeRDP_wait_for_change, METH_VARARGS | METH_KEYWORDS, "Wait for a paint inside rect"},
+    {"find_image", (PyCFunction)FreeRDP_find_image, METH_VARARGS | METH_KEYWORDS, "Find a BGRA template on screen"},
+    {"enable_thumbnail", (PyCFunction)FreeRDP_enable_thumbnail, METH_VARARGS | METH_KEYWORDS, "Keep a downscaled desktop and its hash"},
     {NULL, NULL}
 };
 
+/**
+ * Class properties.
+ */
+static PyGetSetDef FreeRDP_getset[] = {
+    {"framebuffer", (getter)FreeRDP_get_framebuffer, NULL, "Zero-copy view of the desktop", NULL},
+    {"framebuffer_size", (getter)FreeRDP_get_framebuffer_size, NULL, "(width, height, stride)", NULL},
+    {"framebuffer_sequence", (getter)FreeRDP_get_framebuffer_sequence, NULL, "Paint sequence, odd while painting", NULL},
+    {"thumbnail", (getter)FreeRDP_get_thumbnail, NULL, "Zero-copy view of the downscaled desktop", NULL},
+    {"screen_hash", (getter)FreeRDP_get_screen_hash, NULL, "Zero-copy view of the 64-bit screen hash", NULL},
+    {"frame", (getter)FreeRDP_get_frame, NULL, "Last frame that changed the screen", NULL},
+    {"connect_timings", (getter)FreeRDP_get_connect_timings, NULL, "Seconds from start to each connect phase", NULL},
+    {"metrics", (getter)FreeRDP_get_metrics, NULL, "Session counters and latency histograms", NULL},
+    {NULL}
+};
+
 /**
  * Define FreeRDP class type.
  */ 
-static PyTypeObject FreeRDPType = {
+PyTypeObject FreeRDPType = {
     PyVarObject_HEAD_INIT(NULL, 0)
     "freerdp.FreeRDP",            /* tp_name */
     sizeof(FreeRDP),              /* tp_basicsize */
@@ -221,7 +1294,7 @@ static PyTypeObject FreeRDPType = {
     0,                            /* tp_iternext */
     FreeRDP_methods,              /* tp_methods */
     FreeRDP_members,              /* tp_members */
-    0,                            /* tp_getset */
+    FreeRDP_getset,               /* tp_getset */
     0,                            /* tp_base */
     0,                            /* tp_dict */
     0,                            /* tp_descr_get */
@@ -232,11 +1305,165 @@ static PyTypeObject FreeRDPType = {
     FreeRDP_new,                  /* tp_new */
 };
 
+/**
+ * Switch new sessions to the shared epoll engine.
+ */
+static PyObject* freerdp_start_engine(PyObject* module, PyObject* args) {
+    FR_DEBUG("freerdp_start_engine+")
+    int workers = 0;
+    if (!PyArg_ParseTuple(args, "|i", &workers))
+        return NULL;
+    workers = engine_start(workers);
+    if (workers < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "failed to start engine");
+        return NULL;
+    }
+    FR_DEBUG("-freerdp_start_engine")
+    return PyLong_FromLong(workers);
+}
+
+/**
+ * Event descriptor for an event loop's reader. Switches the
+ * module to draining events through dispatch_events().
+ */
+static PyObject* freerdp_event_fd(PyObject* module, PyObject* unused) {
+    int fd = event_fd();
+    if (fd == -1) {
+        PyErr_SetString(PyExc_RuntimeError, "event descriptor unavailable");
+        return NULL;
+    }
+    if (FreeRDP_external_dispatch() != 0)
+        return NULL;
+    return PyLong_FromLong(fd);
+}
+
+/**
+ * Drain pending events into their sessions' callbacks,
+ * returns how many were delivered.
+ */
+static PyObject* freerdp_dispatch_events(PyObject* module, PyObject* unused) {
+    int count;
+    long total = 0;
+    event_t events[DISPATCH_BATCH];
+    if (!GETSTATE(module)->_external) {
+        PyErr_SetString(PyExc_RuntimeError, "events are drained by the dispatcher thread, call event_fd() first");
+        return NULL;
+    }
+    do {
+        count = poll_events(events, DISPATCH_BATCH);
+        FreeRDP_dispatch(events, count);
+        total += count;
+    } while (count == DISPATCH_BATCH);
+    return PyLong_FromLong(total);
+}
+
+/**
+ * Process-wide metrics, totals over every session so far.
+ */
+static PyObject* freerdp_metrics(PyObject* module, PyObject* unused) {
+    metrics_t metrics;
+    process_metrics(&metrics);
+    return FreeRDP_metrics_dict(&metrics);
+}
+
+/**
+ * Metrics in Prometheus text format, optionally per session.
+ */
+static PyObject* freerdp_metrics_text(PyObject* module, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"sessions", NULL};
+    int sessions = 0;
+    char* text;
+    PyObject* result;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", keywords, &sessions))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    text = metrics_text(sessions);
+    Py_END_ALLOW_THREADS
+    if (text == NULL)
+        return PyErr_NoMemory();
+    result = PyUnicode_FromString(text);
+    free(text);
+    return result;
+}
+
+/**
+ * Sessions started and not yet closed.
+ */
+static PyObject* freerdp_live_sessions(PyObject* module, PyObject* unused) {
+    return PyLong_FromLong(live_sessions());
+}
+
+/**
+ * Play a recording back in a new session, returns its FreeRDP.
+ */
+static PyObject* freerdp_replay(PyObject* module, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"path", "realtime", "onConnect", "on_event", NULL};
+    char* path;
+    int realtime = 0;
+    session_t session;
+    PyObject* onConnect = Py_None;
+    PyObject* onEvent = Py_None;
+    FreeRDP* client;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|pOO:replay", keywords, &path, &realtime, &onConnect, &onEvent))
+        return NULL;
+    if ((onConnect != Py_None && !PyCallable_Check(onConnect)) || (onEvent != Py_None && !PyCallable_Check(onEvent))) {
+        PyErr_SetString(PyExc_TypeError, "callbacks must be callable");
+        return NULL;
+    }
+    if (FreeRDP_start_dispatcher() != 0)
+        return NULL;
+    client = (FreeRDP*)FreeRDPType.tp_alloc(&FreeRDPType, 0);
+    if (client == NULL)
+        return NULL;
+    if (onConnect != Py_None) {
+        Py_INCREF(onConnect);
+        client->_onConnect = onConnect;
+    }
+    if (onEvent != Py_None) {
+        Py_INCREF(onEvent);
+        client->_onEvent = onEvent;
+    }
+    /* the GIL stays held, no event is dispatched before the owner is set */
+    session = replay(path, realtime ? REPLAY_REALTIME : 0, NULL);
+    if (session == 0) {
+        Py_DECREF(client);
+        PyErr_Format(PyExc_ValueError, "can't replay %s", path);
+        return NULL;
+    }
+    set_session_owner(session, client);
+    client->_session = session;
+    return (PyObject*)client;
+}
+
+/**
+ * Module methods.
+ */
+static PyMethodDef freerdp_methods[] = {
+    {"start_engine", (PyCFunction)freerdp_start_engine, METH_VARARGS, "Drive sessions from a pool of epoll workers"},
+    {"live_sessions", (PyCFunction)freerdp_live_sessions, METH_NOARGS, "Sessions started and not yet closed"},
+    {"event_fd", (PyCFunction)freerdp_event_fd, METH_NOARGS, "Event descriptor for an event loop"},
+    {"dispatch_events", (PyCFunction)freerdp_dispatch_events, METH_NOARGS, "Deliver pending events"},
+    {"metrics", (PyCFunction)freerdp_metrics, METH_NOARGS, "Process-wide counters and latency histograms"},
+    {"metrics_text", (PyCFunction)freerdp_metrics_text, METH_VARARGS | METH_KEYWORDS, "Metrics in Prometheus text format"},
+    {"start_many", (PyCFunction)FreeRDP_start_many, METH_VARARGS | METH_KEYWORDS, "Start sessions from a SessionTemplate"},
+    {"replay", (PyCFunction)freerdp_replay, METH_VARARGS | METH_KEYWORDS, "Play a recording back without a network"},
+    {"compile_macro", (PyCFunction)FreeRDP_compile_macro, METH_O, "Encode macro steps into a program"},
+    {NULL, NULL}
+};
+
 /**
  * Cleanup module.
  */
 static void module_freerdp_free(void* module) {
     FR_DEBUG("module_freerdp_free+")
+    uint64_t one = 1;
+    struct module_state* state = GETSTATE((PyObject*)module);
+    if (state != NULL && state->_dispatching) {
+        state->_dispatching = 0;
+        if (write(state->_stopfd, &one, sizeof(one)) != sizeof(one))
+            fprintf(stderr, "module_freerdp_free: eventfd write failed\n");
+        pthread_detach(state->_dispatcher);
+    }
     //destroy(10000);
     FR_DEBUG("-module_freerdp_free")
 }
@@ -263,7 +1490,7 @@ static PyModuleDef freerdpmodule = {
     "freerdp",                         /* m_name     */
     "FreeRDP client",                  /* m_doc      */
     sizeof(struct module_state),       /* m_size     */
-    NULL,                              /* m_methods  */ 
+    freerdp_methods,                   /* m_methods  */
     NULL,                              /* m_reload   */
     (traverseproc)module_freerdp_trav, /* m_traverse */
     (inquiry)module_freerdp_clear,     /* m_clear    */
@@ -275,24 +1502,31 @@ static PyModuleDef freerdpmodule = {
  */
 PyMODINIT_FUNC
 PyInit_freerdp(void) {
+#ifdef FAPI_TRACE
+    g_trace = getenv("FREERDP_DEBUG") != NULL;
+#endif
     PyEval_InitThreads();
     PyEval_InitThreads();
     PyEval_InitThreads();
     PyObject* module;
     if (PyType_Ready(&FreeRDPType) < 0)
         return NULL;
+    if (PyType_Ready(&BufferViewType) < 0)
+        return NULL;
     module = PyModule_Create(&freerdpmodule);
     if (module == NULL)
         return NULL;
     struct module_state *state = GETSTATE(module);
-    state->_module_instanceMap = PyDict_New();
-    if (state->_module_instanceMap == NULL) {
-        Py_XDECREF(module);
-        return NULL;
-    }
+    state->_dispatching = 0;
+    state->_external = 0;
+    state->_stopfd = -1;
     Py_XINCREF(&FreeRDPType);
     PyModule_AddObject(module, "FreeRDP", (PyObject*)&FreeRDPType);
     FreeRDP_AddConstants(module);
+    if (FreeRDP_AddAsync(module) != 0 || FreeRDP_AddTemplate(module) != 0 || FreeRDP_AddPool(module) != 0) {
+        Py_XDECREF(module);
+        return NULL;
+    }
     __global_module = module;
     return module;
 }
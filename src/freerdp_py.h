@@ -0,0 +1,76 @@
+#ifndef FREERDP_PY_MODULE_H
+#define FREERDP_PY_MODULE_H
+
+#include <Python.h>
+#include "freerdp.h"
+
+typedef struct FreeRDP FreeRDP;
+
+/**
+ * Native event hook for subclasses, called under the GIL
+ * before the Python callbacks.
+ */
+typedef void (*event_handler_t)(FreeRDP* self, const event_t* event);
+
+/**
+ * Defines the FreeRDP class data.
+ */
+struct FreeRDP {
+    PyObject_HEAD
+    session_t _session;
+    PyObject* _onConnect;
+    PyObject* _onEvent;
+    event_handler_t _handler;
+};
+
+extern PyObject* __global_module;
+extern PyTypeObject FreeRDPType;
+
+/**
+ * Most arguments taken from an argument string.
+ */
+#define FREERDP_MAX_ARGS 100
+
+int FreeRDP_split_args(const char* string, char* argv[FREERDP_MAX_ARGS], char** buffer);
+
+/**
+ * Start the event dispatcher thread unless it runs
+ * or events are drained externally.
+ */
+int FreeRDP_start_dispatcher(void);
+
+/**
+ * Stop the dispatcher thread so events are drained by
+ * dispatch_events() from an event loop instead.
+ */
+int FreeRDP_external_dispatch(void);
+
+/**
+ * Register AsyncFreeRDP.
+ */
+int FreeRDP_AddAsync(PyObject* module);
+
+/**
+ * Register SessionTemplate, and start_many() for the module table.
+ */
+int FreeRDP_AddTemplate(PyObject* module);
+PyObject* FreeRDP_start_many(PyObject* module, PyObject* args, PyObject* kwargs);
+
+/**
+ * Native template of a SessionTemplate, NULL with an exception set.
+ */
+session_template_t* FreeRDP_template(PyObject* object);
+
+/**
+ * Register SessionPool.
+ */
+int FreeRDP_AddPool(PyObject* module);
+
+/**
+ * Encode macro steps for compile_macro(). FreeRDP_macro_program
+ * passes a compiled program through as bytes.
+ */
+PyObject* FreeRDP_compile_macro(PyObject* module, PyObject* steps);
+PyObject* FreeRDP_macro_program(PyObject* program);
+
+#endif
@@ -0,0 +1,633 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <freerdp/freerdp.h>
+#include <winpr/crt.h>
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * Address space reserved per recording. The file grows into
+ * it in RECORD_GROW steps, recording stops once it is full.
+ */
+#define RECORD_MAX (16ULL << 30)
+#define RECORD_GROW (16ULL << 20)
+
+#define RECORD_MAGIC 0x43525246
+#define RECORD_VERSION 1
+
+/**
+ * Record kinds. Each paint callback the server drives is one
+ * record, channel data is one record per chunk.
+ */
+#define RECORD_BEGIN_PAINT  1
+#define RECORD_END_PAINT    2
+#define RECORD_BITMAP       3
+#define RECORD_SURFACE_BITS 4
+#define RECORD_PALETTE      5
+#define RECORD_CHANNEL      6
+
+/**
+ * Start of the file, what the session negotiated. `end` is
+ * where the next record goes.
+ */
+struct record_header {
+    UINT32 magic;
+    UINT32 version;
+    UINT32 width;
+    UINT32 height;
+    UINT32 depth;
+    UINT32 pad;
+    UINT64 end;
+    char host[64];
+};
+
+/**
+ * Nanoseconds since connect, the payload follows padded to 8 bytes.
+ */
+struct record_entry {
+    UINT64 stamp;
+    UINT32 kind;
+    UINT32 length;
+};
+
+/**
+ * A Bitmap Update is a count, then the rectangles, each
+ * followed by its bitmap padded to 8 bytes.
+ */
+struct record_bitmap {
+    UINT32 dest_left;
+    UINT32 dest_top;
+    UINT32 dest_right;
+    UINT32 dest_bottom;
+    UINT32 width;
+    UINT32 height;
+    UINT32 bpp;
+    UINT32 flags;
+    UINT32 length;
+    UINT32 first_row_size;
+    UINT32 main_body_size;
+    UINT32 scan_width;
+    UINT32 uncompressed_size;
+    UINT32 compressed;
+};
+
+struct record_surface {
+    UINT32 cmd_type;
+    UINT32 dest_left;
+    UINT32 dest_top;
+    UINT32 dest_right;
+    UINT32 dest_bottom;
+    UINT32 bpp;
+    UINT32 codec_id;
+    UINT32 width;
+    UINT32 height;
+    UINT32 length;
+};
+
+struct record_channel {
+    UINT32 id;
+    UINT32 flags;
+    UINT32 total_size;
+    UINT32 size;
+};
+
+#define RECORD_ALIGN(n) (((n) + 7) & ~(UINT64)7)
+
+/**
+ * Recording session state, written by the session loop only. The
+ * callbacks it wrapped are called after each record is taken.
+ */
+struct recorder {
+    int fd;
+    BYTE* map;
+    UINT64 size;
+    UINT64 start;
+    BOOL full;
+    pBeginPaint begin_paint;
+    pEndPaint end_paint;
+    pBitmapUpdate bitmap_update;
+    pSurfaceBits surface_bits;
+    pPalette palette;
+};
+
+/**
+ * A recording mapped for playback, with room for the
+ * rectangles of the largest Bitmap Update seen.
+ */
+struct replayer {
+    BYTE* map;
+    UINT64 size;
+    int flags;
+    BITMAP_DATA* rects;
+    UINT32 max_rects;
+};
+
+static struct record_header* record_header(BYTE* map) {
+    return (struct record_header*)map;
+}
+
+/**
+ * Room for a record of `length` payload bytes at the end of the
+ * file, NULL once the file is full. Nothing is visible to a reader
+ * until record_commit().
+ */
+static BYTE* record_reserve(struct recorder* rec, UINT32 kind, UINT64 length) {
+    UINT64 size;
+    UINT64 end = record_header(rec->map)->end;
+    UINT64 need = RECORD_ALIGN(sizeof(struct record_entry) + length);
+    struct record_entry* entry;
+    if (rec->full)
+        return NULL;
+    if (end + need > RECORD_MAX || length > 0xffffffffULL) {
+        fprintf(stderr, "record: file full, recording stopped\n");
+        rec->full = TRUE;
+        return NULL;
+    }
+    if (end + need > rec->size) {
+        size = (end + need + RECORD_GROW - 1) / RECORD_GROW * RECORD_GROW;
+        if (ftruncate(rec->fd, size) != 0) {
+            fprintf(stderr, "record: can't grow file: %s\n", strerror(errno));
+            rec->full = TRUE;
+            return NULL;
+        }
+        rec->size = size;
+    }
+    entry = (struct record_entry*)(rec->map + end);
+    entry->stamp = fapi_now() - rec->start;
+    entry->kind = kind;
+    entry->length = (UINT32)length;
+    return (BYTE*)(entry + 1);
+}
+
+/**
+ * Publish the record reserved last.
+ */
+static void record_commit(struct recorder* rec) {
+    struct record_header* header = record_header(rec->map);
+    struct record_entry* entry = (struct record_entry*)(rec->map + header->end);
+    __atomic_store_n(&header->end, header->end + RECORD_ALIGN(sizeof(struct record_entry) + entry->length),
+                     __ATOMIC_RELEASE);
+}
+
+static void record_empty(Context* ctx, UINT32 kind) {
+    if (record_reserve(ctx->recorder, kind, 0) != NULL)
+        record_commit(ctx->recorder);
+}
+
+static void fapi_record_begin_paint(rdpContext* context) {
+    Context* ctx = (Context*)context;
+    record_empty(ctx, RECORD_BEGIN_PAINT);
+    if (ctx->recorder->begin_paint != NULL)
+        ctx->recorder->begin_paint(context);
+}
+
+static void fapi_record_end_paint(rdpContext* context) {
+    Context* ctx = (Context*)context;
+    record_empty(ctx, RECORD_END_PAINT);
+    if (ctx->recorder->end_paint != NULL)
+        ctx->recorder->end_paint(context);
+}
+
+static void fapi_record_bitmap(rdpContext* context, BITMAP_UPDATE* bitmap) {
+    UINT32 i;
+    UINT64 length = 8;
+    BYTE* p;
+    BITMAP_DATA* data;
+    struct record_bitmap* rect;
+    Context* ctx = (Context*)context;
+    for (i = 0; i < bitmap->number; i++)
+        length += RECORD_ALIGN(sizeof(struct record_bitmap) + bitmap->rectangles[i].bitmapLength);
+    p = record_reserve(ctx->recorder, RECORD_BITMAP, length);
+    if (p != NULL) {
+        *(UINT32*)p = bitmap->number;
+        p += 8;
+        for (i = 0; i < bitmap->number; i++) {
+            data = &bitmap->rectangles[i];
+            rect = (struct record_bitmap*)p;
+            rect->dest_left = data->destLeft;
+            rect->dest_top = data->destTop;
+            rect->dest_right = data->destRight;
+            rect->dest_bottom = data->destBottom;
+            rect->width = data->width;
+            rect->height = data->height;
+            rect->bpp = data->bitsPerPixel;
+            rect->flags = data->flags;
+            rect->length = data->bitmapLength;
+            rect->first_row_size = data->cbCompFirstRowSize;
+            rect->main_body_size = data->cbCompMainBodySize;
+            rect->scan_width = data->cbScanWidth;
+            rect->uncompressed_size = data->cbUncompressedSize;
+            rect->compressed = data->compressed;
+            CopyMemory(rect + 1, data->bitmapDataStream, data->bitmapLength);
+            p += RECORD_ALIGN(sizeof(struct record_bitmap) + data->bitmapLength);
+        }
+        record_commit(ctx->recorder);
+    }
+    if (ctx->recorder->bitmap_update != NULL)
+        ctx->recorder->bitmap_update(context, bitmap);
+}
+
+static void fapi_record_surface_bits(rdpContext* context, SURFACE_BITS_COMMAND* cmd) {
+    Context* ctx = (Context*)context;
+    struct record_surface* surface;
+    surface = (struct record_surface*)record_reserve(ctx->recorder, RECORD_SURFACE_BITS,
+                                                     sizeof(struct record_surface) + cmd->bitmapDataLength);
+    if (surface != NULL) {
+        surface->cmd_type = cmd->cmdType;
+        surface->dest_left = cmd->destLeft;
+        surface->dest_top = cmd->destTop;
+        surface->dest_right = cmd->destRight;
+        surface->dest_bottom = cmd->destBottom;
+        surface->bpp = cmd->bpp;
+        surface->codec_id = cmd->codecID;
+        surface->width = cmd->width;
+        surface->height = cmd->height;
+        surface->length = cmd->bitmapDataLength;
+        CopyMemory(surface + 1, cmd->bitmapData, cmd->bitmapDataLength);
+        record_commit(ctx->recorder);
+    }
+    if (ctx->recorder->surface_bits != NULL)
+        ctx->recorder->surface_bits(context, cmd);
+}
+
+static void fapi_record_palette(rdpContext* context, PALETTE_UPDATE* palette) {
+    Context* ctx = (Context*)context;
+    UINT32 number = palette->number > 256 ? 256 : palette->number;
+    BYTE* p = record_reserve(ctx->recorder, RECORD_PALETTE, 4 + number * sizeof(PALETTE_ENTRY));
+    if (p != NULL) {
+        *(UINT32*)p = number;
+        CopyMemory(p + 4, palette->entries, number * sizeof(PALETTE_ENTRY));
+        record_commit(ctx->recorder);
+    }
+    if (ctx->recorder->palette != NULL)
+        ctx->recorder->palette(context, palette);
+}
+
+/**
+ * Tee a virtual channel chunk, session loop only.
+ */
+void fapi_record_channel(Context* ctx, int channelId, BYTE* data, int size, int flags, int total_size) {
+    struct record_channel* chunk;
+    if (ctx->recorder == NULL || size < 0)
+        return;
+    chunk = (struct record_channel*)record_reserve(ctx->recorder, RECORD_CHANNEL,
+                                                   sizeof(struct record_channel) + size);
+    if (chunk == NULL)
+        return;
+    chunk->id = channelId;
+    chunk->flags = flags;
+    chunk->total_size = total_size;
+    chunk->size = size;
+    CopyMemory(chunk + 1, data, size);
+    record_commit(ctx->recorder);
+}
+
+/**
+ * Create the recording, replacing any file at `path`.
+ */
+static struct recorder* record_open(const char* path, rdpSettings* settings) {
+    int fd;
+    struct recorder* rec;
+    struct record_header* header;
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "record: can't open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    rec = (struct recorder*)calloc(1, sizeof(struct recorder));
+    if (rec == NULL || ftruncate(fd, RECORD_GROW) != 0) {
+        free(rec);
+        close(fd);
+        return NULL;
+    }
+    rec->map = (BYTE*)mmap(NULL, RECORD_MAX, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (rec->map == MAP_FAILED) {
+        fprintf(stderr, "record: can't map %s: %s\n", path, strerror(errno));
+        free(rec);
+        close(fd);
+        return NULL;
+    }
+    rec->fd = fd;
+    rec->size = RECORD_GROW;
+    rec->start = fapi_now();
+    header = record_header(rec->map);
+    header->magic = RECORD_MAGIC;
+    header->version = RECORD_VERSION;
+    header->width = settings->DesktopWidth;
+    header->height = settings->DesktopHeight;
+    header->depth = settings->ColorDepth;
+    if (settings->ServerHostname != NULL)
+        strncpy(header->host, settings->ServerHostname, sizeof(header->host) - 1);
+    header->end = sizeof(struct record_header);
+    return rec;
+}
+
+/**
+ * Negotiate only what a recording can replay: bitmap updates and
+ * surface commands. Drawing orders and the caches they refer to
+ * are turned off, their effect would depend on state not recorded.
+ */
+void fapi_record_pre_connect(Context* ctx) {
+    rdpSettings* settings = ctx->_p.settings;
+    if (ctx->record_path == NULL)
+        return;
+    ZeroMemory(settings->OrderSupport, 32);
+    settings->BitmapCacheEnabled = FALSE;
+    settings->BitmapCachePersistEnabled = FALSE;
+    settings->OffscreenSupportLevel = 0;
+    settings->GlyphSupportLevel = GLYPH_SUPPORT_NONE;
+}
+
+/**
+ * Open the recording and hook the paint callbacks, after the
+ * GDI and the session registered theirs.
+ */
+void fapi_record_post_connect(Context* ctx) {
+    rdpUpdate* update = ctx->_p.update;
+    struct recorder* rec;
+    if (ctx->record_path == NULL)
+        return;
+    /* a reconnect appends to the same file */
+    if (ctx->recorder == NULL)
+        ctx->recorder = record_open(ctx->record_path, ctx->_p.settings);
+    rec = ctx->recorder;
+    if (rec == NULL)
+        return;
+    rec->begin_paint = update->BeginPaint;
+    rec->end_paint = update->EndPaint;
+    rec->bitmap_update = update->BitmapUpdate;
+    rec->surface_bits = update->SurfaceBits;
+    rec->palette = update->Palette;
+    update->BeginPaint = fapi_record_begin_paint;
+    update->EndPaint = fapi_record_end_paint;
+    update->BitmapUpdate = fapi_record_bitmap;
+    update->SurfaceBits = fapi_record_surface_bits;
+    update->Palette = fapi_record_palette;
+}
+
+/**
+ * Map a recording for playback, NULL if it is not one.
+ */
+static struct replayer* replay_open(const char* path, int flags) {
+    int fd;
+    BYTE* map;
+    struct stat st;
+    struct replayer* rep;
+    struct record_header* header;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "replay: can't open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (UINT64)st.st_size < sizeof(struct record_header)) {
+        fprintf(stderr, "replay: %s is not a recording\n", path);
+        close(fd);
+        return NULL;
+    }
+    /* private and writable, the decoders get non-const pointers into it */
+    map = (BYTE*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "replay: can't map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    header = record_header(map);
+    if (header->magic != RECORD_MAGIC || header->version != RECORD_VERSION || header->end > (UINT64)st.st_size ||
+        header->width == 0 || header->height == 0) {
+        fprintf(stderr, "replay: %s is not a recording\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    header->host[sizeof(header->host) - 1] = '\0';
+    rep = (struct replayer*)calloc(1, sizeof(struct replayer));
+    if (rep == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    rep->map = map;
+    rep->size = st.st_size;
+    rep->flags = flags;
+    return rep;
+}
+
+/**
+ * Sleep until `due` unless the session is stopped first.
+ */
+static BOOL replay_wait(Context* ctx, UINT64 due) {
+    UINT64 now;
+    UINT64 count;
+    struct pollfd pfd;
+    pfd.fd = ctx->wakefd;
+    pfd.events = POLLIN;
+    while (!ctx->shutdown && (now = fapi_now()) < due) {
+        pfd.revents = 0;
+        poll(&pfd, 1, (int)((due - now + 999999) / 1000000));
+        while (read(ctx->wakefd, &count, sizeof(count)) > 0)
+            ;
+    }
+    return !ctx->shutdown;
+}
+
+/**
+ * Rebuild a Bitmap Update and hand it to the session. FALSE
+ * if the record runs past its length.
+ */
+static BOOL replay_bitmap(Context* ctx, BYTE* p, UINT32 length) {
+    UINT32 i;
+    UINT32 number;
+    UINT64 offset = 8;
+    BITMAP_UPDATE bitmap;
+    BITMAP_DATA* data;
+    BITMAP_DATA* rects;
+    struct record_bitmap* rect;
+    struct replayer* rep = ctx->replay;
+    if (length < 8)
+        return FALSE;
+    number = *(UINT32*)p;
+    if (number > length / sizeof(struct record_bitmap))
+        return FALSE;
+    if (number > rep->max_rects) {
+        rects = (BITMAP_DATA*)realloc(rep->rects, number * sizeof(BITMAP_DATA));
+        if (rects == NULL)
+            return FALSE;
+        rep->rects = rects;
+        rep->max_rects = number;
+    }
+    for (i = 0; i < number; i++) {
+        rect = (struct record_bitmap*)(p + offset);
+        if (offset + sizeof(struct record_bitmap) > length ||
+            offset + RECORD_ALIGN(sizeof(struct record_bitmap) + rect->length) > RECORD_ALIGN(length))
+            return FALSE;
+        data = &rep->rects[i];
+        data->destLeft = rect->dest_left;
+        data->destTop = rect->dest_top;
+        data->destRight = rect->dest_right;
+        data->destBottom = rect->dest_bottom;
+        data->width = rect->width;
+        data->height = rect->height;
+        data->bitsPerPixel = rect->bpp;
+        data->flags = rect->flags;
+        data->bitmapLength = rect->length;
+        data->cbCompFirstRowSize = rect->first_row_size;
+        data->cbCompMainBodySize = rect->main_body_size;
+        data->cbScanWidth = rect->scan_width;
+        data->cbUncompressedSize = rect->uncompressed_size;
+        data->compressed = rect->compressed;
+        data->bitmapDataStream = (BYTE*)(rect + 1);
+        offset += RECORD_ALIGN(sizeof(struct record_bitmap) + rect->length);
+    }
+    bitmap.count = number;
+    bitmap.number = number;
+    bitmap.rectangles = rep->rects;
+    if (ctx->_p.update->BitmapUpdate != NULL)
+        ctx->_p.update->BitmapUpdate(&ctx->_p, &bitmap);
+    return TRUE;
+}
+
+static BOOL replay_surface_bits(Context* ctx, BYTE* p, UINT32 length) {
+    SURFACE_BITS_COMMAND cmd;
+    struct record_surface* surface = (struct record_surface*)p;
+    if (length < sizeof(struct record_surface) || surface->length > length - sizeof(struct record_surface))
+        return FALSE;
+    cmd.cmdType = surface->cmd_type;
+    cmd.destLeft = surface->dest_left;
+    cmd.destTop = surface->dest_top;
+    cmd.destRight = surface->dest_right;
+    cmd.destBottom = surface->dest_bottom;
+    cmd.bpp = surface->bpp;
+    cmd.codecID = surface->codec_id;
+    cmd.width = surface->width;
+    cmd.height = surface->height;
+    cmd.bitmapDataLength = surface->length;
+    cmd.bitmapData = (BYTE*)(surface + 1);
+    if (ctx->_p.update->SurfaceBits != NULL)
+        ctx->_p.update->SurfaceBits(&ctx->_p, &cmd);
+    return TRUE;
+}
+
+static BOOL replay_palette(Context* ctx, BYTE* p, UINT32 length) {
+    PALETTE_UPDATE palette;
+    if (length < 4)
+        return FALSE;
+    palette.number = *(UINT32*)p;
+    if (palette.number > 256 || palette.number * sizeof(PALETTE_ENTRY) > length - 4)
+        return FALSE;
+    CopyMemory(palette.entries, p + 4, palette.number * sizeof(PALETTE_ENTRY));
+    if (ctx->_p.update->Palette != NULL)
+        ctx->_p.update->Palette(&ctx->_p, &palette);
+    return TRUE;
+}
+
+/**
+ * Replay session thread. Connects the GDI as a live session would,
+ * then feeds every record to the session's paint callbacks, at once
+ * or at the recorded pace. Channel data is skipped, the channel
+ * manager routes it by the ids of a live connection.
+ */
+int fapi_replay_run(freerdp* instance) {
+    BYTE* p;
+    BOOL valid = TRUE;
+    UINT64 begin;
+    UINT64 offset = sizeof(struct record_header);
+    Context* ctx = (Context*)instance->context;
+    struct replayer* rep = ctx->replay;
+    struct record_entry* entry;
+    UINT64 end = record_header(rep->map)->end;
+    /* there is no connection to tear down */
+    ctx->disconnected = TRUE;
+    if (!instance->PostConnect(instance)) {
+        fapi_close(instance);
+        return 0;
+    }
+    fapi_connected(ctx);
+    begin = fapi_now();
+    while (valid && !ctx->shutdown && offset + sizeof(struct record_entry) <= end) {
+        entry = (struct record_entry*)(rep->map + offset);
+        if (offset + RECORD_ALIGN(sizeof(struct record_entry) + entry->length) > end)
+            break;
+        p = (BYTE*)(entry + 1);
+        offset += RECORD_ALIGN(sizeof(struct record_entry) + entry->length);
+        if ((rep->flags & REPLAY_REALTIME) && !replay_wait(ctx, begin + entry->stamp))
+            break;
+        switch (entry->kind) {
+        case RECORD_BEGIN_PAINT:
+            if (ctx->_p.update->BeginPaint != NULL)
+                ctx->_p.update->BeginPaint(&ctx->_p);
+            break;
+        case RECORD_END_PAINT:
+            if (ctx->_p.update->EndPaint != NULL)
+                ctx->_p.update->EndPaint(&ctx->_p);
+            break;
+        case RECORD_BITMAP:
+            valid = replay_bitmap(ctx, p, entry->length);
+            break;
+        case RECORD_SURFACE_BITS:
+            valid = replay_surface_bits(ctx, p, entry->length);
+            break;
+        case RECORD_PALETTE:
+            valid = replay_palette(ctx, p, entry->length);
+            break;
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "replay: bad record at offset %llu\n", (unsigned long long)offset);
+        fapi_emit(ctx, EVENT_ERROR, SESSION_ERROR_TRANSPORT);
+    }
+    fapi_close(instance);
+    return 0;
+}
+
+session_t replay(const char* path, int flags, instance_callback_t onConnect) {
+    freerdp* instance;
+    Context* ctx;
+    rdpSettings* settings;
+    struct record_header* header;
+    struct replayer* rep = replay_open(path, flags);
+    if (rep == NULL)
+        return 0;
+    header = record_header(rep->map);
+    instance = fapi_instance_new(onConnect, NULL);
+    ctx = (Context*)instance->context;
+    ctx->replay = rep;
+    settings = instance->settings;
+    settings->DesktopWidth = header->width;
+    settings->DesktopHeight = header->height;
+    settings->ColorDepth = header->depth;
+    settings->ServerHostname = strdup(header->host);
+    /* no channels to load, nothing arrives on them */
+    settings->RedirectClipboard = FALSE;
+    return fapi_launch(instance);
+}
+
+/**
+ * Close the recording, cut to what was written, or unmap a replay.
+ */
+void fapi_record_free(Context* ctx) {
+    struct recorder* rec = ctx->recorder;
+    struct replayer* rep = ctx->replay;
+    if (rec != NULL) {
+        if (ftruncate(rec->fd, record_header(rec->map)->end) != 0)
+            fprintf(stderr, "record: can't trim file: %s\n", strerror(errno));
+        munmap(rec->map, RECORD_MAX);
+        close(rec->fd);
+        free(rec);
+    }
+    if (rep != NULL) {
+        munmap(rep->map, rep->size);
+        free(rep->rects);
+        free(rep);
+    }
+    ctx->recorder = NULL;
+    ctx->replay = NULL;
+    free(ctx->record_path);
+    ctx->record_path = NULL;
+}
@@ -0,0 +1,70 @@
+#include <freerdp/freerdp.h>
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * Bounding box of two rectangles.
+ */
+static rect_t rect_union(rect_t a, rect_t b) {
+    rect_t u;
+    u.x = a.x < b.x ? a.x : b.x;
+    u.y = a.y < b.y ? a.y : b.y;
+    u.width = (a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width) - u.x;
+    u.height = (a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height) - u.y;
+    return u;
+}
+
+/**
+ * Add a rectangle to a coalesced list. Rectangles merge when their
+ * bounding box costs no more than their combined area, and the list
+ * folds into its cheapest merge once full.
+ */
+void dirty_add(rect_t* rects, int* count, int max, rect_t r) {
+    int i;
+    int best;
+    long cost;
+    long best_cost;
+    rect_t u;
+    if (r.width <= 0 || r.height <= 0 || max <= 0)
+        return;
+    for (i = 0; i < *count; i++) {
+        u = rect_union(rects[i], r);
+        if ((long)u.width * u.height <= (long)rects[i].width * rects[i].height + (long)r.width * r.height) {
+            /* pull the merged rectangle back through the list */
+            rects[i] = rects[--(*count)];
+            r = u;
+            i = -1;
+        }
+    }
+    if (*count < max) {
+        rects[(*count)++] = r;
+        return;
+    }
+    best = 0;
+    best_cost = -1;
+    for (i = 0; i < *count; i++) {
+        u = rect_union(rects[i], r);
+        cost = (long)u.width * u.height - (long)rects[i].width * rects[i].height;
+        if (best_cost < 0 || cost < best_cost) {
+            best = i;
+            best_cost = cost;
+        }
+    }
+    rects[best] = rect_union(rects[best], r);
+}
+
+/**
+ * Clip `r` to `bounds`, FALSE when nothing is left.
+ */
+BOOL rect_clip(rect_t* r, const rect_t* bounds) {
+    int right = r->x + r->width;
+    int bottom = r->y + r->height;
+    if (r->x < bounds->x) r->x = bounds->x;
+    if (r->y < bounds->y) r->y = bounds->y;
+    if (right > bounds->x + bounds->width) right = bounds->x + bounds->width;
+    if (bottom > bounds->y + bounds->height) bottom = bounds->y + bounds->height;
+    r->width = right - r->x;
+    r->height = bottom - r->y;
+    return r->width > 0 && r->height > 0;
+}
@@ -0,0 +1,160 @@
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <freerdp/freerdp.h>
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * Slots are allocated in fixed chunks that never move, so
+ * growing the table leaves existing slots where they are.
+ */
+#define REGISTRY_CHUNK_BITS 10
+#define REGISTRY_CHUNK (1 << REGISTRY_CHUNK_BITS)
+#define REGISTRY_CHUNKS 4096
+
+/**
+ * A handle is the slot index in the low 32 bits and the slot
+ * generation in the high 32 bits, bumped on every removal.
+ */
+struct slot {
+    Context* ctx;
+    UINT32 generation;
+    UINT32 next_free;
+};
+
+/**
+ * Lookups share the lock, adds and removals take it exclusively.
+ * A context stays referenced by its slot, so anything found
+ * under the lock is safe to reference.
+ */
+static struct {
+    pthread_rwlock_t lock;
+    struct slot* chunks[REGISTRY_CHUNKS];
+    UINT32 capacity;
+    UINT32 free_head;
+} g_registry = { PTHREAD_RWLOCK_INITIALIZER };
+
+/**
+ * Slot for an index below capacity.
+ */
+static struct slot* registry_slot(UINT32 index) {
+    return &g_registry.chunks[index >> REGISTRY_CHUNK_BITS][index & (REGISTRY_CHUNK - 1)];
+}
+
+/**
+ * Slot a live handle refers to, NULL for stale or bogus handles.
+ */
+static struct slot* registry_find(session_t session) {
+    struct slot* slot;
+    UINT32 index = (UINT32)session;
+    if (index >= g_registry.capacity)
+        return NULL;
+    slot = registry_slot(index);
+    if (slot->ctx == NULL || slot->generation != (UINT32)(session >> 32))
+        return NULL;
+    return slot;
+}
+
+/**
+ * Register a session, the slot takes over one reference.
+ * Returns 0 when the table is full.
+ */
+session_t registry_add(Context* ctx) {
+    UINT32 index;
+    UINT32 base;
+    struct slot* slot;
+    struct slot* chunk;
+    session_t session = 0;
+    pthread_rwlock_wrlock(&g_registry.lock);
+    if (g_registry.free_head == 0 && g_registry.capacity < (UINT32)REGISTRY_CHUNKS * REGISTRY_CHUNK) {
+        chunk = (struct slot*)calloc(REGISTRY_CHUNK, sizeof(struct slot));
+        if (chunk != NULL) {
+            base = g_registry.capacity;
+            g_registry.chunks[base >> REGISTRY_CHUNK_BITS] = chunk;
+            g_registry.capacity += REGISTRY_CHUNK;
+            /* free list links are index + 1, 0 ends the list */
+            for (index = REGISTRY_CHUNK; index > 0; index--) {
+                chunk[index - 1].generation = 1;
+                chunk[index - 1].next_free = g_registry.free_head;
+                g_registry.free_head = base + index;
+            }
+        }
+    }
+    if (g_registry.free_head != 0) {
+        index = g_registry.free_head - 1;
+        slot = registry_slot(index);
+        g_registry.free_head = slot->next_free;
+        slot->ctx = ctx;
+        session = ((session_t)slot->generation << 32) | index;
+        ctx->session = session;
+    }
+    pthread_rwlock_unlock(&g_registry.lock);
+    return session;
+}
+
+/**
+ * Look up a session and take a reference, drop it with fapi_release.
+ */
+Context* registry_get(session_t session) {
+    Context* ctx = NULL;
+    struct slot* slot;
+    pthread_rwlock_rdlock(&g_registry.lock);
+    slot = registry_find(session);
+    if (slot != NULL) {
+        ctx = slot->ctx;
+        __atomic_add_fetch(&ctx->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    pthread_rwlock_unlock(&g_registry.lock);
+    return ctx;
+}
+
+/**
+ * Unregister a session, handing the slot's reference to the caller.
+ * The handle and any copies of it go stale.
+ */
+Context* registry_remove(session_t session) {
+    Context* ctx = NULL;
+    struct slot* slot;
+    pthread_rwlock_wrlock(&g_registry.lock);
+    slot = registry_find(session);
+    if (slot != NULL) {
+        ctx = slot->ctx;
+        slot->ctx = NULL;
+        if (++slot->generation == 0)
+            slot->generation = 1;
+        slot->next_free = g_registry.free_head;
+        g_registry.free_head = (UINT32)session + 1;
+    }
+    pthread_rwlock_unlock(&g_registry.lock);
+    return ctx;
+}
+
+/**
+ * Call `fn` for every registered session under the shared lock,
+ * it must not add or remove sessions.
+ */
+void registry_each(void (*fn)(Context* ctx, void* arg), void* arg) {
+    UINT32 index;
+    struct slot* slot;
+    pthread_rwlock_rdlock(&g_registry.lock);
+    for (index = 0; index < g_registry.capacity; index++) {
+        slot = registry_slot(index);
+        if (slot->ctx != NULL)
+            fn(slot->ctx, arg);
+    }
+    pthread_rwlock_unlock(&g_registry.lock);
+}
+
+static void registry_stop(Context* ctx, void* arg) {
+    fapi_stop(ctx);
+}
+
+/**
+ * Ask every registered session to shut down.
+ */
+void registry_stop_all(void) {
+    registry_each(registry_stop, NULL);
+}
@@ -0,0 +1,357 @@
+#ifndef FREERDP_SESSION_H
+#define FREERDP_SESSION_H
+
+#include <pthread.h>
+#include <freerdp/freerdp.h>
+
+#include "freerdp.h"
+
+/**
+ * Most descriptors a session exposes through
+ * freerdp_get_fds and freerdp_channels_get_fds.
+ */
+#define FAPI_MAX_FDS 32
+
+/**
+ * Readiness kinds reported to fapi_dispatch.
+ */
+#define FAPI_EV_NET   0x1
+#define FAPI_EV_WAKE  0x2
+#define FAPI_EV_TIMER 0x4
+
+/**
+ * Coalesced rectangles kept per frame, and
+ * how many frames of history are kept.
+ */
+#define FAPI_DIRTY_RECTS 16
+#define FAPI_DIRTY_HISTORY 64
+
+/**
+ * Unlocked template searches a paint may spoil before
+ * find_image searches under fb_lock.
+ */
+#define FAPI_SEARCH_RETRIES 3
+
+/**
+ * Finished macro results kept for macro_result().
+ */
+#define FAPI_MACRO_RESULTS 16
+
+struct context;
+struct worker;
+struct session_pool;
+struct recorder;
+struct replayer;
+struct thumbnail;
+
+/**
+ * Epoll registration, tells which of the
+ * session's descriptors fired.
+ */
+struct watch {
+    struct context* ctx;
+    int kind;
+};
+
+/**
+ * Input event kinds.
+ */
+#define INPUT_KEY       1
+#define INPUT_UNICODE   2
+#define INPUT_CLIPBOARD 3
+#define INPUT_MOUSE     4
+#define INPUT_WAIT      5
+#define INPUT_DELAY     6
+
+/**
+ * Clipboard operations carried by INPUT_CLIPBOARD events.
+ */
+#define CLIP_ANNOUNCE 1
+#define CLIP_REQUEST  2
+
+/**
+ * One input step, followed by `delay` microseconds before the
+ * next one is sent. With `echo` set the delay waits for the screen
+ * to answer, and with echo pacing ends as soon as it does. Mouse
+ * events carry x in `code`; waits find their macro_wait at `arg`
+ * in the command's data.
+ */
+struct input_event {
+    UINT16 type;
+    UINT16 flags;
+    UINT16 code;
+    UINT16 y;
+    UINT32 delay;
+    BOOL echo;
+    UINT32 arg;
+};
+
+/**
+ * A macro's screen wait, for a change in `area` or for a template
+ * image inside it, whose pixels follow.
+ */
+struct macro_wait {
+    int step;
+    rect_t area;
+    BOOL anywhere;
+    UINT32 timeout;
+    int width;
+    int height;
+    double threshold;
+};
+
+/**
+ * Batch of input queued to a session. Macros keep their waits in
+ * `data` and report `result` when they finish.
+ */
+struct command {
+    struct command* next;
+    UINT64 submitted;
+    unsigned int ticket;
+    int count;
+    int pos;
+    struct input_event* events;
+    BYTE* data;
+    BOOL macro;
+    macro_result_t result;
+};
+
+/**
+ * Regions invalidated by one frame.
+ */
+struct dirty_frame {
+    unsigned int frame;
+    int count;
+    rect_t rects[FAPI_DIRTY_RECTS];
+};
+
+/**
+ * Additional context.
+ */
+struct context {
+    rdpContext _p;
+    volatile BOOL shutdown;
+    BOOL disconnected;
+    instance_callback_t onConnect;
+    BOOL headless;
+    session_t session;
+    void* owner;
+    volatile int coalesce;
+    int wakefd;
+    int nfds;
+    int fds[FAPI_MAX_FDS];
+    int sockfd;
+    UINT64 sampled;
+    UINT64 tcp_seen[4];
+    int timerfd;
+    struct watch net_watch;
+    struct watch wake_watch;
+    struct watch timer_watch;
+    struct worker* worker;
+    struct context* next;
+    unsigned int epoch;
+    int ready;
+    volatile int refs;
+    pthread_mutex_t fb_lock;
+    pthread_cond_t fb_cond;
+    BOOL painting;
+    BOOL closed;
+    volatile unsigned int fb_seq;
+    volatile BOOL fb_held;
+    pthread_t fb_owner;
+    volatile unsigned int frame;
+    struct dirty_frame dirty[FAPI_DIRTY_HISTORY];
+    struct command* volatile queue_head;
+    struct command* queue_tail;
+    struct command queue_stub;
+    struct command* stash;
+    struct command* stash_tail;
+    struct command* current;
+    UINT64 input_due;
+    volatile int input_pacing;
+    volatile UINT64 input_quiet;
+    UINT64 last_paint;
+    BOOL echo_wait;
+    unsigned int echo_frame;
+    UINT64 echo_sent;
+    UINT64 echo_seen;
+    UINT64 echo_deadline;
+    UINT64 echo_limit;
+    UINT64 echo_avg;
+    UINT64 echo_timeout;
+    BOOL move_pending;
+    UINT16 move_x;
+    UINT16 move_y;
+    BOOL macro_wait;
+    unsigned int macro_frame;
+    UINT64 macro_deadline;
+    unsigned int macro_tickets[FAPI_MACRO_RESULTS];
+    macro_result_t macro_results[FAPI_MACRO_RESULTS];
+    volatile int output_paused;
+    volatile unsigned int output_request;
+    unsigned int output_applied;
+    BOOL output_allowed;
+    BOOL output_area_set;
+    RECTANGLE_16 output_area;
+    volatile int output_idle;
+    volatile UINT64 idle_suppress;
+    volatile UINT64 last_read;
+    volatile int readers;
+    UINT64 output_due;
+    volatile unsigned int input_ticket;
+    volatile unsigned int input_done;
+    volatile int input_waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    BYTE* clip_local;
+    UINT32 clip_local_size;
+    BOOL clip_remote_text;
+    BYTE* clip_remote;
+    UINT32 clip_remote_size;
+    volatile unsigned int clip_responses;
+    volatile BOOL reconnecting;
+    UINT32 reconnect_attempt;
+    UINT64 reconnect_at;
+    volatile unsigned int probe_request;
+    volatile unsigned int probe_done;
+    struct session_pool* pool;
+    int pool_state;
+    char* record_path;
+    struct recorder* recorder;
+    struct replayer* replay;
+    struct thumbnail* thumbnail;
+    volatile UINT64 timings[CONNECT_PHASES];
+    metrics_t metrics;
+};
+typedef struct context Context;
+
+/**
+ * Session steps shared by the per-session
+ * thread and the engine workers.
+ */
+freerdp* fapi_instance_new(instance_callback_t onConnect, const session_options_t* options);
+session_t fapi_launch(freerdp* instance);
+void fapi_discard(freerdp* instance);
+BOOL fapi_connect(freerdp* instance);
+void fapi_connected(Context* ctx);
+BOOL fapi_can_reconnect(Context* ctx);
+BOOL fapi_reconnect(freerdp* instance);
+BOOL fapi_watch_fds(int epfd, Context* ctx);
+void fapi_unwatch_fds(int epfd, Context* ctx);
+BOOL fapi_dispatch(Context* ctx, int ready);
+void fapi_wake(Context* ctx);
+void fapi_stop(Context* ctx);
+void fapi_close(freerdp* instance);
+void fapi_release(Context* ctx);
+UINT64 fapi_now(void);
+void fapi_schedule(Context* ctx, UINT64 due);
+void fapi_arm_timer(Context* ctx);
+
+/**
+ * Queue an event for the dispatcher.
+ */
+void fapi_emit(Context* ctx, int type, unsigned int arg);
+
+/**
+ * Lock-free metrics, counted into the session and the process totals.
+ */
+void fapi_count(Context* ctx, int counter, UINT64 n);
+void fapi_observe(Context* ctx, int histogram, UINT64 ns);
+void fapi_sample_tcp(Context* ctx);
+BOOL fapi_tcp_alive(Context* ctx);
+
+/**
+ * Handle table, O(1) lookups of live sessions.
+ */
+session_t registry_add(Context* ctx);
+Context* registry_get(session_t session);
+Context* registry_remove(session_t session);
+void registry_each(void (*fn)(Context* ctx, void* arg), void* arg);
+void registry_stop_all(void);
+
+/**
+ * Input queue, drained on the session's own loop.
+ */
+void fapi_input_init(Context* ctx);
+void fapi_input_free(Context* ctx);
+unsigned int fapi_input_submit(Context* ctx, struct input_event* events, int count);
+unsigned int fapi_macro_submit(Context* ctx, struct input_event* events, int count,
+                               const BYTE* data, int size, int steps);
+unsigned int fapi_clipboard_submit(Context* ctx, const char* text);
+void fapi_input_service(Context* ctx);
+
+/**
+ * Framebuffer readers. fapi_fb_held tells whether the calling thread
+ * holds fb_lock through lock_framebuffer(). Reads bracketed by
+ * fapi_read_begin and fapi_read_retry need no lock: they are repeated
+ * while a paint ran in between.
+ */
+BOOL fapi_fb_held(Context* ctx);
+unsigned int fapi_read_begin(Context* ctx);
+BOOL fapi_read_retry(Context* ctx, unsigned int seq);
+
+/**
+ * Screen checks behind macro waits, on the session loop.
+ */
+BOOL fapi_screen_changed(Context* ctx, unsigned int since, const rect_t* rect);
+int fapi_find_image(Context* context, const unsigned char* pixels, int width, int height,
+                    const rect_t* region, const unsigned int* since, double threshold, match_t* match);
+
+/**
+ * Clipboard redirection, channel events are handled on the session loop.
+ * Text to offer is encoded on the caller's thread and taken into
+ * clip_local when its announce runs, so queued pastes keep their order.
+ */
+BYTE* fapi_clipboard_encode(const char* text, UINT32* size);
+void fapi_clipboard_take(Context* ctx, const BYTE* text, UINT32 size);
+void fapi_clipboard_send(Context* ctx, int op);
+BOOL fapi_clipboard_event(Context* ctx, wMessage* event);
+void fapi_clipboard_free(Context* ctx);
+
+/**
+ * Session templates and pools.
+ */
+freerdp* fapi_template_instance(session_template_t* tpl, const session_override_t* override,
+                                instance_callback_t onConnect);
+void fapi_pool_connected(Context* ctx);
+void fapi_pool_closed(Context* ctx);
+
+/**
+ * Recording of display updates and channel data, and replay
+ * of a recording without a connection.
+ */
+void fapi_record_pre_connect(Context* ctx);
+void fapi_record_post_connect(Context* ctx);
+void fapi_record_channel(Context* ctx, int channelId, BYTE* data, int size, int flags, int total_size);
+void fapi_record_free(Context* ctx);
+int fapi_replay_run(freerdp* instance);
+
+/**
+ * Downscaled desktop and its hash, updated under the paint.
+ * Readers note themselves like framebuffer readers.
+ */
+void fapi_touch(Context* ctx);
+void fapi_thumbnail_paint(Context* ctx, const rect_t* rects, int count);
+void fapi_thumbnail_free(Context* ctx);
+
+/**
+ * Rectangle lists, dirty_add coalesces into at most `max` entries.
+ */
+void dirty_add(rect_t* rects, int* count, int max, rect_t r);
+BOOL rect_clip(rect_t* r, const rect_t* bounds);
+
+/**
+ * Image kernels.
+ */
+BOOL match_search(const BYTE* frame, int stride, const BYTE* tpl, int tw, int th,
+                  rect_t area, unsigned long* best_sad, match_t* best);
+
+/**
+ * Engine mode, a fixed pool of epoll workers.
+ */
+BOOL engine_running(void);
+void engine_submit(freerdp* instance);
+void engine_stop(void);
+void engine_kick(void);
+
+#endif
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <freerdp/freerdp.h>
+#include <freerdp/client/cmdline.h>
+#include <winpr/crt.h>
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * Arguments parsed once, read-only afterwards
+ * so any number of threads can start from it.
+ */
+struct session_template {
+    rdpSettings* settings;
+    session_options_t options;
+};
+
+/**
+ * Replace a settings string with a copy of `value`.
+ */
+static void settings_string(char** field, const char* value) {
+    free(*field);
+    *field = value != NULL ? strdup(value) : NULL;
+}
+
+/**
+ * Copy the template's settings into a new session's. The session's
+ * own settings object has to stay, the core keeps pointers to it from
+ * freerdp_context_new on, so a clone of the template, which copies
+ * every field and deep-copies strings, arrays, channel and device
+ * lists, is swapped into it. The fields the session had go with the
+ * clone.
+ */
+static BOOL settings_copy(rdpSettings* dst, rdpSettings* src) {
+    rdpSettings swap;
+    rdpSettings* clone = freerdp_settings_clone(src);
+    if (clone == NULL)
+        return FALSE;
+    swap = *dst;
+    *dst = *clone;
+    *clone = swap;
+    dst->instance = swap.instance;
+    freerdp_settings_free(clone);
+    return TRUE;
+}
+
+session_template_t* template_new(int argc, char* argv[], const session_options_t* options) {
+    session_template_t* tpl = (session_template_t*)calloc(1, sizeof(session_template_t));
+    if (tpl == NULL)
+        return NULL;
+    tpl->settings = freerdp_settings_new(NULL);
+    if (tpl->settings == NULL) {
+        free(tpl);
+        return NULL;
+    }
+    /* as fapi_instance_new() sets it before a parse */
+    tpl->settings->RedirectClipboard = TRUE;
+    if (freerdp_client_parse_command_line_arguments(argc, argv, tpl->settings) < 0) {
+        fprintf(stderr, "template_new: bad arguments\n");
+        template_free(tpl);
+        return NULL;
+    }
+    if (options != NULL) {
+        tpl->options = *options;
+        /* sessions would all write the one file */
+        tpl->options.record = NULL;
+    }
+    return tpl;
+}
+
+void template_free(session_template_t* tpl) {
+    if (tpl == NULL)
+        return;
+    freerdp_settings_free(tpl->settings);
+    free(tpl);
+}
+
+/**
+ * New instance set up from a template, not yet launched, NULL if
+ * its settings could not be copied.
+ */
+freerdp* fapi_template_instance(session_template_t* tpl, const session_override_t* override,
+                                instance_callback_t onConnect) {
+    freerdp* instance = fapi_instance_new(onConnect, &tpl->options);
+    rdpSettings* settings = instance->settings;
+    if (!settings_copy(settings, tpl->settings)) {
+        fprintf(stderr, "start_from: can't copy template settings\n");
+        fapi_discard(instance);
+        return NULL;
+    }
+    if (override != NULL) {
+        if (override->host != NULL)
+            settings_string(&settings->ServerHostname, override->host);
+        if (override->port != 0)
+            settings->ServerPort = override->port;
+        if (override->username != NULL)
+            settings_string(&settings->Username, override->username);
+        if (override->password != NULL)
+            settings_string(&settings->Password, override->password);
+        if (override->domain != NULL)
+            settings_string(&settings->Domain, override->domain);
+    }
+    return instance;
+}
+
+session_t start_from(session_template_t* tpl, const session_override_t* override, instance_callback_t onConnect) {
+    freerdp* instance = fapi_template_instance(tpl, override, onConnect);
+    if (instance == NULL)
+        return 0;
+    return fapi_launch(instance);
+}
+
+int start_many(session_template_t* tpl, const session_override_t* overrides, int count,
+               instance_callback_t onConnect, session_t* sessions) {
+    int i;
+    int started = 0;
+    for (i = 0; i < count; i++) {
+        sessions[i] = start_from(tpl, overrides != NULL ? &overrides[i] : NULL, onConnect);
+        if (sessions[i] != 0)
+            started++;
+    }
+    return started;
+}
@@ -0,0 +1,250 @@
+#include <Python.h>
+#include "freerdp.h"
+#include "freerdp_py.h"
+
+/**
+ * Connection arguments parsed once, started many times.
+ */
+typedef struct {
+    PyObject_HEAD
+    session_template_t* _template;
+} SessionTemplate;
+
+static PyTypeObject SessionTemplateType;
+
+static void SessionTemplate_dealloc(SessionTemplate* self) {
+    template_free(self->_template);
+    Py_TYPE(self)->tp_free(self);
+}
+
+/**
+ * Parse and check the arguments, options as for FreeRDP().
+ */
+static int SessionTemplate_init(SessionTemplate* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"args", "headless", "idle_suppress", NULL};
+    char* args_string;
+    char* buffer;
+    char* argv[FREERDP_MAX_ARGS];
+    int argc;
+    int headless = 0;
+    double idle_suppress = 0.0;
+    session_options_t options;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|pd:SessionTemplate", keywords, &args_string,
+                                     &headless, &idle_suppress))
+        return -1;
+    if (self->_template != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "template already initialized");
+        return -1;
+    }
+    argc = FreeRDP_split_args(args_string, argv, &buffer);
+    if (argc < 0)
+        return -1;
+    options.flags = headless ? SESSION_HEADLESS : 0;
+    options.idle_suppress_ms = idle_suppress > 0 ? (int)(idle_suppress * 1000) : 0;
+    options.record = NULL;
+    self->_template = template_new(argc, argv, &options);
+    PyMem_Free(buffer);
+    if (self->_template == NULL) {
+        PyErr_SetString(PyExc_ValueError, "bad session arguments");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * A string field of an override dict, NULL when missing or None.
+ */
+static int SessionTemplate_override_string(PyObject* dict, const char* key, const char** out) {
+    PyObject* value = PyDict_GetItemString(dict, key);
+    *out = NULL;
+    if (value == NULL || value == Py_None)
+        return 0;
+    *out = PyUnicode_AsUTF8(value);
+    return *out == NULL ? -1 : 0;
+}
+
+/**
+ * None, a host name or a dict of host, port, username, password
+ * and domain. Strings stay owned by `item`.
+ */
+static int SessionTemplate_override(PyObject* item, session_override_t* override) {
+    PyObject* port;
+    memset(override, 0, sizeof(session_override_t));
+    if (item == Py_None)
+        return 0;
+    if (PyUnicode_Check(item)) {
+        override->host = PyUnicode_AsUTF8(item);
+        return override->host == NULL ? -1 : 0;
+    }
+    if (!PyDict_Check(item)) {
+        PyErr_SetString(PyExc_TypeError, "overrides must be None, a host name or a dict");
+        return -1;
+    }
+    if (SessionTemplate_override_string(item, "host", &override->host) != 0 ||
+        SessionTemplate_override_string(item, "username", &override->username) != 0 ||
+        SessionTemplate_override_string(item, "password", &override->password) != 0 ||
+        SessionTemplate_override_string(item, "domain", &override->domain) != 0)
+        return -1;
+    port = PyDict_GetItemString(item, "port");
+    if (port != NULL && port != Py_None) {
+        override->port = (unsigned int)PyLong_AsUnsignedLong(port);
+        if (PyErr_Occurred())
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Start a session per override, or `overrides` alike ones for an int,
+ * in one call. Returns a list of FreeRDP objects, None where a start
+ * failed.
+ */
+PyObject* FreeRDP_start_many(PyObject* module, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = {"template", "overrides", "onConnect", "on_event", NULL};
+    Py_ssize_t i;
+    Py_ssize_t count;
+    PyObject* tpl;
+    PyObject* overrides;
+    PyObject* items = NULL;
+    PyObject* list = NULL;
+    PyObject* onConnect = Py_None;
+    PyObject* onEvent = Py_None;
+    FreeRDP* client;
+    session_t* sessions = NULL;
+    session_override_t* changes = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!O|OO:start_many", keywords, &SessionTemplateType, &tpl,
+                                     &overrides, &onConnect, &onEvent))
+        return NULL;
+    if ((onConnect != Py_None && !PyCallable_Check(onConnect)) || (onEvent != Py_None && !PyCallable_Check(onEvent))) {
+        PyErr_SetString(PyExc_TypeError, "callbacks must be callable");
+        return NULL;
+    }
+    if (((SessionTemplate*)tpl)->_template == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "template not initialized");
+        return NULL;
+    }
+    if (PyLong_Check(overrides)) {
+        count = PyLong_AsSsize_t(overrides);
+        if (count < 0) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "count must not be negative");
+            return NULL;
+        }
+    } else {
+        items = PySequence_Fast(overrides, "overrides must be a count or a sequence");
+        if (items == NULL)
+            return NULL;
+        count = PySequence_Fast_GET_SIZE(items);
+        changes = (session_override_t*)PyMem_Malloc((count + 1) * sizeof(session_override_t));
+        if (changes == NULL) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        for (i = 0; i < count; i++) {
+            if (SessionTemplate_override(PySequence_Fast_GET_ITEM(items, i), &changes[i]) != 0)
+                goto done;
+        }
+    }
+    if (FreeRDP_start_dispatcher() != 0)
+        goto done;
+    sessions = (session_t*)PyMem_Malloc((count + 1) * sizeof(session_t));
+    list = PyList_New(count);
+    if (sessions == NULL || list == NULL) {
+        Py_CLEAR(list);
+        PyErr_NoMemory();
+        goto done;
+    }
+    /* objects first, a failed allocation leaves no session behind */
+    for (i = 0; i < count; i++) {
+        client = (FreeRDP*)FreeRDPType.tp_alloc(&FreeRDPType, 0);
+        if (client == NULL) {
+            Py_CLEAR(list);
+            goto done;
+        }
+        if (onConnect != Py_None) {
+            Py_INCREF(onConnect);
+            client->_onConnect = onConnect;
+        }
+        if (onEvent != Py_None) {
+            Py_INCREF(onEvent);
+            client->_onEvent = onEvent;
+        }
+        PyList_SET_ITEM(list, i, (PyObject*)client);
+    }
+    /* the GIL stays held, no event is dispatched before its owner is set */
+    start_many(((SessionTemplate*)tpl)->_template, changes, (int)count, NULL, sessions);
+    for (i = 0; i < count; i++) {
+        if (sessions[i] == 0) {
+            Py_INCREF(Py_None);
+            PyList_SetItem(list, i, Py_None);
+            continue;
+        }
+        client = (FreeRDP*)PyList_GET_ITEM(list, i);
+        set_session_owner(sessions[i], client);
+        client->_session = sessions[i];
+    }
+
+done:
+    PyMem_Free(sessions);
+    PyMem_Free(changes);
+    Py_XDECREF(items);
+    return list;
+}
+
+static PyTypeObject SessionTemplateType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "freerdp.SessionTemplate",    /* tp_name */
+    sizeof(SessionTemplate),      /* tp_basicsize */
+    0,                            /* tp_itemsize */
+    (destructor)SessionTemplate_dealloc, /* tp_dealloc */
+    0,                            /* tp_print */
+    0,                            /* tp_getattr */
+    0,                            /* tp_setattr */
+    0,                            /* tp_reserved */
+    0,                            /* tp_repr */
+    0,                            /* tp_as_number */
+    0,                            /* tp_as_sequence */
+    0,                            /* tp_as_mapping */
+    0,                            /* tp_hash */
+    0,                            /* tp_call */
+    0,                            /* tp_str */
+    0,                            /* tp_getattro */
+    0,                            /* tp_setattro */
+    0,                            /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,           /* tp_flags */
+    "Session arguments parsed once for start_many()", /* tp_doc */
+    0,                            /* tp_traverse */
+    0,                            /* tp_clear */
+    0,                            /* tp_richcompare */
+    0,                            /* tp_weaklistoffset */
+    0,                            /* tp_iter */
+    0,                            /* tp_iternext */
+    0,                            /* tp_methods */
+    0,                            /* tp_members */
+    0,                            /* tp_getset */
+    0,                            /* tp_base */
+    0,                            /* tp_dict */
+    0,                            /* tp_descr_get */
+    0,                            /* tp_descr_set */
+    0,                            /* tp_dictoffset */
+    (initproc)SessionTemplate_init, /* tp_init */
+    0,                            /* tp_alloc */
+    PyType_GenericNew,            /* tp_new */
+};
+
+session_template_t* FreeRDP_template(PyObject* object) {
+    if (!PyObject_TypeCheck(object, &SessionTemplateType)) {
+        PyErr_SetString(PyExc_TypeError, "expected a SessionTemplate");
+        return NULL;
+    }
+    if (((SessionTemplate*)object)->_template == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "template not initialized");
+    return ((SessionTemplate*)object)->_template;
+}
+
+int FreeRDP_AddTemplate(PyObject* module) {
+    if (PyType_Ready(&SessionTemplateType) < 0)
+        return -1;
+    Py_INCREF(&SessionTemplateType);
+    return PyModule_AddObject(module, "SessionTemplate", (PyObject*)&SessionTemplateType);
+}
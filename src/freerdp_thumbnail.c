@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <string.h>
+#include <freerdp/freerdp.h>
+#include <freerdp/gdi/gdi.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAPI_X86 1
+#endif
+
+#include "freerdp.h"
+#include "freerdp_session.h"
+
+/**
+ * Hash grid, HASH_GRID x HASH_GRID cells of the thumbnail.
+ */
+#define HASH_GRID 8
+
+/**
+ * Box-filtered copy of the desktop and the average hash of its
+ * luminance over the grid. Cell sums are kept so a paint only
+ * recomputes the cells it touched.
+ */
+struct thumbnail {
+    int scale;
+    int shift;
+    int width;
+    int height;
+    BYTE* pixels;
+    UINT32 sums[HASH_GRID * HASH_GRID];
+    unsigned long long hash;
+};
+
+/**
+ * Average `blocks` scale x scale blocks of a strip of 32bpp rows
+ * into one pixel each. Scale is 4, 8 or 16, `shift` log2 of its
+ * square.
+ */
+typedef void (*box_row_fn)(const BYTE* src, int stride, int scale, int shift, int blocks, BYTE* dst);
+
+static void box_row_scalar(const BYTE* src, int stride, int scale, int shift, int blocks, BYTE* dst) {
+    int b;
+    int c;
+    int x;
+    int y;
+    UINT32 sum[4];
+    const BYTE* p;
+    for (b = 0; b < blocks; b++) {
+        memset(sum, 0, sizeof(sum));
+        for (y = 0; y < scale; y++) {
+            p = src + (size_t)y * stride + (size_t)b * scale * 4;
+            for (x = 0; x < scale * 4; x += 4) {
+                for (c = 0; c < 4; c++)
+                    sum[c] += p[x + c];
+            }
+        }
+        for (c = 0; c < 4; c++)
+            dst[b * 4 + c] = (BYTE)((sum[c] + (1U << (shift - 1))) >> shift);
+    }
+}
+
+#ifdef FAPI_X86
+/**
+ * Four pixels per load widened to 16-bit lanes. At scale 16 a lane
+ * adds up at most 256 bytes, so the sums stay below 65536.
+ */
+static void box_row_sse2(const BYTE* src, int stride, int scale, int shift, int blocks, BYTE* dst) {
+    int b;
+    int x;
+    int y;
+    UINT32 pixel;
+    __m128i v;
+    __m128i acc;
+    const BYTE* p;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16((short)(1 << (shift - 1)));
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    for (b = 0; b < blocks; b++) {
+        acc = zero;
+        for (y = 0; y < scale; y++) {
+            p = src + (size_t)y * stride + (size_t)b * scale * 4;
+            for (x = 0; x < scale; x += 4) {
+                v = _mm_loadu_si128((const __m128i*)(p + x * 4));
+                acc = _mm_add_epi16(acc, _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)));
+            }
+        }
+        acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+        acc = _mm_srl_epi16(_mm_add_epi16(acc, half), count);
+        pixel = (UINT32)_mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+        memcpy(dst + b * 4, &pixel, 4);
+    }
+}
+#endif
+
+/**
+ * Widest kernel the CPU supports, picked once.
+ */
+static box_row_fn box_kernel(void) {
+    static box_row_fn kernel = NULL;
+    if (kernel != NULL)
+        return kernel;
+#ifdef FAPI_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernel = box_row_sse2;
+    else
+#endif
+        kernel = box_row_scalar;
+    return kernel;
+}
+
+/**
+ * First thumbnail column or row of hash cell `cell` out of `size`.
+ */
+static int cell_start(int cell, int size) {
+    return (cell * size + HASH_GRID - 1) / HASH_GRID;
+}
+
+/**
+ * Recompute the luminance sums of cells cx0..cx1, cy0..cy1
+ * and the hash bits from all cell means.
+ */
+static void thumbnail_hash(struct thumbnail* t, int cx0, int cy0, int cx1, int cy1) {
+    int cx;
+    int cy;
+    int x;
+    int y;
+    int cells;
+    UINT32 sum;
+    UINT32 mean[HASH_GRID * HASH_GRID];
+    UINT64 total = 0;
+    UINT64 hash = 0;
+    const BYTE* p;
+    for (cy = cy0; cy <= cy1; cy++) {
+        for (cx = cx0; cx <= cx1; cx++) {
+            sum = 0;
+            for (y = cell_start(cy, t->height); y < cell_start(cy + 1, t->height); y++) {
+                p = t->pixels + ((size_t)y * t->width + cell_start(cx, t->width)) * 4;
+                for (x = cell_start(cx, t->width); x < cell_start(cx + 1, t->width); x++, p += 4)
+                    sum += (29 * p[0] + 150 * p[1] + 77 * p[2]) >> 8;
+            }
+            t->sums[cy * HASH_GRID + cx] = sum;
+        }
+    }
+    for (cy = 0; cy < HASH_GRID; cy++) {
+        for (cx = 0; cx < HASH_GRID; cx++) {
+            cells = (cell_start(cx + 1, t->width) - cell_start(cx, t->width)) *
+                    (cell_start(cy + 1, t->height) - cell_start(cy, t->height));
+            mean[cy * HASH_GRID + cx] = t->sums[cy * HASH_GRID + cx] / cells;
+            total += mean[cy * HASH_GRID + cx];
+        }
+    }
+    for (cx = 0; cx < HASH_GRID * HASH_GRID; cx++) {
+        if ((UINT64)mean[cx] * HASH_GRID * HASH_GRID > total)
+            hash |= 1ULL << cx;
+    }
+    t->hash = hash;
+}
+
+/**
+ * Refilter the blocks under `rects` and rehash their cells.
+ * Paint or fb_lock held.
+ */
+static void thumbnail_update(Context* ctx, struct thumbnail* t, const rect_t* rects, int count) {
+    int i;
+    int by;
+    int bx0;
+    int by0;
+    int bx1;
+    int by1;
+    int cx0 = HASH_GRID;
+    int cy0 = HASH_GRID;
+    int cx1 = -1;
+    int cy1 = -1;
+    rdpGdi* gdi = ctx->_p.gdi;
+    int stride = gdi->width * 4;
+    box_row_fn kernel = box_kernel();
+    for (i = 0; i < count; i++) {
+        bx0 = rects[i].x / t->scale;
+        by0 = rects[i].y / t->scale;
+        bx1 = (rects[i].x + rects[i].width + t->scale - 1) / t->scale;
+        by1 = (rects[i].y + rects[i].height + t->scale - 1) / t->scale;
+        /* partial blocks at the right and bottom edges are left out */
+        if (bx1 > t->width)
+            bx1 = t->width;
+        if (by1 > t->height)
+            by1 = t->height;
+        if (bx0 >= bx1 || by0 >= by1)
+            continue;
+        for (by = by0; by < by1; by++)
+            kernel(gdi->primary_buffer + (size_t)by * t->scale * stride + (size_t)bx0 * t->scale * 4, stride,
+                   t->scale, t->shift, bx1 - bx0, t->pixels + ((size_t)by * t->width + bx0) * 4);
+        if (bx0 * HASH_GRID / t->width < cx0)
+            cx0 = bx0 * HASH_GRID / t->width;
+        if (by0 * HASH_GRID / t->height < cy0)
+            cy0 = by0 * HASH_GRID / t->height;
+        if ((bx1 - 1) * HASH_GRID / t->width > cx1)
+            cx1 = (bx1 - 1) * HASH_GRID / t->width;
+        if ((by1 - 1) * HASH_GRID / t->height > cy1)
+            cy1 = (by1 - 1) * HASH_GRID / t->height;
+    }
+    if (cx1 >= 0)
+        thumbnail_hash(t, cx0, cy0, cx1, cy1);
+}
+
+/**
+ * Keep the thumbnail in step with a paint's dirty rectangles.
+ */
+void fapi_thumbnail_paint(Context* ctx, const rect_t* rects, int count) {
+    if (ctx->thumbnail != NULL)
+        thumbnail_update(ctx, ctx->thumbnail, rects, count);
+}
+
+void fapi_thumbnail_free(Context* ctx) {
+    if (ctx->thumbnail == NULL)
+        return;
+    free(ctx->thumbnail->pixels);
+    free(ctx->thumbnail);
+    ctx->thumbnail = NULL;
+}
+
+/**
+ * Build the thumbnail from the whole framebuffer under fb_lock,
+ * paints keep it current from then on. Inside lock_framebuffer()
+ * the caller's hold already keeps paints out. Once published the
+ * thumbnail stays until the session is freed, so readers load the
+ * pointer without the lock.
+ */
+int enable_thumbnail(session_t session, int scale) {
+    int status = 0;
+    BOOL held;
+    rect_t all;
+    rdpGdi* gdi;
+    struct thumbnail* t;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    if (scale != 4 && scale != 8 && scale != 16) {
+        fapi_release(context);
+        return 0;
+    }
+    held = fapi_fb_held(context);
+    if (!held)
+        pthread_mutex_lock(&context->fb_lock);
+    gdi = context->_p.gdi;
+    if (context->thumbnail != NULL) {
+        status = context->thumbnail->scale == scale;
+    } else if (gdi != NULL && gdi->primary_buffer != NULL && gdi->dstBpp == 32 &&
+               gdi->width / scale >= HASH_GRID && gdi->height / scale >= HASH_GRID) {
+        t = (struct thumbnail*)calloc(1, sizeof(struct thumbnail));
+        if (t != NULL) {
+            t->scale = scale;
+            t->shift = scale == 4 ? 4 : scale == 8 ? 6 : 8;
+            t->width = gdi->width / scale;
+            t->height = gdi->height / scale;
+            t->pixels = (BYTE*)calloc((size_t)t->width * t->height, 4);
+            if (t->pixels != NULL) {
+                all.x = 0;
+                all.y = 0;
+                all.width = gdi->width;
+                all.height = gdi->height;
+                thumbnail_update(context, t, &all, 1);
+                __atomic_store_n(&context->thumbnail, t, __ATOMIC_RELEASE);
+                status = 1;
+            } else {
+                free(t);
+            }
+        }
+    }
+    if (!held)
+        pthread_mutex_unlock(&context->fb_lock);
+    fapi_release(context);
+    return status;
+}
+
+int get_thumbnail(session_t session, thumbnail_t* thumb) {
+    struct thumbnail* t;
+    Context* context = registry_get(session);
+    if (context == NULL)
+        return 0;
+    fapi_touch(context);
+    t = __atomic_load_n(&context->thumbnail, __ATOMIC_ACQUIRE);
+    if (t != NULL) {
+        thumb->data = t->pixels;
+        thumb->width = t->width;
+        thumb->height = t->height;
+        thumb->stride = t->width * 4;
+        thumb->hash = &t->hash;
+    }
+    fapi_release(context);
+    return t != NULL;
+}
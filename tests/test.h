@@ -0,0 +1,24 @@
+#ifndef FREERDP_TEST_H
+#define FREERDP_TEST_H
+
+#include <stdio.h>
+
+/**
+ * Minimal checks for the unit tests, a failed CHECK reports
+ * and counts, TEST_DONE turns the count into the exit status.
+ */
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        test_failures++; \
+    } \
+} while (0)
+
+#define TEST_DONE() do { \
+    fprintf(stderr, "%s: %s\n", __FILE__, test_failures ? "FAILED" : "ok"); \
+    return test_failures != 0; \
+} while (0)
+
+#endif
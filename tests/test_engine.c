@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freerdp_engine.c"
+#include "test.h"
+
+#define GAP 300000000ULL
+#define RETRIES 3
+
+/**
+ * Sessions whose reconnects always fail, a fresh one that connects,
+ * and what the connectors and the worker did with each.
+ */
+static Context contexts[4];
+static freerdp instances[4];
+static int attempts[4];
+static UINT64 attempted[4][RETRIES];
+static UINT64 adopted[4];
+static UINT64 closed[4];
+
+static int index_of(Context* ctx) {
+    return (int)(ctx - contexts);
+}
+
+UINT64 fapi_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UINT64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+BOOL fapi_connect(freerdp* instance) {
+    return TRUE;
+}
+
+/**
+ * As the real one: fail, and leave another attempt due GAP later
+ * until RETRIES are used up.
+ */
+BOOL fapi_reconnect(freerdp* instance) {
+    Context* ctx = (Context*)instance->context;
+    int i = index_of(ctx);
+    if (ctx->shutdown) {
+        ctx->reconnecting = FALSE;
+        return FALSE;
+    }
+    attempted[i][attempts[i]] = fapi_now();
+    __atomic_add_fetch(&attempts[i], 1, __ATOMIC_RELEASE);
+    if (attempts[i] < RETRIES) {
+        ctx->reconnect_at = fapi_now() + GAP;
+        return FALSE;
+    }
+    ctx->reconnecting = FALSE;
+    return FALSE;
+}
+
+BOOL fapi_watch_fds(int epfd, Context* ctx) {
+    __atomic_store_n(&adopted[index_of(ctx)], fapi_now(), __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+void fapi_unwatch_fds(int epfd, Context* ctx) {}
+BOOL fapi_dispatch(Context* ctx, int ready) { return TRUE; }
+BOOL fapi_can_reconnect(Context* ctx) { return FALSE; }
+
+void fapi_close(freerdp* instance) {
+    __atomic_store_n(&closed[index_of((Context*)instance->context)], fapi_now(), __ATOMIC_RELEASE);
+}
+
+static void submit(int i, BOOL reconnecting) {
+    instances[i].context = (rdpContext*)&contexts[i];
+    contexts[i]._p.instance = &instances[i];
+    contexts[i].reconnecting = reconnecting;
+    engine_submit(&instances[i]);
+}
+
+/**
+ * Wait up to `ms` for a stamp, returns it.
+ */
+static UINT64 settle(UINT64* stamp, int ms) {
+    UINT64 value;
+    while ((value = __atomic_load_n(stamp, __ATOMIC_ACQUIRE)) == 0 && ms-- > 0)
+        usleep(1000);
+    return value;
+}
+
+/**
+ * Failing reconnects wait out their gap parked, so a connect
+ * queued behind them on the only two connectors goes through at
+ * once. Each is retried a gap apart and closed after the last.
+ */
+static void test_parked(void) {
+    int i;
+    int j;
+    UINT64 done;
+    UINT64 start = fapi_now();
+    CHECK(engine_start(1) == 1);
+    submit(0, TRUE);
+    submit(1, TRUE);
+    submit(2, FALSE);
+    done = settle(&adopted[2], 5000);
+    CHECK(done != 0 && done - start < GAP / 2);
+    for (i = 0; i < 2; i++) {
+        CHECK(settle(&closed[i], 5000) != 0);
+        CHECK(attempts[i] == RETRIES);
+        for (j = 1; j < RETRIES; j++)
+            CHECK(attempted[i][j] - attempted[i][j - 1] >= GAP);
+    }
+    pthread_mutex_lock(&g_engine.lock);
+    CHECK(g_engine.delayed == NULL);
+    pthread_mutex_unlock(&g_engine.lock);
+}
+
+/**
+ * A parked session that is stopped closes without waiting for its
+ * next attempt.
+ */
+static void test_stop(void) {
+    UINT64 done;
+    UINT64 stopped;
+    submit(3, TRUE);
+    while (__atomic_load_n(&attempts[3], __ATOMIC_ACQUIRE) == 0)
+        usleep(1000);
+    usleep(10000);
+    stopped = fapi_now();
+    contexts[3].shutdown = TRUE;
+    engine_kick();
+    done = settle(&closed[3], 5000);
+    CHECK(attempts[3] == 1);
+    CHECK(done != 0 && done - stopped < GAP / 2);
+    CHECK(__atomic_load_n(&g_engine.workers[0].sessions, __ATOMIC_RELAXED) == 1);
+}
+
+int main(void) {
+    alarm(60);
+    test_parked();
+    test_stop();
+    engine_stop();
+    TEST_DONE();
+}
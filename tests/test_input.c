@@ -0,0 +1,299 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freerdp_input.c"
+#include "test.h"
+
+#define PRODUCERS 4
+#define SUBMITS 20000
+
+/**
+ * What reached the fake server, in order.
+ */
+struct sent {
+    UINT16 type;
+    UINT16 flags;
+    UINT16 code;
+    UINT16 y;
+};
+
+static struct sent* sent;
+static int sent_count;
+static unsigned int last_emitted;
+static int emit_gaps;
+static UINT64 coalesced;
+static Context ctx;
+static freerdp instance;
+
+static void record(UINT16 type, UINT16 flags, UINT16 code, UINT16 y) {
+    sent[sent_count].type = type;
+    sent[sent_count].flags = flags;
+    sent[sent_count].code = code;
+    sent[sent_count].y = y;
+    sent_count++;
+}
+
+void freerdp_input_send_keyboard_event_ex(rdpInput* input, BOOL down, UINT32 rdp_scancode) {
+    record(INPUT_KEY, down ? KBD_FLAGS_DOWN : KBD_FLAGS_RELEASE, (UINT16)rdp_scancode, 0);
+}
+
+void freerdp_input_send_unicode_keyboard_event(rdpInput* input, UINT16 flags, UINT16 code) {
+    record(INPUT_UNICODE, flags, code, 0);
+}
+
+void freerdp_input_send_mouse_event(rdpInput* input, UINT16 flags, UINT16 x, UINT16 y) {
+    record(INPUT_MOUSE, flags, x, y);
+}
+
+void fapi_emit(Context* c, int type, unsigned int arg) {
+    if (type != EVENT_INPUT)
+        return;
+    if (arg != last_emitted + 1)
+        emit_gaps++;
+    last_emitted = arg;
+}
+
+void fapi_count(Context* c, int counter, UINT64 n) {
+    if (counter == METRIC_MOUSE_COALESCED)
+        coalesced += n;
+}
+
+UINT64 fapi_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (UINT64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+Context* registry_get(session_t session) {
+    return session == 1 ? &ctx : NULL;
+}
+
+void fapi_observe(Context* c, int histogram, UINT64 ns) {}
+void fapi_wake(Context* c) {}
+void fapi_release(Context* c) {}
+void fapi_schedule(Context* c, UINT64 due) {}
+BYTE* fapi_clipboard_encode(const char* text, UINT32* size) {
+    *size = (UINT32)strlen(text) + 1;
+    return (BYTE*)strdup(text);
+}
+
+/**
+ * Clipboard text is recorded as it is taken, the announce after it
+ * as a send with the first character of the text then offered.
+ */
+static char taken[4][16];
+static int taken_count;
+
+void fapi_clipboard_take(Context* c, const BYTE* text, UINT32 size) {
+    CHECK(size == strlen((const char*)text) + 1);
+    strcpy(taken[taken_count++], (const char*)text);
+}
+
+void fapi_clipboard_send(Context* c, int op) {
+    record(INPUT_CLIPBOARD, 0, taken_count > 0 ? (UINT16)taken[taken_count - 1][0] : 0, (UINT16)op);
+}
+
+BOOL fapi_screen_changed(Context* c, unsigned int since, const rect_t* rect) { return FALSE; }
+int fapi_find_image(Context* c, const unsigned char* pixels, int width, int height,
+                    const rect_t* rect, const unsigned int* since, double threshold, match_t* match) {
+    return 0;
+}
+
+static void reset(void) {
+    memset(&ctx, 0, sizeof(ctx));
+    ctx._p.instance = &instance;
+    fapi_input_init(&ctx);
+    sent_count = 0;
+    last_emitted = 0;
+    emit_gaps = 0;
+    coalesced = 0;
+    taken_count = 0;
+}
+
+static struct input_event unicode(UINT16 flags, UINT16 code) {
+    struct input_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = INPUT_UNICODE;
+    event.flags = flags;
+    event.code = code;
+    return event;
+}
+
+static void* producer(void* arg) {
+    int i;
+    struct input_event event;
+    for (i = 0; i < SUBMITS; i++) {
+        event = unicode((UINT16)(size_t)arg, (UINT16)i);
+        fapi_input_submit(&ctx, &event, 1);
+    }
+    return NULL;
+}
+
+/**
+ * Producers race on tickets and pushes, the loop must still send
+ * every command once, each producer's in submission order, and
+ * finish tickets without gaps.
+ */
+static void test_producers(void) {
+    int i;
+    int next[PRODUCERS];
+    unsigned int done;
+    unsigned int seen = 0;
+    pthread_t threads[PRODUCERS];
+    reset();
+    sent = (struct sent*)malloc(PRODUCERS * SUBMITS * sizeof(struct sent));
+    for (i = 0; i < PRODUCERS; i++)
+        pthread_create(&threads[i], NULL, producer, (void*)(size_t)i);
+    while (seen < PRODUCERS * SUBMITS) {
+        fapi_input_service(&ctx);
+        done = __atomic_load_n(&ctx.input_done, __ATOMIC_SEQ_CST);
+        CHECK(done >= seen);
+        seen = done;
+        sched_yield();
+    }
+    for (i = 0; i < PRODUCERS; i++)
+        pthread_join(threads[i], NULL);
+    CHECK(sent_count == PRODUCERS * SUBMITS);
+    CHECK(emit_gaps == 0);
+    CHECK(last_emitted == PRODUCERS * SUBMITS);
+    CHECK(ctx.stash == NULL);
+    memset(next, 0, sizeof(next));
+    for (i = 0; i < sent_count; i++) {
+        CHECK(sent[i].code == next[sent[i].flags]);
+        next[sent[i].flags] = sent[i].code + 1;
+    }
+    fapi_input_free(&ctx);
+    free(sent);
+}
+
+/**
+ * Commands pushed out of ticket order come out in order, the
+ * early ones held in the stash until the gap fills.
+ */
+static void test_stash(void) {
+    int i;
+    unsigned int order[] = { 3, 2, 6, 5, 1, 4 };
+    struct command cmds[6];
+    struct command* cmd;
+    reset();
+    for (i = 0; i < 6; i++) {
+        memset(&cmds[i], 0, sizeof(cmds[i]));
+        cmds[i].ticket = order[i];
+    }
+    for (i = 0; i < 4; i++)
+        queue_push(&ctx, &cmds[i]);
+    CHECK(input_next(&ctx) == NULL);
+    CHECK(ctx.stash != NULL && ctx.stash->ticket == 2);
+    CHECK(ctx.stash_tail != NULL && ctx.stash_tail->ticket == 6);
+    queue_push(&ctx, &cmds[4]);
+    queue_push(&ctx, &cmds[5]);
+    for (i = 1; i <= 6; i++) {
+        cmd = input_next(&ctx);
+        CHECK(cmd != NULL && cmd->ticket == (unsigned int)i);
+        ctx.input_done = i;
+    }
+    CHECK(input_next(&ctx) == NULL);
+    CHECK(ctx.stash == NULL && ctx.stash_tail == NULL);
+    fapi_input_free(&ctx);
+}
+
+static void* servicer(void* arg) {
+    usleep(20000);
+    fapi_input_service(&ctx);
+    return NULL;
+}
+
+/**
+ * wait_input answers from input_done, ticket 0 is the latest, and
+ * a waiter is woken by the command finishing.
+ */
+static void test_wait(void) {
+    unsigned int first;
+    unsigned int second;
+    pthread_t thread;
+    struct sent buffer[4];
+    struct input_event event = unicode(0, 'a');
+    reset();
+    sent = buffer;
+    CHECK(wait_input(2, 0, 0) == 0);
+    CHECK(wait_input(1, 0, 0) == 1);
+    first = fapi_input_submit(&ctx, &event, 1);
+    second = fapi_input_submit(&ctx, &event, 1);
+    CHECK(first == 1 && second == 2);
+    CHECK(wait_input(1, first, 0) == 0);
+    CHECK(wait_input(1, 0, 10) == 0);
+    pthread_create(&thread, NULL, servicer, NULL);
+    CHECK(wait_input(1, 0, -1) == 1);
+    pthread_join(thread, NULL);
+    CHECK(wait_input(1, first, 0) == 1);
+    CHECK(sent_count == 2);
+    fapi_input_free(&ctx);
+}
+
+/**
+ * Back-to-back moves collapse into the last one, flushed before
+ * the next other event or at the end of a service pass.
+ */
+static void test_moves(void) {
+    int i;
+    struct sent buffer[8];
+    struct input_event events[4];
+    reset();
+    sent = buffer;
+    for (i = 0; i < 3; i++) {
+        memset(&events[i], 0, sizeof(events[i]));
+        events[i].type = INPUT_MOUSE;
+        events[i].flags = PTR_FLAGS_MOVE;
+        events[i].code = (UINT16)(10 * i);
+        events[i].y = (UINT16)(20 * i);
+    }
+    events[3] = unicode(0, 'x');
+    fapi_input_submit(&ctx, events, 4);
+    fapi_input_submit(&ctx, events, 3);
+    fapi_input_service(&ctx);
+    CHECK(sent_count == 3);
+    CHECK(sent[0].type == INPUT_MOUSE && sent[0].code == 20 && sent[0].y == 40);
+    CHECK(sent[1].type == INPUT_UNICODE && sent[1].code == 'x');
+    CHECK(sent[2].type == INPUT_MOUSE && sent[2].code == 20 && sent[2].y == 40);
+    CHECK(coalesced == 4);
+    CHECK(!ctx.move_pending);
+    fapi_input_free(&ctx);
+}
+
+/**
+ * Queued pastes each offer their own text when their turn comes,
+ * before the Ctrl+V that pastes it.
+ */
+static void test_paste(void) {
+    struct sent buffer[16];
+    reset();
+    sent = buffer;
+    CHECK(paste_text(1, "first") == 1);
+    CHECK(fapi_clipboard_submit(&ctx, "second") == 2);
+    CHECK(paste_text(1, "third") == 3);
+    CHECK(taken_count == 0);
+    fapi_input_service(&ctx);
+    while (ctx.current != NULL) {
+        usleep(1000);
+        fapi_input_service(&ctx);
+    }
+    CHECK(taken_count == 3);
+    CHECK(strcmp(taken[0], "first") == 0);
+    CHECK(strcmp(taken[1], "second") == 0);
+    CHECK(strcmp(taken[2], "third") == 0);
+    CHECK(sent_count == 11);
+    CHECK(sent[0].type == INPUT_CLIPBOARD && sent[0].code == 'f' && sent[0].y == CLIP_ANNOUNCE);
+    CHECK(sent[1].type == INPUT_KEY && sent[1].code == RDP_SCANCODE_LCONTROL);
+    CHECK(sent[5].type == INPUT_CLIPBOARD && sent[5].code == 's');
+    CHECK(sent[6].type == INPUT_CLIPBOARD && sent[6].code == 't');
+    fapi_input_free(&ctx);
+}
+
+int main(void) {
+    test_stash();
+    test_moves();
+    test_wait();
+    test_paste();
+    test_producers();
+    TEST_DONE();
+}
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freerdp_macro_py.c"
+#include "freerdp_input.c"
+#include "test.h"
+
+/*
+ * The encoder runs in an embedded interpreter, its programs go
+ * through the decoder the session loop uses.
+ */
+
+void fapi_emit(Context* c, int type, unsigned int arg) {}
+void fapi_count(Context* c, int counter, UINT64 n) {}
+void fapi_observe(Context* c, int histogram, UINT64 ns) {}
+void fapi_wake(Context* c) {}
+void fapi_release(Context* c) {}
+void fapi_schedule(Context* c, UINT64 due) {}
+void fapi_clipboard_take(Context* c, const BYTE* text, UINT32 size) {}
+void fapi_clipboard_send(Context* c, int op) {}
+BYTE* fapi_clipboard_encode(const char* text, UINT32* size) { return NULL; }
+Context* registry_get(session_t session) { return NULL; }
+UINT64 fapi_now(void) { return 0; }
+BOOL fapi_screen_changed(Context* c, unsigned int since, const rect_t* rect) { return FALSE; }
+int fapi_find_image(Context* c, const unsigned char* pixels, int width, int height,
+                    const rect_t* rect, const unsigned int* since, double threshold, match_t* match) {
+    return 0;
+}
+void freerdp_input_send_keyboard_event_ex(rdpInput* input, BOOL down, UINT32 rdp_scancode) {}
+void freerdp_input_send_unicode_keyboard_event(rdpInput* input, UINT16 flags, UINT16 code) {}
+void freerdp_input_send_mouse_event(rdpInput* input, UINT16 flags, UINT16 x, UINT16 y) {}
+
+/**
+ * Compile the steps given as a Python expression, NULL with the
+ * exception cleared if they are rejected.
+ */
+static PyObject* compile(const char* steps) {
+    PyObject* program = NULL;
+    PyObject* globals = PyDict_New();
+    PyObject* value = PyRun_String(steps, Py_eval_input, globals, globals);
+    CHECK(value != NULL);
+    if (value != NULL)
+        program = FreeRDP_compile_macro(NULL, value);
+    if (program == NULL)
+        PyErr_Clear();
+    Py_XDECREF(value);
+    Py_DECREF(globals);
+    return program;
+}
+
+static int decode(PyObject* program, struct input_builder* b, struct input_data* d, Py_ssize_t length) {
+    return macro_decode(b, d, (const BYTE*)PyBytes_AS_STRING(program), (int)length);
+}
+
+static void test_round_trip(void) {
+    static const Py_ssize_t boundaries[9] = { 0, 3, 6, 18, 23, 29, 34, 55, 76 };
+    int i;
+    int found;
+    int steps;
+    Py_ssize_t length;
+    struct macro_wait* wait;
+    struct input_builder b = { NULL, 0, 0 };
+    struct input_data d = { NULL, 0, 0 };
+    PyObject* program = compile("[('key_down', 0x15B), ('key_up', 0x15B), ('text', 'h\\u00e9', 0.01),"
+                                " ('move', 10, 20), ('click', 5, 6, 2), ('delay', 0.5),"
+                                " ('wait_change', (1, 2, 3, 4), 2.5), ('wait_change',),"
+                                " ('wait_image', bytes(range(24)), 2, None, 0.02, None)]");
+    CHECK(program != NULL);
+    if (program == NULL)
+        return;
+    length = PyBytes_GET_SIZE(program);
+    /* opcode and little-endian u16 of the extended key */
+    CHECK(memcmp(PyBytes_AS_STRING(program), "\x01\x5b\x01\x02\x5b\x01", 6) == 0);
+    steps = decode(program, &b, &d, length);
+    CHECK(steps == 9);
+    CHECK(b.events[0].type == INPUT_KEY && b.events[0].code == 0x15B && b.events[0].flags == KBD_FLAGS_DOWN);
+    CHECK(b.events[1].type == INPUT_KEY && b.events[1].code == 0x15B && b.events[1].flags == KBD_FLAGS_RELEASE);
+    CHECK(b.events[2].type == INPUT_KEY && b.events[2].code == RDP_SCANCODE_KEY_H);
+    found = 0;
+    for (i = 0; i < b.count; i++) {
+        if (b.events[i].type == INPUT_UNICODE && b.events[i].code == 0xE9)
+            found++;
+        if (b.events[i].type == INPUT_MOUSE && b.events[i].flags == PTR_FLAGS_MOVE)
+            CHECK(b.events[i].code == 10 && b.events[i].y == 20);
+        if (b.events[i].type == INPUT_MOUSE && b.events[i].flags == (PTR_FLAGS_BUTTON2 | PTR_FLAGS_DOWN))
+            CHECK(b.events[i].code == 5 && b.events[i].y == 6 && b.events[i + 1].flags == PTR_FLAGS_BUTTON2);
+        if (b.events[i].type == INPUT_DELAY)
+            CHECK(b.events[i].delay == 500000);
+    }
+    CHECK(found == 2);
+    CHECK(b.events[b.count - 3].type == INPUT_WAIT);
+    wait = (struct macro_wait*)(d.bytes + b.events[b.count - 3].arg);
+    CHECK(wait->step == 6 && wait->timeout == 2500 && !wait->anywhere);
+    CHECK(wait->area.x == 1 && wait->area.y == 2 && wait->area.width == 3 && wait->area.height == 4);
+    wait = (struct macro_wait*)(d.bytes + b.events[b.count - 2].arg);
+    CHECK(wait->step == 7 && wait->anywhere && wait->timeout == 0xFFFFFFFF && wait->width == 0);
+    wait = (struct macro_wait*)(d.bytes + b.events[b.count - 1].arg);
+    CHECK(wait->step == 8 && wait->width == 2 && wait->height == 3 && wait->anywhere);
+    CHECK(wait->threshold > 0.0199 && wait->threshold < 0.0201);
+    CHECK(((BYTE*)(wait + 1))[23] == 23);
+    CHECK(b.events[b.count - 1].arg % 8 == 0);
+    /* a program cut inside a step is rejected, one cut at a step boundary is not */
+    CHECK(PyBytes_GET_SIZE(program) == 129);
+    for (length = 0; length < PyBytes_GET_SIZE(program); length++) {
+        b.count = 0;
+        d.size = 0;
+        steps = decode(program, &b, &d, length);
+        for (i = 0; i < 9 && boundaries[i] != length; i++)
+            ;
+        CHECK((steps == -1) == (i == 9));
+        CHECK(i == 9 || steps == i);
+    }
+    free(b.events);
+    free(d.bytes);
+    Py_DECREF(program);
+}
+
+static void test_rejects(void) {
+    PyObject* program;
+    CHECK(compile("[('key_down', 0x5B00)]") == NULL);
+    CHECK(compile("[('key_up', 0)]") == NULL);
+    CHECK(compile("[('click', 1, 2, 4)]") == NULL);
+    CHECK(compile("[('jump', 1)]") == NULL);
+    CHECK(compile("[['key_down', 1]]") == NULL);
+    CHECK(compile("[('wait_image', bytes(20), 2)]") == NULL);
+    program = compile("[]");
+    CHECK(program != NULL && PyBytes_GET_SIZE(program) == 0);
+    Py_XDECREF(program);
+}
+
+int main(void) {
+    Py_Initialize();
+    test_round_trip();
+    test_rejects();
+    Py_Finalize();
+    TEST_DONE();
+}
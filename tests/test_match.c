@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freerdp_match.c"
+#include "test.h"
+
+static void fill(BYTE* p, size_t size) {
+    size_t i;
+    for (i = 0; i < size; i++)
+        p[i] = (BYTE)rand();
+}
+
+static void test_kernels(void) {
+    int n;
+    int offset;
+    BYTE a[4 * 80 + 4];
+    BYTE b[4 * 80 + 4];
+    fill(a, sizeof(a));
+    fill(b, sizeof(b));
+    /* every tail length and misalignment, alpha bytes differ too */
+    for (offset = 0; offset < 4; offset++) {
+        for (n = 0; n <= 80 - offset; n++) {
+#ifdef FAPI_X86
+            CHECK(sad_row_sse2(a + offset * 4, b, n) == sad_row_scalar(a + offset * 4, b, n));
+            if (__builtin_cpu_supports("avx2"))
+                CHECK(sad_row_avx2(a + offset * 4, b, n) == sad_row_scalar(a + offset * 4, b, n));
+#endif
+        }
+    }
+    /* alpha is ignored, colour bytes count in full */
+    memset(a, 0, 8);
+    memset(b, 0, 8);
+    a[3] = 0xFF;
+    a[4] = 10;
+    b[6] = 255;
+    CHECK(sad_row_scalar(a, b, 2) == 265);
+    CHECK(match_kernel()(a, b, 2) == 265);
+}
+
+/**
+ * Copy of the w x h block of `frame` at x, y.
+ */
+static BYTE* cut(const BYTE* frame, int stride, int x, int y, int w, int h) {
+    int row;
+    BYTE* tpl = (BYTE*)malloc((size_t)w * h * 4);
+    for (row = 0; row < h; row++)
+        memcpy(tpl + (size_t)row * w * 4, frame + (size_t)(y + row) * stride + (size_t)x * 4, (size_t)w * 4);
+    return tpl;
+}
+
+static void test_search(void) {
+    int i;
+    int width = 200;
+    int height = 120;
+    int stride = width * 4;
+    int tw = 23;
+    int th = 11;
+    unsigned long best_sad;
+    rect_t area;
+    match_t best;
+    BYTE* frame = (BYTE*)malloc((size_t)stride * height);
+    BYTE* tpl;
+    fill(frame, (size_t)stride * height);
+    tpl = cut(frame, stride, 131, 77, tw, th);
+    for (i = 0; i < tw * th; i++)
+        tpl[i * 4 + 3] ^= 0xFF;
+    area.x = 0;
+    area.y = 0;
+    area.width = width - tw + 1;
+    area.height = height - th + 1;
+
+    /* exact match despite different alpha */
+    best.x = -1;
+    best_sad = 0;
+    CHECK(match_search(frame, stride, tpl, tw, th, area, &best_sad, &best));
+    CHECK(best.x == 131 && best.y == 77 && best_sad == 0);
+
+    /* a near match within the threshold, none without one */
+    tpl[0] ^= 0x04;
+    best.x = -1;
+    best_sad = 10;
+    CHECK(match_search(frame, stride, tpl, tw, th, area, &best_sad, &best));
+    CHECK(best.x == 131 && best.y == 77 && best_sad == 4);
+    best.x = -1;
+    best_sad = 3;
+    CHECK(!match_search(frame, stride, tpl, tw, th, area, &best_sad, &best));
+    CHECK(best.x == -1);
+
+    /* positions outside `area` are not considered */
+    area.x = 0;
+    area.width = 131;
+    best.x = -1;
+    best_sad = 10;
+    CHECK(!match_search(frame, stride, tpl, tw, th, area, &best_sad, &best));
+    free(tpl);
+
+    /* the first of equal matches wins */
+    memset(frame, 0x55, (size_t)stride * height);
+    tpl = cut(frame, stride, 0, 0, tw, th);
+    area.x = 5;
+    area.y = 7;
+    area.width = 50;
+    area.height = 50;
+    best.x = -1;
+    best_sad = 0;
+    CHECK(match_search(frame, stride, tpl, tw, th, area, &best_sad, &best));
+    CHECK(best.x == 5 && best.y == 7);
+    free(tpl);
+    free(frame);
+}
+
+int main(void) {
+    srand(3);
+    test_kernels();
+    test_search();
+    TEST_DONE();
+}
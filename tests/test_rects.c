@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freerdp_rects.c"
+#include "test.h"
+
+#define MAX 16
+
+static BOOL covers(const rect_t* rects, int count, int x, int y) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (x >= rects[i].x && x < rects[i].x + rects[i].width &&
+                y >= rects[i].y && y < rects[i].y + rects[i].height)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static rect_t rect(int x, int y, int width, int height) {
+    rect_t r;
+    r.x = x;
+    r.y = y;
+    r.width = width;
+    r.height = height;
+    return r;
+}
+
+static void test_merge(void) {
+    int count = 0;
+    rect_t rects[MAX];
+    /* overlapping rectangles whose union costs nothing extra merge */
+    dirty_add(rects, &count, MAX, rect(0, 0, 10, 10));
+    dirty_add(rects, &count, MAX, rect(10, 0, 10, 10));
+    CHECK(count == 1);
+    CHECK(rects[0].x == 0 && rects[0].y == 0 && rects[0].width == 20 && rects[0].height == 10);
+    /* contained rectangles are absorbed */
+    dirty_add(rects, &count, MAX, rect(2, 2, 3, 3));
+    CHECK(count == 1 && rects[0].width == 20);
+    /* far apart ones stay separate */
+    dirty_add(rects, &count, MAX, rect(500, 500, 10, 10));
+    CHECK(count == 2);
+    /* empty rectangles are ignored */
+    dirty_add(rects, &count, MAX, rect(50, 50, 0, 10));
+    dirty_add(rects, &count, MAX, rect(50, 50, 10, -1));
+    CHECK(count == 2);
+}
+
+static void test_chain(void) {
+    int count = 0;
+    rect_t rects[MAX];
+    /* a bridging rectangle pulls both neighbours into one */
+    dirty_add(rects, &count, MAX, rect(0, 0, 10, 10));
+    dirty_add(rects, &count, MAX, rect(20, 0, 10, 10));
+    CHECK(count == 2);
+    dirty_add(rects, &count, MAX, rect(5, 0, 20, 10));
+    CHECK(count == 1);
+    CHECK(rects[0].x == 0 && rects[0].width == 30 && rects[0].height == 10);
+}
+
+static void test_cover(void) {
+    int i;
+    int n;
+    int x;
+    int y;
+    int count = 0;
+    rect_t in[200];
+    rect_t rects[MAX];
+    srand(7);
+    for (n = 0; n < 200; n++) {
+        in[n] = rect(rand() % 300, rand() % 200, 1 + rand() % 40, 1 + rand() % 40);
+        dirty_add(rects, &count, MAX, in[n]);
+        CHECK(count >= 1 && count <= MAX);
+    }
+    /* folding never loses a painted pixel */
+    for (i = 0; i < n; i++) {
+        for (y = in[i].y; y < in[i].y + in[i].height; y += 3) {
+            for (x = in[i].x; x < in[i].x + in[i].width; x += 3) {
+                if (!covers(rects, count, x, y)) {
+                    CHECK(covers(rects, count, x, y));
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void test_full(void) {
+    int count = 0;
+    rect_t rects[2];
+    dirty_add(rects, &count, 2, rect(0, 0, 1, 1));
+    dirty_add(rects, &count, 2, rect(100, 0, 1, 1));
+    dirty_add(rects, &count, 2, rect(0, 100, 1, 1));
+    CHECK(count == 2);
+    CHECK(covers(rects, count, 0, 0) && covers(rects, count, 100, 0) && covers(rects, count, 0, 100));
+    count = 0;
+    dirty_add(rects, &count, 0, rect(0, 0, 1, 1));
+    CHECK(count == 0);
+}
+
+static void test_clip(void) {
+    rect_t bounds = rect(0, 0, 100, 50);
+    rect_t r = rect(-10, -5, 30, 20);
+    CHECK(rect_clip(&r, &bounds));
+    CHECK(r.x == 0 && r.y == 0 && r.width == 20 && r.height == 15);
+    r = rect(90, 40, 30, 30);
+    CHECK(rect_clip(&r, &bounds));
+    CHECK(r.x == 90 && r.y == 40 && r.width == 10 && r.height == 10);
+    r = rect(100, 0, 5, 5);
+    CHECK(!rect_clip(&r, &bounds));
+}
+
+int main(void) {
+    test_merge();
+    test_chain();
+    test_cover();
+    test_full();
+    test_clip();
+    TEST_DONE();
+}
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include "freerdp_registry.c"
+#include "test.h"
+
+#define SESSIONS 3000
+
+static Context contexts[SESSIONS];
+static session_t handles[SESSIONS];
+static int stopped;
+
+void fapi_stop(Context* ctx) {
+    stopped++;
+}
+
+static void count(Context* ctx, void* arg) {
+    (*(int*)arg)++;
+}
+
+/**
+ * Handles stay valid across chunk growth and take a reference
+ * on lookup, bogus ones find nothing.
+ */
+static void test_add(void) {
+    int i;
+    int live = 0;
+    for (i = 0; i < SESSIONS; i++) {
+        contexts[i].refs = 1;
+        handles[i] = registry_add(&contexts[i]);
+        CHECK(handles[i] != 0);
+        CHECK(contexts[i].session == handles[i]);
+    }
+    CHECK(g_registry.capacity == 3 * REGISTRY_CHUNK);
+    for (i = 0; i < SESSIONS; i += 97) {
+        CHECK(registry_get(handles[i]) == &contexts[i]);
+        CHECK(contexts[i].refs == 2);
+        contexts[i].refs = 1;
+    }
+    CHECK(registry_get(0) == NULL);
+    CHECK(registry_get(((session_t)1 << 32) | g_registry.capacity) == NULL);
+    CHECK(registry_get(handles[5] + ((session_t)1 << 32)) == NULL);
+    registry_each(count, &live);
+    CHECK(live == SESSIONS);
+    registry_stop_all();
+    CHECK(stopped == SESSIONS);
+}
+
+/**
+ * Removal makes every copy of a handle stale, the slot comes back
+ * with a new generation.
+ */
+static void test_generations(void) {
+    int live = 0;
+    session_t stale = handles[1500];
+    session_t fresh;
+    struct slot* slot;
+    CHECK(registry_remove(stale) == &contexts[1500]);
+    CHECK(registry_get(stale) == NULL);
+    CHECK(registry_remove(stale) == NULL);
+    registry_each(count, &live);
+    CHECK(live == SESSIONS - 1);
+    fresh = registry_add(&contexts[1500]);
+    CHECK((UINT32)fresh == (UINT32)stale);
+    CHECK((fresh >> 32) == (stale >> 32) + 1);
+    CHECK(registry_get(stale) == NULL);
+    CHECK(registry_get(fresh) == &contexts[1500]);
+    /* the generation wraps past 0, which no handle may carry */
+    slot = registry_slot((UINT32)fresh);
+    slot->generation = 0xFFFFFFFF;
+    fresh = ((session_t)0xFFFFFFFF << 32) | (UINT32)fresh;
+    CHECK(registry_remove(fresh) == &contexts[1500]);
+    CHECK(slot->generation == 1);
+    fresh = registry_add(&contexts[1500]);
+    CHECK((fresh >> 32) == 1);
+    CHECK(registry_get(fresh) == &contexts[1500]);
+}
+
+/**
+ * Freed slots are reused before the table grows.
+ */
+static void test_reuse(void) {
+    int i;
+    UINT32 capacity;
+    for (i = 0; i < SESSIONS; i++)
+        registry_remove(contexts[i].session);
+    capacity = g_registry.capacity;
+    for (i = 0; i < SESSIONS; i++)
+        CHECK(registry_add(&contexts[i]) != 0);
+    CHECK(g_registry.capacity == capacity);
+    for (i = 0; i < SESSIONS; i++)
+        CHECK(registry_get(handles[i]) == NULL);
+}
+
+int main(void) {
+    test_add();
+    test_generations();
+    test_reuse();
+    TEST_DONE();
+}
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "freerdp_thumbnail.c"
+#include "test.h"
+
+#define WIDTH 390
+#define HEIGHT 275
+
+static Context ctx;
+static rdpGdi gdi;
+static BOOL held;
+
+Context* registry_get(session_t session) {
+    return session == 1 ? &ctx : NULL;
+}
+
+void fapi_release(Context* c) {}
+void fapi_touch(Context* c) {}
+
+BOOL fapi_fb_held(Context* c) {
+    return held;
+}
+
+static void fill(BYTE* p, size_t size) {
+    size_t i;
+    for (i = 0; i < size; i++)
+        p[i] = (BYTE)rand();
+}
+
+static void reset(BYTE* fb) {
+    fapi_thumbnail_free(&ctx);
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&gdi, 0, sizeof(gdi));
+    pthread_mutex_init(&ctx.fb_lock, NULL);
+    gdi.width = WIDTH;
+    gdi.height = HEIGHT;
+    gdi.dstBpp = 32;
+    gdi.primary_buffer = fb;
+    ctx._p.gdi = &gdi;
+    held = FALSE;
+}
+
+/**
+ * The SSE2 box filter matches the scalar one, bytes at 0 and 255
+ * included since they stress the 16-bit lanes at scale 16.
+ */
+static void test_kernels(void) {
+#ifdef FAPI_X86
+    int scale;
+    int shift;
+    int blocks;
+    int stride = 16 * 4 * 9;
+    BYTE src[16 * 4 * 9 * 16];
+    BYTE a[9 * 4];
+    BYTE b[9 * 4];
+    fill(src, sizeof(src));
+    memset(src, 255, stride * 2);
+    memset(src + stride * 2, 0, stride);
+    for (scale = 4, shift = 4; scale <= 16; scale *= 2, shift += 2) {
+        for (blocks = 1; blocks <= 9 && blocks * scale * 4 <= stride; blocks++) {
+            box_row_scalar(src, stride, scale, shift, blocks, a);
+            box_row_sse2(src, stride, scale, shift, blocks, b);
+            CHECK(memcmp(a, b, blocks * 4) == 0);
+        }
+    }
+    memset(src, 255, sizeof(src));
+    box_row_sse2(src, stride, 16, 8, 1, b);
+    CHECK(b[0] == 255 && b[3] == 255);
+#endif
+}
+
+/**
+ * Incremental refilters after random paints match a full refilter,
+ * and the incremental hash matches one over every cell.
+ */
+static void test_incremental(BYTE* fb) {
+    int i;
+    int y;
+    int scale;
+    UINT64 hash;
+    BYTE* ref;
+    rect_t r;
+    thumbnail_t thumb;
+    struct thumbnail* t;
+    for (scale = 4; scale <= 16; scale *= 2) {
+        reset(fb);
+        CHECK(enable_thumbnail(1, scale) == 1);
+        t = ctx.thumbnail;
+        CHECK(t != NULL && t->width == WIDTH / scale && t->height == HEIGHT / scale);
+        ref = (BYTE*)malloc((size_t)t->width * t->height * 4);
+        for (i = 0; i < 200; i++) {
+            r.x = rand() % WIDTH;
+            r.y = rand() % HEIGHT;
+            r.width = 1 + rand() % (i % 3 ? 40 : WIDTH - r.x);
+            r.height = 1 + rand() % (i % 3 ? 40 : HEIGHT - r.y);
+            if (r.x + r.width > WIDTH)
+                r.width = WIDTH - r.x;
+            if (r.y + r.height > HEIGHT)
+                r.height = HEIGHT - r.y;
+            for (y = r.y; y < r.y + r.height; y++)
+                memset(fb + ((size_t)y * WIDTH + r.x) * 4, rand() & 0xFF, r.width * 4);
+            fapi_thumbnail_paint(&ctx, &r, 1);
+            for (y = 0; y < t->height; y++)
+                box_row_scalar(fb + (size_t)y * scale * WIDTH * 4, WIDTH * 4, scale, t->shift, t->width,
+                               ref + (size_t)y * t->width * 4);
+            CHECK(memcmp(ref, t->pixels, (size_t)t->width * t->height * 4) == 0);
+            hash = t->hash;
+            thumbnail_hash(t, 0, 0, HASH_GRID - 1, HASH_GRID - 1);
+            CHECK(hash == t->hash);
+        }
+        CHECK(get_thumbnail(1, &thumb) == 1);
+        CHECK(thumb.data == t->pixels && thumb.stride == t->width * 4 && *thumb.hash == t->hash);
+        free(ref);
+    }
+}
+
+/**
+ * A flat screen hashes to 0, a brighter left half sets the bits of
+ * the left four columns.
+ */
+static void test_hash(BYTE* fb) {
+    int y;
+    UINT64 left = 0;
+    thumbnail_t thumb;
+    memset(fb, 0x80, (size_t)WIDTH * HEIGHT * 4);
+    reset(fb);
+    CHECK(enable_thumbnail(1, 8) == 1);
+    CHECK(get_thumbnail(1, &thumb) == 1 && *thumb.hash == 0);
+    for (y = 0; y < HEIGHT; y++)
+        memset(fb + (size_t)y * WIDTH * 4, 0xF0, WIDTH / 2 * 4);
+    for (y = 0; y < HASH_GRID; y++)
+        left |= 0x0FULL << (y * HASH_GRID);
+    reset(fb);
+    CHECK(enable_thumbnail(1, 8) == 1);
+    CHECK(get_thumbnail(1, &thumb) == 1 && *thumb.hash == left);
+}
+
+/**
+ * Bad scales and screens are refused, a second enable only agrees at
+ * the same scale, and enabling under the caller's own fb_lock hold
+ * does not take the lock again.
+ */
+static void test_enable(BYTE* fb) {
+    thumbnail_t thumb;
+    reset(fb);
+    CHECK(get_thumbnail(1, &thumb) == 0);
+    CHECK(enable_thumbnail(2, 8) == 0);
+    CHECK(enable_thumbnail(1, 3) == 0);
+    gdi.dstBpp = 16;
+    CHECK(enable_thumbnail(1, 8) == 0);
+    gdi.dstBpp = 32;
+    gdi.width = 100;
+    CHECK(enable_thumbnail(1, 16) == 0);
+    gdi.width = WIDTH;
+    CHECK(enable_thumbnail(1, 8) == 1);
+    CHECK(enable_thumbnail(1, 8) == 1);
+    CHECK(enable_thumbnail(1, 4) == 0);
+    reset(fb);
+    pthread_mutex_lock(&ctx.fb_lock);
+    held = TRUE;
+    CHECK(enable_thumbnail(1, 4) == 1);
+    CHECK(get_thumbnail(1, &thumb) == 1 && thumb.width == WIDTH / 4);
+    held = FALSE;
+    pthread_mutex_unlock(&ctx.fb_lock);
+}
+
+int main(void) {
+    BYTE* fb = (BYTE*)malloc((size_t)WIDTH * HEIGHT * 4);
+    /* a lock taken twice hangs, fail instead */
+    alarm(60);
+    fill(fb, (size_t)WIDTH * HEIGHT * 4);
+    test_kernels();
+    test_incremental(fb);
+    test_enable(fb);
+    test_hash(fb);
+    fapi_thumbnail_free(&ctx);
+    free(fb);
+    TEST_DONE();
+}